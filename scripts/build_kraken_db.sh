@@ -56,38 +56,68 @@ else
   echo "Kraken build set to minimize RAM usage."
 fi
 
+LAYOUTFLAGS=""
+if [ -n "$KRAKEN_COMPACT_KEYS" ]
+then
+  LAYOUTFLAGS="-c"
+fi
+if [ -n "$KRAKEN_SPLIT_ARRAYS" ]
+then
+  LAYOUTFLAGS="$LAYOUTFLAGS -s"
+fi
+if [ -n "$KRAKEN_EYTZINGER_BINS" ]
+then
+  LAYOUTFLAGS="$LAYOUTFLAGS -e"
+fi
+if [ -n "$KRAKEN_COMPRESS_INDEX" ]
+then
+  LAYOUTFLAGS="$LAYOUTFLAGS -x"
+fi
+FILTERFLAGS=""
+if [ -n "$KRAKEN_FILTER_BITS" ]
+then
+  FILTERFLAGS="-B database.flt -b $KRAKEN_FILTER_BITS"
+fi
+BUILDMEMFLAG=""
+if [ -n "$KRAKEN_SORT_MEMORY" ]
+then
+  BUILDMEMFLAG="-m $KRAKEN_SORT_MEMORY"
+fi
+
 if [ -n "$KRAKEN_REBUILD_DATABASE" ]
 then
   rm -f database.* *.map lca.complete
 fi
 
-if [ -e "database.jdb" ]
+if [ -e "database.jdb" ] || [ -e "database.kdb" ]
 then
   echo "Skipping step 1, k-mer set already exists."
+elif [ -z "$KRAKEN_MAX_DB_SIZE" ]
+then
+  echo "Creating sorted k-mer set (steps 1 and 3 of 6)..."
+  start_time1=$(date "+%s.%N")
+
+  find library/ -name '*.fna' -print0 | \
+    xargs -0 cat | \
+    build_kmer_set -k $KRAKEN_KMER_LEN -n $KRAKEN_MINIMIZER_LEN \
+      -t $KRAKEN_THREAD_CT $BUILDMEMFLAG $LAYOUTFLAGS $FILTERFLAGS \
+      -o database.kdb.tmp -i database.idx /dev/fd/0
+
+  # Once here, DB is sorted, can put file in proper place.
+  mv database.kdb.tmp database.kdb
+
+  echo "Sorted k-mer set created. [$(report_time_elapsed $start_time1)]"
 else
   echo "Creating k-mer set (step 1 of 6)..."
   start_time1=$(date "+%s.%N")
 
-  check_for_jellyfish.sh
-  # Estimate hash size as 1.25 * estimated k-mer count
-  if [ -z "$KRAKEN_HASH_SIZE" ]
-  then
-    KRAKEN_HASH_SIZE=$(find library/ -name '*.fna' -print0 | xargs -0 cat | kmer_estimator -m 1.25 -t $KRAKEN_THREAD_CT -k $KRAKEN_KMER_LEN)
-    echo "Hash size not specified, using '$KRAKEN_HASH_SIZE'"
-  fi
-
+  # Plain layout, so step 2 can shrink it before it's sorted again
   find library/ -name '*.fna' -print0 | \
     xargs -0 cat | \
-    jellyfish count -m $KRAKEN_KMER_LEN -s $KRAKEN_HASH_SIZE -C -t $KRAKEN_THREAD_CT \
-      -o database /dev/fd/0
-
-  # Merge only if necessary
-  if [ -e "database_1" ]
-  then
-    jellyfish merge -o database.jdb.tmp database_*
-  else
-    mv database_0 database.jdb.tmp
-  fi
+    build_kmer_set -k $KRAKEN_KMER_LEN -n $KRAKEN_MINIMIZER_LEN \
+      -t $KRAKEN_THREAD_CT $BUILDMEMFLAG \
+      -o database.jdb.tmp -i database.jdb.idx /dev/fd/0
+  rm database.jdb.idx
 
   # Once here, DB is finalized, can put file in place.
   mv database.jdb.tmp database.jdb
@@ -105,7 +135,13 @@ else
   else
     start_time1=$(date "+%s.%N")
     kdb_size=$(stat -c '%s' database.jdb)
-    idx_size=$(echo "8 * (4 ^ $KRAKEN_MINIMIZER_LEN + 2)" | bc)
+    if [ -n "$KRAKEN_COMPRESS_INDEX" ]
+    then
+      # Estimate; doesn't count blocks w/ offsets in overflow table
+      idx_size=$(echo "2 * (4 ^ $KRAKEN_MINIMIZER_LEN + 64)" | bc)
+    else
+      idx_size=$(echo "8 * (4 ^ $KRAKEN_MINIMIZER_LEN + 2)" | bc)
+    fi
     resize_needed=$(echo "scale = 10; ($kdb_size+$idx_size)/(2^30) > $KRAKEN_MAX_DB_SIZE" | bc)
     if (( resize_needed == 0 ))
     then
@@ -144,7 +180,12 @@ then
 else
   echo "Sorting k-mer set (step 3 of 6)..."
   start_time1=$(date "+%s.%N")
-  db_sort -z $MEMFLAG -t $KRAKEN_THREAD_CT -n $KRAKEN_MINIMIZER_LEN \
+  SORTMEMFLAG=$MEMFLAG
+  if [ -n "$KRAKEN_SORT_MEMORY" ]
+  then
+    SORTMEMFLAG="-m $KRAKEN_SORT_MEMORY"
+  fi
+  db_sort -z $SORTMEMFLAG $LAYOUTFLAGS $FILTERFLAGS -t $KRAKEN_THREAD_CT -n $KRAKEN_MINIMIZER_LEN \
     -d database.jdb -o database.kdb.tmp \
     -i database.idx
 
@@ -194,13 +235,36 @@ then
 else
   echo "Setting LCAs in database (step 6 of 6)..."
   start_time1=$(date "+%s.%N")
+  # W/ DB on disk, update it in sorted batches (of 100 Mbp) so its bins
+  # are read in order
+  LCAFLAG=$MEMFLAG
+  if [ -n "$KRAKEN_WORK_ON_DISK" ]
+  then
+    LCAFLAG="-S 100"
+  fi
   find library/ '(' -name '*.fna' -o -name '*.fa' -o -name '*.ffn' ')' -print0 | \
     xargs -0 cat | \
-    set_lcas $MEMFLAG -x -d database.kdb -i database.idx \
+    set_lcas $LCAFLAG -x -d database.kdb -i database.idx \
     -n taxonomy/nodes.dmp -t $KRAKEN_THREAD_CT -m seqid2taxid.map -F /dev/fd/0
   touch "lca.complete"
 
   echo "Database LCAs set. [$(report_time_elapsed $start_time1)]"
 fi
 
+if [ -n "$KRAKEN_SHARD_CT" ]
+then
+  if [ -e "database.$(($KRAKEN_SHARD_CT - 1)).kdb" ] && \
+     [ ! -e "database.$KRAKEN_SHARD_CT.kdb" ]
+  then
+    echo "Skipping sharding, shards already exist."
+  else
+    echo "Splitting database into $KRAKEN_SHARD_CT shards..."
+    start_time1=$(date "+%s.%N")
+    rm -f database.[0-9]*.kdb database.[0-9]*.idx
+    db_shard -d database.kdb -i database.idx -o database -s $KRAKEN_SHARD_CT
+
+    echo "Database sharded. [$(report_time_elapsed $start_time1)]"
+  fi
+fi
+
 echo "Database construction complete. [Total: $(report_time_elapsed $start_time)]"
@@ -30,20 +30,24 @@ then
   WOD_FLAG="--work-on-disk"
 fi
 
+SORTMEM_FLAG=""
+if [ -n "$KRAKEN_SORT_MEMORY" ]
+then
+  SORTMEM_FLAG="--sort-memory $KRAKEN_SORT_MEMORY"
+fi
+
 WGET_FLAG=""
 if [ -n "$KRAKEN_USE_WGET" ]
 then
   WGET_FLAG="--use-wget"
 fi
 
-check_for_jellyfish.sh
 kraken-build --db $KRAKEN_DB_NAME --download-taxonomy
 kraken-build --db $KRAKEN_DB_NAME --download-library archaea $WGET_FLAG
 kraken-build --db $KRAKEN_DB_NAME --download-library bacteria $WGET_FLAG
 kraken-build --db $KRAKEN_DB_NAME --download-library viral $WGET_FLAG
 kraken-build --db $KRAKEN_DB_NAME --build --threads $KRAKEN_THREAD_CT \
-               --jellyfish-hash-size "$KRAKEN_HASH_SIZE" \
                --max-db-size "$KRAKEN_MAX_DB_SIZE" \
                --minimizer-len $KRAKEN_MINIMIZER_LEN \
                --kmer-len $KRAKEN_KMER_LEN \
-               $WOD_FLAG
+               $WOD_FLAG $SORTMEM_FLAG
@@ -48,10 +48,14 @@ fi
 cd "$DATABASE_DIR"
 
 MEMFLAG=""
-if [ -n "$KRAKEN_WORK_ON_DISK" ]
+if [ -z "$KRAKEN_WORK_ON_DISK" ]
 then
   MEMFLAG="-M"
 fi
+if [ -n "$KRAKEN_SORT_MEMORY" ]
+then
+  MEMFLAG="-m $KRAKEN_SORT_MEMORY"
+fi
 
 if [ -e "old_database.kdb" ]
 then
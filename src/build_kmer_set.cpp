@@ -0,0 +1,691 @@
+/*
+ * Copyright 2013-2019, Derrick Wood, Jennifer Lu <jlu26@jhmi.edu>
+ *
+ * This file is part of the Kraken taxonomic sequence classification system.
+ *
+ * Kraken is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Kraken is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kraken.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Builds a DB's sorted k-mer set & index straight from library
+// sequences, in place of jellyfish count & db_sort.  Canonical k-mers
+// are scanned in parallel and partitioned by bin key into buckets,
+// each a contiguous range of bins.  A bucket collects its k-mers in
+// memory and spills them to disk as sorted, deduplicated runs, which
+// are merged as they accumulate so repeats don't pile up on disk.
+// Each bucket's runs are then merged into one, and the buckets are
+// written to their places in the DB, as many at once as the memory
+// budget allows.  Values are zero, to be set by set_lcas.
+
+#include "kraken_headers.hpp"
+#include "quickfile.hpp"
+#include "krakendb.hpp"
+#include "krakenutil.hpp"
+#include "seqreader.hpp"
+
+using namespace std;
+using namespace kraken;
+
+// Bp of input read at a time, and most k-mers one thread scans at once
+// (neighboring stretches of a sequence overlap by k - 1 bp)
+const size_t READ_BATCH_SIZE = 64 << 20;
+const size_t SCAN_CHUNK_SIZE = 1 << 20;
+// K-mers each thread holds per bucket before adding them to the
+// bucket's pending run
+const size_t BUCKET_BUFFER_KMERS = 8192;
+// Most runs a bucket keeps on disk before merging them regardless of
+// their sizes, and k-mers read or written at once per run
+const size_t MAX_BUCKET_RUNS = 16;
+const size_t RUN_BUFFER_KMERS = 1 << 16;
+// Bytes of output DB written at once
+const size_t WRITE_CHUNK_SIZE = 4 << 20;
+const uint64_t DEF_MEMORY_MB = 4096;
+
+// Temporary file of sorted, distinct k-mers
+typedef struct {
+  string filename;
+  uint64_t kmer_ct;
+} Run;
+
+// K-mers in bins [first_bin, first_bin + Bins_per_bucket)
+typedef struct {
+  string filename;  // prefix of its runs' filenames
+  pthread_mutex_t lock;      // guards pending
+  pthread_mutex_t run_lock;  // guards runs & run_id
+  uint64_t first_bin;
+  vector<uint64_t> pending;  // k-mers not yet spilled to a run
+  vector<Run> runs;          // in the order they were written
+  uint64_t run_id;
+  uint64_t kmer_ct;  // after finish_bucket(), distinct k-mers
+} Bucket;
+
+// Buffered sequential reader of a run's k-mers
+typedef struct {
+  int fd;
+  const Run *run;
+  uint64_t left;  // k-mers not yet read into buffer
+  vector<uint64_t> buffer;
+  size_t next;
+} RunReader;
+
+string Output_DB_filename, Index_filename, Filter_filename, Temp_dir;
+vector<string> Input_filenames;
+double Filter_bits_per_kmer = 10;
+uint8_t Kmer_len = 0;
+uint8_t Bin_key_nt = 15;
+int Num_threads = 1;
+uint64_t Bucket_ct = 256;
+bool Compact_keys = false;
+bool Split_arrays = false;
+bool Eytzinger_bins = false;
+bool Compress_index = false;
+uint64_t Memory_budget = DEF_MEMORY_MB << 20;
+
+uint64_t Bins_per_bucket;
+uint64_t Run_kmers;  // most k-mers a bucket's pending run collects
+vector<Bucket> Buckets;
+vector<vector<vector<uint64_t> > > Thread_buffers;  // [thread][bucket]
+uint64_t Scanned_kmer_ct = 0;
+
+static void parse_command_line(int argc, char **argv);
+static void usage(int exit_code=EX_USAGE);
+static void scan_input(KrakenDB &kdb, string filename);
+static void flush_buffer(vector<uint64_t> &buffer, Bucket &bucket);
+static void spill_run(Bucket &bucket, vector<uint64_t> &kmers);
+static void write_run(Bucket &bucket, vector<uint64_t> &kmers);
+static void merge_runs(Bucket &bucket, size_t first_run, KrakenDB *kdb,
+                       uint64_t *bin_counts);
+static void finish_bucket(KrakenDB &kdb, Bucket &bucket, uint64_t *bin_counts);
+static void write_bucket(KrakenDB &kdb, KrakenDB &out_db, Bucket &bucket,
+                         const uint64_t *offsets, int out_fd,
+                         KrakenDBFilter *filter);
+static void eytzinger_order(uint64_t *keys, uint64_t key_ct);
+static uint64_t eytzinger_fill(uint64_t *dest, const uint64_t *sorted,
+                               uint64_t node, uint64_t key_ct, uint64_t next);
+static int create_run(Bucket &bucket, Run &run);
+static void open_run(RunReader &reader, const Run &run);
+static bool read_kmer(RunReader &reader, uint64_t &kmer);
+static void close_run(RunReader &reader);
+static void write_fully(int fd, const void *buf, size_t size, off_t offset,
+                        const string &filename);
+
+int main(int argc, char **argv) {
+  #ifdef _OPENMP
+  omp_set_num_threads(1);
+  #endif
+
+  parse_command_line(argc, argv);
+
+  // Jellyfish-style header, for KrakenDB's k-mer functions until the
+  // k-mer count is known
+  uint64_t key_bits = Kmer_len * 2, val_len = 4, key_ct = 0;
+  vector<char> header(72 + 2 * (4 + 8 * key_bits));
+  memcpy(header.data(), "JFLISTDN", 8);
+  memcpy(&header[8], &key_bits, 8);
+  memcpy(&header[16], &val_len, 8);
+  KrakenDB kdb(header.data());
+  if (Compact_keys && kdb.residual_key_bits(Bin_key_nt) >= key_bits)
+    errx(EX_USAGE, "compact keys would be no smaller w/ %d nt bin keys",
+         (int) Bin_key_nt);
+
+  KmerScanner::set_k(Kmer_len);
+  KmerScanner::set_minimizer(Bin_key_nt,
+                             KrakenDBIndex::bin_key_xor_mask(Bin_key_nt));
+  uint64_t entries = 1ull << (Bin_key_nt * 2);
+  Bins_per_bucket = entries / Bucket_ct;
+  Buckets.resize(Bucket_ct);
+  for (uint64_t i = 0; i < Bucket_ct; i++) {
+    Bucket &bucket = Buckets[i];
+    ostringstream name;
+    name << Temp_dir << "/"
+         << Output_DB_filename.substr(Output_DB_filename.rfind('/') + 1)
+         << ".bucket" << i;
+    bucket.filename = name.str();
+    pthread_mutex_init(&bucket.lock, NULL);
+    pthread_mutex_init(&bucket.run_lock, NULL);
+    bucket.first_bin = i * Bins_per_bucket;
+    bucket.run_id = 0;
+    bucket.kmer_ct = 0;
+  }
+
+  // Budget covers a batch of sequence, threads' buffers and merges, and
+  // a pending run per bucket plus one being spilled per thread
+  uint64_t fixed_bytes = READ_BATCH_SIZE + Num_threads * sizeof(uint64_t)
+      * (Bucket_ct * BUCKET_BUFFER_KMERS
+         + (MAX_BUCKET_RUNS + 2) * RUN_BUFFER_KMERS);
+  uint64_t run_ct = Bucket_ct + Num_threads;
+  uint64_t min_bytes = fixed_bytes
+      + run_ct * BUCKET_BUFFER_KMERS * sizeof(uint64_t);
+  if (Memory_budget < min_bytes)
+    errx(EX_USAGE, "memory budget too small (%llu MB needed w/ %llu buckets)",
+         (unsigned long long) (min_bytes >> 20) + 1,
+         (unsigned long long) Bucket_ct);
+  Run_kmers = (Memory_budget - fixed_bytes) / sizeof(uint64_t) / run_ct;
+
+  // Partition input's k-mers
+  Thread_buffers.resize(Num_threads);
+  for (int i = 0; i < Num_threads; i++)
+    Thread_buffers[i].resize(Bucket_ct);
+  for (size_t i = 0; i < Input_filenames.size(); i++)
+    scan_input(kdb, Input_filenames[i]);
+  #pragma omp parallel for schedule(dynamic)
+  for (uint64_t i = 0; i < Bucket_ct; i++)
+    for (int j = 0; j < Num_threads; j++)
+      flush_buffer(Thread_buffers[j][i], Buckets[i]);
+  Thread_buffers.clear();
+
+  // Merge each bucket's runs, counting its bins' k-mers; index is
+  // filled in place, so it needn't also be held in RAM
+  QuickFile index_file(Index_filename, "w",
+                       KrakenDBIndex::index_file_size(Bin_key_nt));
+  uint64_t *offsets = KrakenDBIndex::init_index(index_file.ptr(), Bin_key_nt);
+  #pragma omp parallel for schedule(dynamic)
+  for (uint64_t i = 0; i < Bucket_ct; i++)
+    finish_bucket(kdb, Buckets[i], offsets + 1);
+  uint64_t max_bucket_ct = 0;
+  for (uint64_t i = 0; i < Bucket_ct; i++)
+    max_bucket_ct = max(max_bucket_ct, Buckets[i].kmer_ct);
+  for (uint64_t i = 1; i <= entries; i++)
+    offsets[i] += offsets[i - 1];
+  key_ct = offsets[entries];
+  fprintf(stderr, "%llu k-mers scanned, %llu distinct\n",
+          (unsigned long long) Scanned_kmer_ct, (unsigned long long) key_ct);
+
+  memcpy(&header[48], &key_ct, 8);
+  vector<char> output_header = kdb.kraken_header(Compact_keys, Split_arrays,
+                                                 Eytzinger_bins, Bin_key_nt);
+  KrakenDB out_db(output_header.data());
+  uint64_t key_len = out_db.get_key_len();
+  uint64_t data_size = key_ct * (key_len + val_len);
+  if (Split_arrays)
+    data_size = ((key_ct * key_len + 7) & ~7ull) + key_ct * val_len;
+  int out_fd = open(Output_DB_filename.c_str(), O_RDWR | O_CREAT | O_TRUNC,
+                    0666);
+  if (out_fd < 0)
+    err(EX_CANTCREAT, "unable to create %s", Output_DB_filename.c_str());
+  if (ftruncate(out_fd, output_header.size() + data_size) < 0)
+    err(EX_IOERR, "unable to size %s", Output_DB_filename.c_str());
+  write_fully(out_fd, output_header.data(), output_header.size(), 0,
+              Output_DB_filename);
+
+  QuickFile filter_file;
+  KrakenDBFilter filter;
+  if (! Filter_filename.empty()) {
+    uint64_t block_ct = KrakenDBFilter::block_count(key_ct,
+                                                    Filter_bits_per_kmer);
+    filter_file.open_file(Filter_filename, "w",
+                          KrakenDBFilter::file_size(block_ct));
+    filter = KrakenDBFilter(filter_file.ptr(), block_ct,
+                            KrakenDBFilter::hash_count(Filter_bits_per_kmer));
+  }
+
+  // Each bucket being written holds its k-mers & its bins' next slots
+  uint64_t bucket_bytes = (max_bucket_ct + Bins_per_bucket) * sizeof(uint64_t)
+      + WRITE_CHUNK_SIZE + RUN_BUFFER_KMERS * sizeof(uint64_t);
+  int writer_ct = min((uint64_t) Num_threads, Memory_budget / bucket_bytes);
+  if (writer_ct == 0) {
+    warnx("largest bucket needs %llu MB, more than the memory budget "
+          "(use more buckets)", (unsigned long long) (bucket_bytes >> 20) + 1);
+    writer_ct = 1;
+  }
+
+  // Values (all zero) are left as ftruncate() made them
+  #pragma omp parallel for schedule(dynamic) num_threads(writer_ct)
+  for (uint64_t i = 0; i < Bucket_ct; i++)
+    write_bucket(kdb, out_db, Buckets[i], offsets, out_fd,
+                 Filter_filename.empty() ? NULL : &filter);
+  if (close(out_fd) < 0)
+    err(EX_IOERR, "unable to write %s", Output_DB_filename.c_str());
+
+  if (! Filter_filename.empty()) {
+    filter_file.close_file();
+    fprintf(stderr, "Filter: %llu bytes, %d probes, "
+            "est. false positive rate %.3g%%\n",
+            (unsigned long long) KrakenDBFilter::file_size(filter.get_block_ct()),
+            (int) filter.get_hash_ct(),
+            100 * filter.false_positive_rate(key_ct));
+  }
+
+  if (Compress_index) {
+    KrakenDBIndex db_index(index_file.ptr());
+    vector<char> contents = db_index.compressed_index();
+    index_file.close_file();
+    QuickFile compressed_file(Index_filename, "w", contents.size());
+    memcpy(compressed_file.ptr(), contents.data(), contents.size());
+  }
+
+  return 0;
+}
+
+// Add canonical k-mers of filename's sequences to their buckets' files
+static void scan_input(KrakenDB &kdb, string filename) {
+  BlockSequenceReader reader(filename, false, Num_threads);
+  SequenceBatch batch;
+  vector<pair<size_t, size_t> > chunks;  // (record, start) to scan
+
+  while (reader.next_batch(batch, READ_BATCH_SIZE)) {
+    chunks.clear();
+    for (size_t i = 0; i < batch.records.size(); i++)
+      for (size_t start = 0; start + Kmer_len <= batch.records[i].seq_len;
+           start += SCAN_CHUNK_SIZE)
+        chunks.push_back(make_pair(i, start));
+
+    uint64_t scanned_ct = 0;
+    #pragma omp parallel for schedule(dynamic) reduction(+:scanned_ct)
+    for (size_t i = 0; i < chunks.size(); i++) {
+      vector<vector<uint64_t> > &buffers = Thread_buffers[omp_get_thread_num()];
+      SequenceView &dna = batch.records[chunks[i].first];
+      size_t start = chunks[i].second;
+      KmerScanner scanner(dna.seq, dna.seq_len, start,
+                          start + SCAN_CHUNK_SIZE + Kmer_len - 1);
+      uint64_t *kmer_ptr;
+
+      while ((kmer_ptr = scanner.next_kmer()) != NULL) {
+        if (scanner.ambig_kmer())
+          continue;
+        uint64_t bucket = scanner.bin_key() / Bins_per_bucket;
+        vector<uint64_t> &buffer = buffers[bucket];
+        buffer.push_back(kdb.canonical_representation(*kmer_ptr));
+        if (buffer.size() == BUCKET_BUFFER_KMERS)
+          flush_buffer(buffer, Buckets[bucket]);
+        scanned_ct++;
+      }
+    }
+    Scanned_kmer_ct += scanned_ct;
+  }
+}
+
+// Add a thread's buffered k-mers to their bucket's pending run,
+// dropping repeats first (library sequences share many k-mers), and
+// spill the run once it's full
+static void flush_buffer(vector<uint64_t> &buffer, Bucket &bucket) {
+  if (buffer.empty())
+    return;
+  sort(buffer.begin(), buffer.end());
+  buffer.erase(unique(buffer.begin(), buffer.end()), buffer.end());
+  vector<uint64_t> full_run;
+  pthread_mutex_lock(&bucket.lock);
+  if (bucket.pending.capacity() == 0)
+    bucket.pending.reserve(Run_kmers + BUCKET_BUFFER_KMERS);
+  bucket.pending.insert(bucket.pending.end(), buffer.begin(), buffer.end());
+  if (bucket.pending.size() >= Run_kmers)
+    full_run.swap(bucket.pending);
+  pthread_mutex_unlock(&bucket.lock);
+  buffer.clear();
+  if (! full_run.empty())
+    spill_run(bucket, full_run);
+}
+
+// Write kmers as a new run of bucket's, then merge its latest runs
+// while the one before them is no larger than they are together, so
+// run sizes shrink geometrically: a bucket keeps few runs, and repeats
+// across runs take up at most about as much disk as its distinct k-mers
+static void spill_run(Bucket &bucket, vector<uint64_t> &kmers) {
+  pthread_mutex_lock(&bucket.run_lock);
+  write_run(bucket, kmers);
+  size_t first_run = bucket.runs.size() - 1;
+  uint64_t tail_ct = bucket.runs[first_run].kmer_ct;
+  while (first_run > 0 && bucket.runs[first_run - 1].kmer_ct <= tail_ct)
+    tail_ct += bucket.runs[--first_run].kmer_ct;
+  first_run = min(first_run, MAX_BUCKET_RUNS - 1);
+  if (first_run < bucket.runs.size() - 1)
+    merge_runs(bucket, first_run, NULL, NULL);
+  pthread_mutex_unlock(&bucket.run_lock);
+}
+
+// Sort & dedup kmers, then write them as a new run of bucket's
+// (caller holds bucket's run_lock); kmers' memory is freed
+static void write_run(Bucket &bucket, vector<uint64_t> &kmers) {
+  sort(kmers.begin(), kmers.end());
+  kmers.erase(unique(kmers.begin(), kmers.end()), kmers.end());
+  Run run;
+  int fd = create_run(bucket, run);
+  write_fully(fd, kmers.data(), kmers.size() * sizeof(uint64_t), 0,
+              run.filename);
+  if (close(fd) < 0)
+    err(EX_IOERR, "unable to write %s", run.filename.c_str());
+  run.kmer_ct = kmers.size();
+  bucket.runs.push_back(run);
+  vector<uint64_t>().swap(kmers);
+}
+
+// Replace bucket's runs from first_run on w/ one run of their distinct
+// k-mers (caller holds bucket's run_lock, or is its only user); if
+// bin_counts isn't NULL, adds the count of each bin's k-mers to it
+static void merge_runs(Bucket &bucket, size_t first_run, KrakenDB *kdb,
+                       uint64_t *bin_counts)
+{
+  size_t reader_ct = bucket.runs.size() - first_run;
+  vector<RunReader> readers(reader_ct);
+  vector<uint64_t> heads(reader_ct);
+  vector<bool> live(reader_ct);
+  for (size_t i = 0; i < reader_ct; i++) {
+    open_run(readers[i], bucket.runs[first_run + i]);
+    live[i] = read_kmer(readers[i], heads[i]);
+  }
+
+  Run merged;
+  int fd = create_run(bucket, merged);
+  vector<uint64_t> output;
+  output.reserve(RUN_BUFFER_KMERS);
+  uint64_t last_kmer = 0;
+  merged.kmer_ct = 0;
+  while (true) {
+    // Few runs are merged at once, so a linear scan finds the least
+    size_t least = reader_ct;
+    for (size_t i = 0; i < reader_ct; i++)
+      if (live[i] && (least == reader_ct || heads[i] < heads[least]))
+        least = i;
+    if (least == reader_ct)
+      break;
+    uint64_t kmer = heads[least];
+    live[least] = read_kmer(readers[least], heads[least]);
+    if (merged.kmer_ct > 0 && kmer == last_kmer)
+      continue;
+    if (bin_counts != NULL)
+      bin_counts[kdb->bin_key(kmer, Bin_key_nt)]++;
+    output.push_back(kmer);
+    last_kmer = kmer;
+    merged.kmer_ct++;
+    if (output.size() == RUN_BUFFER_KMERS) {
+      write_fully(fd, output.data(), output.size() * sizeof(uint64_t),
+                  (merged.kmer_ct - output.size()) * sizeof(uint64_t),
+                  merged.filename);
+      output.clear();
+    }
+  }
+  write_fully(fd, output.data(), output.size() * sizeof(uint64_t),
+              (merged.kmer_ct - output.size()) * sizeof(uint64_t),
+              merged.filename);
+  if (close(fd) < 0)
+    err(EX_IOERR, "unable to write %s", merged.filename.c_str());
+
+  for (size_t i = 0; i < reader_ct; i++) {
+    close_run(readers[i]);
+    unlink(bucket.runs[first_run + i].filename.c_str());
+  }
+  bucket.runs.resize(first_run);
+  bucket.runs.push_back(merged);
+}
+
+// Leave bucket w/ a single run of its distinct k-mers, adding the count
+// of each of its bins' k-mers to bin_counts
+static void finish_bucket(KrakenDB &kdb, Bucket &bucket, uint64_t *bin_counts)
+{
+  if (! bucket.pending.empty())
+    write_run(bucket, bucket.pending);
+  if (bucket.runs.size() > 1) {
+    merge_runs(bucket, 0, &kdb, bin_counts);
+  }
+  else if (bucket.runs.size() == 1) {
+    RunReader reader;
+    uint64_t kmer;
+    open_run(reader, bucket.runs[0]);
+    while (read_kmer(reader, kmer))
+      bin_counts[kdb.bin_key(kmer, Bin_key_nt)]++;
+    close_run(reader);
+  }
+  bucket.kmer_ct = bucket.runs.empty() ? 0 : bucket.runs[0].kmer_ct;
+}
+
+// Write bucket's bins in the output DB's layout, then remove its run
+static void write_bucket(KrakenDB &kdb, KrakenDB &out_db, Bucket &bucket,
+                         const uint64_t *offsets, int out_fd,
+                         KrakenDBFilter *filter)
+{
+  if (bucket.kmer_ct == 0)
+    return;
+  uint64_t first = offsets[bucket.first_bin];
+
+  // Scatter run (sorted by k-mer) into bins, so each bin stays sorted
+  vector<uint64_t> keys(bucket.kmer_ct);
+  vector<uint64_t> next_slot(offsets + bucket.first_bin,
+                             offsets + bucket.first_bin + Bins_per_bucket);
+  RunReader reader;
+  uint64_t kmer;
+  open_run(reader, bucket.runs[0]);
+  while (read_kmer(reader, kmer)) {
+    uint64_t b = kdb.bin_key(kmer, Bin_key_nt) - bucket.first_bin;
+    keys[next_slot[b]++ - first] = kmer;
+  }
+  close_run(reader);
+  unlink(bucket.runs[0].filename.c_str());
+  vector<uint64_t>().swap(next_slot);
+
+  for (uint64_t b = bucket.first_bin;
+       b < bucket.first_bin + Bins_per_bucket; b++) {
+    uint64_t *bin = keys.data() + offsets[b] - first;
+    uint64_t bin_ct = offsets[b + 1] - offsets[b];
+    if (filter != NULL)
+      for (uint64_t i = 0; i < bin_ct; i++)
+        filter->insert_atomic(bin[i]);
+    if (Compact_keys) {
+      for (uint64_t i = 0; i < bin_ct; i++)
+        bin[i] = kdb.residual_key(bin[i], b, Bin_key_nt);
+      sort(bin, bin + bin_ct);
+    }
+    if (Eytzinger_bins)
+      eytzinger_order(bin, bin_ct);
+  }
+
+  // Keys are stored in their low key_len bytes (w/ a zero value after
+  // each, unless keys & values are in separate arrays)
+  uint64_t key_len = out_db.get_key_len();
+  uint64_t stride = Split_arrays ? key_len : out_db.pair_size();
+  uint64_t chunk_keys = min((uint64_t) keys.size(), WRITE_CHUNK_SIZE / stride);
+  vector<char> data(chunk_keys * stride);
+  for (uint64_t i = 0; i < keys.size(); i += chunk_keys) {
+    uint64_t ct = min(chunk_keys, keys.size() - i);
+    for (uint64_t j = 0; j < ct; j++)
+      memcpy(&data[j * stride], &keys[i + j], key_len);
+    write_fully(out_fd, data.data(), ct * stride,
+                out_db.header_size() + (first + i) * stride,
+                Output_DB_filename);
+  }
+}
+
+// Rearrange sorted keys into Eytzinger order (see KrakenDB)
+static void eytzinger_order(uint64_t *keys, uint64_t key_ct) {
+  vector<uint64_t> sorted(keys, keys + key_ct);
+  eytzinger_fill(keys, sorted.data(), 1, key_ct, 0);
+}
+
+// In-order traversal of the tree below node, filling each node w/
+// the next sorted key; returns index of next unused sorted key
+static uint64_t eytzinger_fill(uint64_t *dest, const uint64_t *sorted,
+                               uint64_t node, uint64_t key_ct, uint64_t next)
+{
+  if (node > key_ct)
+    return next;
+  next = eytzinger_fill(dest, sorted, 2 * node, key_ct, next);
+  dest[node - 1] = sorted[next++];
+  return eytzinger_fill(dest, sorted, 2 * node + 1, key_ct, next);
+}
+
+// Create the file for a new run of bucket's (caller holds its run_lock)
+static int create_run(Bucket &bucket, Run &run) {
+  ostringstream name;
+  name << bucket.filename << ".run" << bucket.run_id++;
+  run.filename = name.str();
+  int fd = open(run.filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0)
+    err(EX_CANTCREAT, "unable to create %s", run.filename.c_str());
+  return fd;
+}
+
+static void open_run(RunReader &reader, const Run &run) {
+  reader.fd = open(run.filename.c_str(), O_RDONLY);
+  if (reader.fd < 0)
+    err(EX_NOINPUT, "unable to open %s", run.filename.c_str());
+  reader.run = &run;
+  reader.left = run.kmer_ct;
+  reader.next = 0;
+  reader.buffer.clear();
+}
+
+static bool read_kmer(RunReader &reader, uint64_t &kmer) {
+  if (reader.next == reader.buffer.size()) {
+    if (reader.left == 0)
+      return false;
+    reader.buffer.resize(min((uint64_t) RUN_BUFFER_KMERS, reader.left));
+    char *ptr = (char *) reader.buffer.data();
+    size_t size = reader.buffer.size() * sizeof(uint64_t), done = 0;
+    while (done < size) {
+      ssize_t ct = read(reader.fd, ptr + done, size - done);
+      if (ct <= 0)
+        err(EX_IOERR, "unable to read %s", reader.run->filename.c_str());
+      done += ct;
+    }
+    reader.left -= reader.buffer.size();
+    reader.next = 0;
+  }
+  kmer = reader.buffer[reader.next++];
+  return true;
+}
+
+static void close_run(RunReader &reader) {
+  close(reader.fd);
+  vector<uint64_t>().swap(reader.buffer);
+}
+
+static void write_fully(int fd, const void *buf, size_t size, off_t offset,
+                        const string &filename)
+{
+  const char *ptr = (const char *) buf;
+  while (size > 0) {
+    ssize_t ct = pwrite(fd, ptr, size, offset);
+    if (ct < 0)
+      err(EX_IOERR, "unable to write %s", filename.c_str());
+    ptr += ct;
+    size -= ct;
+    offset += ct;
+  }
+}
+
+static void parse_command_line(int argc, char **argv) {
+  int opt;
+  long long sig;
+
+  if (argc > 1 && strcmp(argv[1], "-h") == 0)
+    usage(0);
+  while ((opt = getopt(argc, argv, "k:n:o:i:t:p:m:T:csexB:b:")) != -1) {
+    switch (opt) {
+      case 'k' :
+        sig = atoll(optarg);
+        if (sig < 2 || sig > 31)
+          errx(EX_USAGE, "k must be between 2 and 31");
+        Kmer_len = sig;
+        break;
+      case 'n' :
+        sig = atoll(optarg);
+        if (sig < 1 || sig > 31)
+          errx(EX_USAGE, "bin key length out of range");
+        Bin_key_nt = (uint8_t) sig;
+        break;
+      case 'o' :
+        Output_DB_filename = optarg;
+        break;
+      case 'i' :
+        Index_filename = optarg;
+        break;
+      case 't' :
+        sig = atoll(optarg);
+        if (sig <= 0)
+          errx(EX_USAGE, "can't use nonpositive thread count");
+        #ifdef _OPENMP
+        if (sig > omp_get_num_procs())
+          errx(EX_USAGE, "thread count exceeds number of processors");
+        Num_threads = sig;
+        omp_set_num_threads(Num_threads);
+        #endif
+        break;
+      case 'p' :
+        sig = atoll(optarg);
+        if (sig <= 0 || (sig & (sig - 1)) != 0)
+          errx(EX_USAGE, "bucket count must be a power of 2");
+        Bucket_ct = sig;
+        break;
+      case 'm' :
+        sig = atoll(optarg);
+        if (sig <= 0)
+          errx(EX_USAGE, "can't use nonpositive memory budget");
+        Memory_budget = (uint64_t) sig << 20;
+        break;
+      case 'T' :
+        Temp_dir = optarg;
+        break;
+      case 'c' :
+        Compact_keys = true;
+        break;
+      case 's' :
+        Split_arrays = true;
+        break;
+      case 'e' :
+        Eytzinger_bins = true;
+        break;
+      case 'x' :
+        Compress_index = true;
+        break;
+      case 'B' :
+        Filter_filename = optarg;
+        break;
+      case 'b' :
+        Filter_bits_per_kmer = atof(optarg);
+        if (Filter_bits_per_kmer < 1 || Filter_bits_per_kmer > 64)
+          errx(EX_USAGE, "filter bits per k-mer must be between 1 and 64");
+        break;
+      default:
+        usage();
+        break;
+    }
+  }
+
+  if (Kmer_len == 0 || Output_DB_filename.empty() || Index_filename.empty()
+      || optind == argc)
+    usage();
+  if (Bin_key_nt >= Kmer_len)
+    errx(EX_USAGE, "bin key length must be less than k");
+  if (Bucket_ct > (1ull << (Bin_key_nt * 2)))
+    errx(EX_USAGE, "more buckets than bins");
+  if (Temp_dir.empty()) {
+    size_t slash = Output_DB_filename.rfind('/');
+    Temp_dir = slash == string::npos ? "."
+                                     : Output_DB_filename.substr(0, slash + 1);
+  }
+  for (int i = optind; i < argc; i++)
+    Input_filenames.push_back(argv[i]);
+}
+
+static void usage(int exit_code) {
+  cerr << "Usage: build_kmer_set [options] <FASTA file(s)>" << endl
+       << endl
+       << "Options: (*mandatory)" << endl
+       << "* -k #             K-mer length" << endl
+       << "* -o filename      Output Kraken DB filename" << endl
+       << "* -i filename      Output Kraken DB index filename" << endl
+       << "  -n #             Bin key (minimizer) length (default 15)" << endl
+       << "  -t #             Number of threads" << endl
+       << "  -p #             Number of temporary buckets (a power of 2;" << endl
+       << "                   default 256); a bucket's distinct k-mers are" << endl
+       << "                   held in memory at once while it's written" << endl
+       << "  -m #             Memory budget in MB (default " << DEF_MEMORY_MB << ")" << endl
+       << "  -T directory     Directory for buckets (default: output DB's)" << endl
+       << "  -c               Store compact (residual) keys" << endl
+       << "  -s               Store keys and values in separate arrays" << endl
+       << "  -e               Store bins in Eytzinger (breadth-first search tree) order" << endl
+       << "  -x               Write a compressed (v3) index" << endl
+       << "  -B filename      Write a Bloom filter of the k-mers to given file" << endl
+       << "  -b #             Filter bits per k-mer (default 10)" << endl
+       << "  -h               Print this message" << endl;
+  exit(exit_code);
+}
@@ -22,36 +22,201 @@
 #include "krakenutil.hpp"
 #include "quickfile.hpp"
 #include "seqreader.hpp"
+#include "jobsocket.hpp"
 
 const size_t DEF_WORK_UNIT_SIZE = 500000;
 
 using namespace std;
 using namespace kraken;
 
+// Run of identical k-mer results in a read's hitlist
+// (taxon is -1 for ambiguous k-mers)
+typedef struct {
+  int64_t taxon;
+  uint32_t count;
+} HitlistRun;
+
+// K-mer to look up in an out-of-core sweep (-b), w/ its work unit's
+// index in the batch and its position in the unit's k-mers
+typedef struct {
+  uint64_t bin_key;
+  uint64_t kmer;
+  uint32_t unit;
+  uint32_t pos;
+} BinQuery;
+
+// Bins an out-of-core sweep reads as one: bins w/ queries, and any
+// small gaps of bins w/o them in between
+typedef struct {
+  uint64_t first_bin, last_bin;
+} BinSpan;
+
+// Part of a sweep searched at once: the queries before query_end (and
+// after the last window's), in the spans before span_end
+typedef struct {
+  size_t query_end, span_end;
+} SweepWindow;
+
+// An out-of-core batch's k-mers, sorted by bin, and the sweep of the
+// DB that looks them up
+typedef struct {
+  vector<BinQuery> queries;
+  vector<uint64_t> kmers, bin_keys;  // the queries', in sorted order
+  vector<uint8_t> mmer_pos;  // used only w/ compact DBs
+  vector<uint32_t> taxa;
+  vector<size_t> part_starts;  // see sort_batch_kmers()
+  vector<size_t> part_ends;
+  vector<BinSpan> spans;
+  vector<SweepWindow> windows;
+} SweepBatch;
+
+// Per-thread state reused from read to read, so steady-state
+// classification makes no heap allocations
+typedef struct {
+  vector<uint64_t> kmers, bin_keys;
+  vector<uint32_t> kmer_taxa;
+  vector<uint8_t> mmer_pos;  // used only w/ compact DBs
+  vector<uint8_t> ambig_flags;
+  vector<size_t> kmer_cts;  // k-mer positions per fragment
+  TaxonCounter hit_counts;
+  vector<HitlistRun> hitlist;
+  vector<size_t> filter_hits;  // positions of k-mers drop_absent_kmers() kept
+  vector<uint32_t> filtered_taxa;
+  KrakenDB *database;  // this thread's NUMA-local replica, or Database
+  KrakenDBFilter *filter;  // likewise, or NULL if no filter
+} ClassifyScratch;
+
+// Input records of a work unit, and the output made from them
+typedef struct {
+  SequenceBatch input;
+  SequenceBatch mates;  // mates' records, if mates are in a 2nd file
+  bool interleaved;  // input alternates between mates
+  uint64_t classified_ct;
+  vector<char> job_data;  // records received by a server job
+  OutputBuffer kraken_output;
+  OutputBuffer classified_output, classified_output2;
+  OutputBuffer unclassified_output, unclassified_output2;
+} WorkUnit;
+
+enum WorkUnitState { UNIT_EMPTY, UNIT_FILLED, UNIT_CLASSIFIED };
+
+// Bounded ring of work units passed from the parser thread to the
+// classifier threads to the writer thread.  Units are filled, claimed,
+// and written in input order; the parser blocks when the ring is full.
+// Ring state is guarded by Pool_lock, shared by all rings.
+typedef struct {
+  WorkUnit *units;
+  WorkUnitState *states;
+  size_t size;
+  uint64_t fill_ct;   // units filled by parser
+  uint64_t claim_ct;  // units claimed by classifiers
+  uint64_t write_ct;  // units written (and emptied) by writer
+  bool input_done;
+  pthread_cond_t unit_emptied, unit_classified;
+  BlockSequenceReader *reader;
+  BlockSequenceReader *mate_reader;  // NULL unless mates in a 2nd file
+  int output_fd;  // server job's client connection, or -1
+  bool output_failed;  // client stopped accepting output
+  // Kept by the parser and writer
+  uint64_t sequence_ct, base_ct, classified_ct;
+  double parser_busy_time, writer_busy_time;
+} WorkUnitRing;
+
+// Work units in ring per classifier thread
+const size_t RING_UNITS_PER_THREAD = 2;
+
+// Jobs a server runs at once; further clients wait in the listen queue
+const size_t MAX_SERVER_JOBS = 64;
+
+// Out-of-core mode's estimate of a batch's memory use per bp of input:
+// its k-mers' scratch & sorted arrays (about 80 bytes per k-mer), plus
+// its input & output and that of the batch parsed while it's classified
+const size_t SWEEP_BYTES_PER_BP = 88;
+// Largest DB window an out-of-core sweep searches (& reads ahead) at once
+const size_t MAX_SWEEP_WINDOW = 64 << 20;
+// Bins w/o queries are read along w/ the ones around them (rather than
+// skipped) if they hold no more bytes than this
+const uint64_t SWEEP_READ_GAP = 1 << 20;
+// Log2 of the number of partitions of bins a batch's k-mers are sorted
+// in, in parallel
+const int SWEEP_PARTITION_BITS = 10;
+
 void parse_command_line(int argc, char **argv);
 void usage(int exit_code=EX_USAGE);
-void process_file(char *filename);
-void classify_sequence(DNASequence &dna, ostringstream &koss,
-                       ostringstream &coss, ostringstream &uoss,
-		       ostringstream &coss2, ostringstream &uoss2);
-string hitlist_string(vector<uint32_t> &taxa, vector<uint8_t> &ambig);
-set<uint32_t> get_ancestry(uint32_t taxon);
+void process_files(char *filename, char *mate_filename);
+void init_ring(WorkUnitRing &ring);
+void destroy_ring(WorkUnitRing &ring);
+void *parse_input(void *ring_ptr);
+void classify_input();
+void classify_batches();
+WorkUnitRing *next_filled_ring();
+bool all_input_done();
+void *write_output(void *ring_ptr);
+void run_server();
+void *accept_jobs(void *listen_fd_ptr);
+void end_job();
+void *serve_job(void *fd_ptr);
+string receive_job_input(WorkUnitRing &ring, int fd, bool interleaved);
+bool unpack_records(WorkUnit &unit, bool interleaved);
+void stop_server(int sig);
+void classify_work_unit(WorkUnit &unit, ClassifyScratch &scratch);
+void classify_batch(vector<WorkUnit *> &units,
+                    vector<ClassifyScratch> &scratch, SweepBatch &batch);
+void scan_work_unit(WorkUnit &unit, ClassifyScratch &scratch);
+void classify_fragments(WorkUnit &unit, ClassifyScratch &scratch);
+size_t fragment_count(WorkUnit &unit);
+void get_fragment(WorkUnit &unit, size_t i,
+                  SequenceView *&dna, SequenceView *&mate);
+void check_mate_ids(WorkUnit &unit);
+size_t scan_fragment(SequenceView &dna, SequenceView *mate,
+                     ClassifyScratch &scratch);
+void scan_sequence(SequenceView &dna, ClassifyScratch &scratch);
+void drop_absent_kmers(ClassifyScratch &scratch);
+void lookup_kmers(ClassifyScratch &scratch);
+void sort_batch_kmers(vector<ClassifyScratch> &scratch, size_t unit_ct,
+                      SweepBatch &batch);
+void sweep_batch(SweepBatch &batch);
+bool classify_sequence(SequenceView &dna, SequenceView *mate, size_t kmer_ct,
+                       uint8_t *ambig_flags,
+                       uint32_t *kmer_taxa, ClassifyScratch &scratch,
+                       OutputBuffer &kbuf,
+                       OutputBuffer &cbuf, OutputBuffer &ubuf,
+                       OutputBuffer &cbuf2, OutputBuffer &ubuf2);
+void print_hitlist(OutputBuffer &buf, vector<HitlistRun> &hitlist);
+void print_record(OutputBuffer &buf, SequenceView &dna);
+void write_output_buffer(ostream *output, OutputBuffer &buf);
 void report_stats(struct timeval time1, struct timeval time2);
+double wall_clock_time();
 
 int Num_threads = 1;
-string DB_filename, Index_filename, Nodes_filename;
+string DB_filename, Index_filename, Filter_filename, Nodes_filename;
 bool Quick_mode = false;
 bool Fastq_input = false;
 bool Fastq_output = false;
 bool Paired_input = false;
+bool Interleaved_input = false;
+bool Check_mate_ids = false;
 bool Print_classified = false;
 bool Print_unclassified = false;
 bool Print_kraken = true;
 bool Populate_memory = false;
+string Numa_placement;
+string Shared_segment;  // db_shm segment to attach DB files from
+BinSearchMethod Search_method = BIN_SEARCH_BINARY;
 bool Only_classified_kraken_output = false;
+bool Partial_output = false;  // hitlists only, for merge_shards
+// DB is a shard (see db_shard) holding only these bins
+bool Shard_db = false;
+uint64_t Shard_first_bin, Shard_last_bin;
 uint32_t Minimum_hit_count = 1;
-map<uint32_t, uint32_t> Parent_map;
+Taxonomy Taxonomy_tree;
 KrakenDB Database;
+// One copy of DB & index per NUMA node, w/ -N replicate
+vector<KrakenDB> Database_replicas;
+vector<KrakenDBIndex> Index_replicas;
+// Optional filter of DB's k-mers, consulted before searching DB
+KrakenDBFilter Filter;
+vector<KrakenDBFilter> Filter_replicas;
 string Classified_output_file, Unclassified_output_file, Kraken_output_file;
 string Output_format;
 ostream *Classified_output;
@@ -60,39 +225,125 @@ ostream *Unclassified_output;
 ostream *Unclassified_output2;
 ostream *Kraken_output;
 size_t Work_unit_size = DEF_WORK_UNIT_SIZE;
+size_t Memory_budget = 0;      // out-of-core mode (-b) if nonzero
+size_t Sweep_window_size = 0;  // bytes of DB searched at once in it
+size_t Batch_units = 0;        // work units it classifies at once
+string Server_socket;  // w/ -L, serve jobs here instead of reading files
+
+// Rings the classifier threads claim units from, round robin: one per
+// input file (pair), or one per job being served
+vector<WorkUnitRing *> Active_rings;
+size_t Next_ring = 0;
+bool Serving = false;  // more rings may become active
+pthread_mutex_t Pool_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t Work_available = PTHREAD_COND_INITIALIZER;
+uint64_t Job_ct = 0;
+size_t Running_job_ct = 0;  // guarded by Pool_lock
+pthread_cond_t Job_ended = PTHREAD_COND_INITIALIZER;
 
 uint64_t total_classified = 0;
 uint64_t total_sequences = 0;
 uint64_t total_bases = 0;
 
+// Time spent working (not waiting on other stages), summed over files
+double parser_busy_time = 0;
+double classifier_busy_time = 0;
+double writer_busy_time = 0;
+double pipeline_time = 0;
+
 int main(int argc, char **argv) {
   #ifdef _OPENMP
   omp_set_num_threads(1);
   #endif
 
   parse_command_line(argc, argv);
-  if (! Nodes_filename.empty())
-    Parent_map = build_parent_map(Nodes_filename);
+  if (! Nodes_filename.empty()) {
+    map<uint32_t, uint32_t> parent_map = build_parent_map(Nodes_filename);
+    Taxonomy_tree = Taxonomy(parent_map);
+  }
+
+  int numa_node_ct = numa_node_count();
+  if (! Numa_placement.empty() && numa_node_ct == 1) {
+    warnx("only one NUMA node, ignoring -N %s", Numa_placement.c_str());
+    Numa_placement.clear();
+  }
+  bool load_database = Populate_memory || ! Numa_placement.empty();
 
-  if (Populate_memory)
+  if (load_database)
     cerr << "Loading database... ";
 
+  // Files already in a shared segment aren't loaded again; missing or
+  // stale ones are opened as usual
+  bool shared_db = false, shared_idx = false, shared_filter = false;
   QuickFile db_file;
-  db_file.open_file(DB_filename);
-  if (Populate_memory)
+  if (! Shared_segment.empty())
+    shared_db = db_file.open_shared(Shared_segment, "kdb", DB_filename);
+  if (! shared_db)
+    db_file.open_file(DB_filename);
+  if (Populate_memory && ! shared_db)
     db_file.load_file();
+  if (Numa_placement == "interleave")
+    db_file.load_interleaved();
   Database = KrakenDB(db_file.ptr());
+  Database.set_search_method(Search_method);
   KmerScanner::set_k(Database.get_k());
 
   QuickFile idx_file;
-  idx_file.open_file(Index_filename);
-  if (Populate_memory)
+  if (! Shared_segment.empty())
+    shared_idx = idx_file.open_shared(Shared_segment, "idx", Index_filename);
+  if (! shared_idx)
+    idx_file.open_file(Index_filename);
+  if (Populate_memory && ! shared_idx)
     idx_file.load_file();
+  if (Numa_placement == "interleave")
+    idx_file.load_interleaved();
   KrakenDBIndex db_index(idx_file.ptr());
   Database.set_index(&db_index);
+  KmerScanner::set_minimizer(db_index.indexed_nt(), db_index.xor_mask());
+  Shard_db = db_index.index_type() == 4;
+  Shard_first_bin = db_index.first_bin();
+  Shard_last_bin = db_index.last_bin();
+  if (Shard_db && ! Partial_output)
+    errx(EX_USAGE, "%s is a DB shard; classify w/ -H and combine results "
+         "w/ merge_shards", DB_filename.c_str());
 
-  if (Populate_memory)
+  QuickFile filter_file;
+  if (! Filter_filename.empty()) {
+    if (! Shared_segment.empty())
+      shared_filter = filter_file.open_shared(Shared_segment, "flt",
+                                              Filter_filename);
+    if (! shared_filter)
+      filter_file.open_file(Filter_filename);
+    if (Populate_memory && ! shared_filter)
+      filter_file.load_file();
+    if (Numa_placement == "interleave")
+      filter_file.load_interleaved();
+    Filter = KrakenDBFilter(filter_file.ptr());
+  }
+
+  if (Numa_placement == "replicate") {
+    Database_replicas.resize(numa_node_ct);
+    Index_replicas.resize(numa_node_ct);
+    for (int node = 0; node < numa_node_ct; node++) {
+      Database_replicas[node] = KrakenDB(db_file.load_replica(node));
+      Index_replicas[node] = KrakenDBIndex(idx_file.load_replica(node));
+      Database_replicas[node].set_index(&Index_replicas[node]);
+      Database_replicas[node].set_search_method(Search_method);
+      if (! Filter_filename.empty())
+        Filter_replicas.push_back(
+          KrakenDBFilter(filter_file.load_replica(node)));
+    }
+  }
+
+  if (load_database)
     cerr << "complete." << endl;
+  if (! Shared_segment.empty() && ! (shared_db && shared_idx))
+    warnx("DB not fully in segment %s, using DB files", Shared_segment.c_str());
+
+  if (! Server_socket.empty()) {
+    run_server();
+    return 0;
+  }
 
   if (Print_classified) {
     if (Classified_output_file == "-")
@@ -151,8 +402,15 @@ int main(int argc, char **argv) {
 
   struct timeval tv1, tv2;
   gettimeofday(&tv1, NULL);
-  for (int i = optind; i < argc; i++)
-    process_file(argv[i]);
+  for (int i = optind; i < argc; i++) {
+    if (Paired_input && ! Interleaved_input) {
+      process_files(argv[i], argv[i + 1]);
+      i++;
+    }
+    else {
+      process_files(argv[i], NULL);
+    }
+  }
   gettimeofday(&tv2, NULL);
 
   report_stats(tv1, tv2);
@@ -173,82 +431,58 @@ void report_stats(struct timeval time1, struct timeval time2) {
 
   if (isatty(fileno(stderr)))
     cerr << "\r";
-  fprintf(stderr, 
-          "%llu sequences (%.2f Mbp) processed in %.3fs (%.1f Kseq/m, %.2f Mbp/m).\n",
-          (unsigned long long) total_sequences, total_bases / 1.0e6, seconds,
-          total_sequences / 1.0e3 / (seconds / 60),
-          total_bases / 1.0e6 / (seconds / 60) );
-  fprintf(stderr, "  %llu sequences classified (%.2f%%)\n",
-          (unsigned long long) total_classified, total_classified * 100.0 / total_sequences);
-  fprintf(stderr, "  %llu sequences unclassified (%.2f%%)\n",
-          (unsigned long long) (total_sequences - total_classified),
-          (total_sequences - total_classified) * 100.0 / total_sequences);
-}
-
-void process_file(char *filename) {
+  // Calls are made by merge_shards for partial output
+  fputs(classification_stats(total_sequences, total_bases, total_classified,
+                             seconds, Partial_output).c_str(), stderr);
+  if (pipeline_time > 0)
+    fprintf(stderr, "  stage utilization: parser %.1f%%, classifiers %.1f%% (%d thread%s), writer %.1f%%\n",
+            parser_busy_time * 100.0 / pipeline_time,
+            classifier_busy_time * 100.0 / (pipeline_time * Num_threads),
+            Num_threads, Num_threads == 1 ? "" : "s",
+            writer_busy_time * 100.0 / pipeline_time);
+}
+
+double wall_clock_time() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// Input is parsed by one thread, classified by Num_threads threads,
+// and written by one thread, w/ work units passed through a ring
+// (mate_filename is NULL unless mates are in a 2nd file)
+void process_files(char *filename, char *mate_filename) {
   string file_str(filename);
-  DNASequenceReader *reader;
-  DNASequence dna;
+  WorkUnitRing ring;
+  pthread_t parser_thread, writer_thread;
 
-  if (Fastq_input)
-    reader = new FastqReader(file_str);
-  else
-    reader = new FastaReader(file_str);
+  init_ring(ring);
+  ring.reader = new BlockSequenceReader(file_str, Fastq_input, Num_threads);
+  if (mate_filename != NULL)
+    ring.mate_reader = new BlockSequenceReader(mate_filename, Fastq_input,
+                                               Num_threads);
+  Active_rings.push_back(&ring);
 
-  #pragma omp parallel
-  {
-    vector<DNASequence> work_unit;
-    ostringstream kraken_output_ss, classified_output_ss, classified_output_ss2, unclassified_output_ss, unclassified_output_ss2;
-
-    while (reader->is_valid()) {
-      work_unit.clear();
-      size_t total_nt = 0;
-      #pragma omp critical(get_input)
-      {
-        while (total_nt < Work_unit_size) {
-          dna = reader->next_sequence();
-          if (! reader->is_valid())
-            break;
-          work_unit.push_back(dna);
-          total_nt += dna.seq.size();
-        }
-      }
-      if (total_nt == 0)
-        break;
-      
-      kraken_output_ss.str("");
-      classified_output_ss.str("");
-      classified_output_ss2.str("");
-      unclassified_output_ss.str("");
-      unclassified_output_ss2.str("");
-      for (size_t j = 0; j < work_unit.size(); j++)
-        classify_sequence( work_unit[j], kraken_output_ss,
-                           classified_output_ss, unclassified_output_ss,
-			   classified_output_ss2, unclassified_output_ss2);
-
-      #pragma omp critical(write_output)
-      {
-        if (Print_kraken)
-          (*Kraken_output) << kraken_output_ss.str();
-        if (Print_classified) {
-          (*Classified_output) << classified_output_ss.str();
-	  if (Output_format == "paired")
-	    (*Classified_output2) << classified_output_ss2.str();
-	}
-        if (Print_unclassified) {
-          (*Unclassified_output) << unclassified_output_ss.str();
-	  if (Output_format == "paired")
-	    (*Unclassified_output2) << unclassified_output_ss2.str();
-	}
-        total_sequences += work_unit.size();
-        total_bases += total_nt;
-        if (isatty(fileno(stderr)))
-          cerr << "\rProcessed " << total_sequences << " sequences (" << total_bases << " bp) ...";
-      }
-    }
-  }  // end parallel section
+  double start_time = wall_clock_time();
+  if (pthread_create(&parser_thread, NULL, parse_input, &ring) != 0)
+    errx(EX_OSERR, "unable to create parser thread");
+  if (pthread_create(&writer_thread, NULL, write_output, &ring) != 0)
+    errx(EX_OSERR, "unable to create writer thread");
+  classify_input();
+  pthread_join(parser_thread, NULL);
+  pthread_join(writer_thread, NULL);
+  pipeline_time += wall_clock_time() - start_time;
+
+  Active_rings.clear();
+  total_sequences += ring.sequence_ct;
+  total_bases += ring.base_ct;
+  total_classified += ring.classified_ct;
+  parser_busy_time += ring.parser_busy_time;
+  writer_busy_time += ring.writer_busy_time;
+  delete ring.reader;
+  delete ring.mate_reader;
+  destroy_ring(ring);
 
-  delete reader;
   if (Print_kraken)
     (*Kraken_output) << std::flush;
   if (Print_classified) {
@@ -261,219 +495,1058 @@ void process_file(char *filename) {
   }
 }
 
-void classify_sequence(DNASequence &dna, ostringstream &koss,
-                       ostringstream &coss, ostringstream &uoss,
-		       ostringstream &coss2, ostringstream &uoss2) {
-  vector<uint32_t> taxa;
-  vector<uint8_t> ambig_list;
-  map<uint32_t, uint32_t> hit_counts;
-  uint64_t *kmer_ptr;
-  uint32_t taxon = 0;
-  uint32_t hits = 0;  // only maintained if in quick mode
+void init_ring(WorkUnitRing &ring) {
+  // Out-of-core mode fills a batch while the one before it is classified
+  ring.size = Memory_budget > 0 ? 2 * Batch_units + 2
+                                : RING_UNITS_PER_THREAD * Num_threads + 2;
+  ring.units = new WorkUnit[ring.size];
+  ring.states = new WorkUnitState[ring.size];
+  for (size_t i = 0; i < ring.size; i++)
+    ring.states[i] = UNIT_EMPTY;
+  ring.fill_ct = ring.claim_ct = ring.write_ct = 0;
+  ring.input_done = false;
+  pthread_cond_init(&ring.unit_emptied, NULL);
+  pthread_cond_init(&ring.unit_classified, NULL);
+  ring.reader = ring.mate_reader = NULL;
+  ring.output_fd = -1;
+  ring.output_failed = false;
+  ring.sequence_ct = ring.base_ct = ring.classified_ct = 0;
+  ring.parser_busy_time = ring.writer_busy_time = 0;
+}
 
-  uint64_t current_bin_key;
-  int64_t current_min_pos = 1;
-  int64_t current_max_pos = 0;
+void destroy_ring(WorkUnitRing &ring) {
+  pthread_cond_destroy(&ring.unit_classified);
+  pthread_cond_destroy(&ring.unit_emptied);
+  delete[] ring.states;
+  delete[] ring.units;
+}
+
+// Parser stage: fill empty units in order, waiting when ring is full
+void *parse_input(void *ring_ptr) {
+  WorkUnitRing &ring = *(WorkUnitRing *) ring_ptr;
+
+  while (true) {
+    size_t slot = ring.fill_ct % ring.size;
+    pthread_mutex_lock(&Pool_lock);
+    while (ring.states[slot] != UNIT_EMPTY)
+      pthread_cond_wait(&ring.unit_emptied, &Pool_lock);
+    pthread_mutex_unlock(&Pool_lock);
 
-  if (dna.seq.size() >= Database.get_k()) {
-    KmerScanner scanner(dna.seq);
-    while ((kmer_ptr = scanner.next_kmer()) != NULL) {
-      taxon = 0;
-      if (scanner.ambig_kmer()) {
-        ambig_list.push_back(1);
+    double start_time = wall_clock_time();
+    WorkUnit &unit = ring.units[slot];
+    bool have_input;
+    unit.interleaved = Interleaved_input;
+    if (ring.mate_reader == NULL) {
+      have_input = ring.reader->next_batch(unit.input, Work_unit_size,
+                                           Interleaved_input ? 2 : 1);
+      if (unit.input.records.size() % (Interleaved_input ? 2 : 1) != 0)
+        errx(EX_DATAERR, "interleaved input has an odd number of sequences");
+    }
+    else {
+      // Read mates in lockstep, w/ work unit size split between them
+      have_input = ring.reader->next_batch(unit.input,
+                                           (Work_unit_size + 1) / 2);
+      size_t record_ct = unit.input.records.size();
+      ring.mate_reader->next_batch(unit.mates, have_input ? SIZE_MAX : 1,
+                                   1, have_input ? record_ct : 1);
+      if (unit.mates.records.size() != record_ct)
+        errx(EX_DATAERR, "paired input files have different sequence counts");
+    }
+    if (Check_mate_ids)
+      check_mate_ids(unit);
+    ring.parser_busy_time += wall_clock_time() - start_time;
+
+    pthread_mutex_lock(&Pool_lock);
+    if (have_input) {
+      ring.states[slot] = UNIT_FILLED;
+      ring.fill_ct++;
+      pthread_cond_signal(&Work_available);
+    }
+    else {
+      ring.input_done = true;
+      pthread_cond_broadcast(&Work_available);
+      pthread_cond_broadcast(&ring.unit_classified);
+    }
+    pthread_mutex_unlock(&Pool_lock);
+    if (! have_input)
+      break;
+  }
+  return NULL;
+}
+
+// Classifier stage: claim filled units from the active rings until
+// all input is exhausted (which never happens while serving)
+void classify_input() {
+  if (Memory_budget > 0) {
+    classify_batches();
+    return;
+  }
+
+  #pragma omp parallel
+  {
+    ClassifyScratch scratch;
+    double busy_time = 0;
+
+    // Spread threads over NUMA nodes, each using its node's replica
+    scratch.database = &Database;
+    scratch.filter = Filter_filename.empty() ? NULL : &Filter;
+    if (! Database_replicas.empty()) {
+      int node = omp_get_thread_num() % Database_replicas.size();
+      numa_bind_thread(node);
+      scratch.database = &Database_replicas[node];
+      if (! Filter_replicas.empty())
+        scratch.filter = &Filter_replicas[node];
+    }
+
+    while (true) {
+      WorkUnitRing *ring;
+      pthread_mutex_lock(&Pool_lock);
+      while ((ring = next_filled_ring()) == NULL && ! all_input_done())
+        pthread_cond_wait(&Work_available, &Pool_lock);
+      if (ring == NULL) {
+        pthread_mutex_unlock(&Pool_lock);
+        break;
       }
-      else {
-        ambig_list.push_back(0);
-        uint32_t *val_ptr = Database.kmer_query(
-                              Database.canonical_representation(*kmer_ptr),
-                              &current_bin_key,
-                              &current_min_pos, &current_max_pos
-                            );
-        taxon = val_ptr ? *val_ptr : 0;
-        if (taxon) {
-          hit_counts[taxon]++;
-          if (Quick_mode && ++hits >= Minimum_hit_count)
-            break;
-        }
+      size_t slot = ring->claim_ct++ % ring->size;
+      pthread_mutex_unlock(&Pool_lock);
+
+      double start_time = wall_clock_time();
+      classify_work_unit(ring->units[slot], scratch);
+      busy_time += wall_clock_time() - start_time;
+
+      pthread_mutex_lock(&Pool_lock);
+      ring->states[slot] = UNIT_CLASSIFIED;
+      pthread_cond_signal(&ring->unit_classified);
+      pthread_mutex_unlock(&Pool_lock);
+    }
+
+    #pragma omp atomic
+    classifier_busy_time += busy_time;
+  }  // end parallel section
+}
+
+// Out-of-core classifier stage: claim a batch of Batch_units filled
+// units (or fewer, once input runs out or while serving jobs) and
+// classify it w/ all threads, so its k-mers are looked up in a single
+// sweep of the DB
+void classify_batches() {
+  vector<ClassifyScratch> scratch(Batch_units);
+  SweepBatch batch;
+  vector<pair<WorkUnitRing *, size_t> > claimed;
+  vector<WorkUnit *> units;
+
+  for (size_t i = 0; i < Batch_units; i++) {
+    scratch[i].database = &Database;
+    scratch[i].filter = Filter_filename.empty() ? NULL : &Filter;
+  }
+  while (true) {
+    claimed.clear();
+    pthread_mutex_lock(&Pool_lock);
+    while (claimed.size() < Batch_units) {
+      WorkUnitRing *ring = next_filled_ring();
+      if (ring != NULL) {
+        claimed.push_back(make_pair(ring, ring->claim_ct++ % ring->size));
+        continue;
       }
-      taxa.push_back(taxon);
+      // Jobs' units aren't held back waiting for a full batch
+      if (all_input_done() || (Serving && ! claimed.empty()))
+        break;
+      pthread_cond_wait(&Work_available, &Pool_lock);
+    }
+    pthread_mutex_unlock(&Pool_lock);
+    if (claimed.empty())
+      break;
+
+    double start_time = wall_clock_time();
+    units.clear();
+    for (size_t i = 0; i < claimed.size(); i++)
+      units.push_back(&claimed[i].first->units[claimed[i].second]);
+    classify_batch(units, scratch, batch);
+    classifier_busy_time += (wall_clock_time() - start_time) * Num_threads;
+
+    pthread_mutex_lock(&Pool_lock);
+    for (size_t i = 0; i < claimed.size(); i++) {
+      WorkUnitRing *ring = claimed[i].first;
+      ring->states[claimed[i].second] = UNIT_CLASSIFIED;
+      pthread_cond_signal(&ring->unit_classified);
+    }
+    pthread_mutex_unlock(&Pool_lock);
+  }
+}
+
+// Next active ring w/ a filled, unclaimed unit, taking rings in turn so
+// concurrent jobs share the classifier threads; NULL if there's none
+// (call w/ Pool_lock held)
+WorkUnitRing *next_filled_ring() {
+  size_t ring_ct = Active_rings.size();
+
+  for (size_t i = 0; i < ring_ct; i++) {
+    WorkUnitRing *ring = Active_rings[(Next_ring + i) % ring_ct];
+    if (ring->claim_ct < ring->fill_ct) {
+      Next_ring = (Next_ring + i + 1) % ring_ct;
+      return ring;
+    }
+  }
+  return NULL;
+}
+
+// Call w/ Pool_lock held
+bool all_input_done() {
+  if (Serving)
+    return false;
+  for (size_t i = 0; i < Active_rings.size(); i++)
+    if (! Active_rings[i]->input_done)
+      return false;
+  return true;
+}
+
+// Writer stage: write classified units in order, then return them
+// to the parser
+void *write_output(void *ring_ptr) {
+  WorkUnitRing &ring = *(WorkUnitRing *) ring_ptr;
+
+  while (true) {
+    size_t slot = ring.write_ct % ring.size;
+    pthread_mutex_lock(&Pool_lock);
+    while (ring.states[slot] != UNIT_CLASSIFIED
+           && ! (ring.input_done && ring.write_ct == ring.fill_ct))
+      pthread_cond_wait(&ring.unit_classified, &Pool_lock);
+    bool have_output = ring.states[slot] == UNIT_CLASSIFIED;
+    pthread_mutex_unlock(&Pool_lock);
+    if (! have_output)
+      break;
+
+    double start_time = wall_clock_time();
+    WorkUnit &unit = ring.units[slot];
+    if (ring.output_fd >= 0) {
+      // A job's output goes to its client; once that fails, units are
+      // just drained
+      OutputBuffer &buf = unit.kraken_output;
+      if (! ring.output_failed && buf.size() > 0
+          && ! send_job_message(ring.output_fd, JOB_OUTPUT,
+                                buf.data(), buf.size()))
+        ring.output_failed = true;
+    }
+    else {
+      if (Print_kraken)
+        write_output_buffer(Kraken_output, unit.kraken_output);
+      if (Print_classified) {
+        write_output_buffer(Classified_output, unit.classified_output);
+        if (Output_format == "paired")
+          write_output_buffer(Classified_output2, unit.classified_output2);
+      }
+      if (Print_unclassified) {
+        write_output_buffer(Unclassified_output, unit.unclassified_output);
+        if (Output_format == "paired")
+          write_output_buffer(Unclassified_output2, unit.unclassified_output2);
+      }
+    }
+    ring.sequence_ct += fragment_count(unit);
+    ring.base_ct += unit.input.total_nt + unit.mates.total_nt;
+    ring.classified_ct += unit.classified_ct;
+    if (ring.output_fd < 0 && isatty(fileno(stderr)))
+      cerr << "\rProcessed " << total_sequences + ring.sequence_ct
+           << " sequences (" << total_bases + ring.base_ct << " bp) ...";
+    ring.writer_busy_time += wall_clock_time() - start_time;
+
+    pthread_mutex_lock(&Pool_lock);
+    ring.states[slot] = UNIT_EMPTY;
+    ring.write_ct++;
+    pthread_cond_signal(&ring.unit_emptied);
+    pthread_mutex_unlock(&Pool_lock);
+  }
+  return NULL;
+}
+
+// Serve classification jobs from clients (see jobsocket.hpp) w/ the
+// DB loaded once.  Each connection gets a thread that parses its
+// records into a ring of its own and a writer thread; this thread
+// becomes the classifier threads shared by all jobs.
+void run_server() {
+  static int listen_fd;
+  pthread_t acceptor_thread;
+
+  listen_fd = listen_job_socket(Server_socket);
+  signal(SIGINT, stop_server);
+  signal(SIGTERM, stop_server);
+  Serving = true;
+  if (pthread_create(&acceptor_thread, NULL, accept_jobs, &listen_fd) != 0)
+    errx(EX_OSERR, "unable to create acceptor thread");
+  cerr << "Listening on " << Server_socket << endl;
+  classify_input();
+}
+
+// Remove socket file so it isn't mistaken for a live server's
+void stop_server(int sig) {
+  unlink(Server_socket.c_str());
+  signal(sig, SIG_DFL);
+  raise(sig);
+}
+
+// Each job takes a connection & two threads, so only MAX_SERVER_JOBS
+// are accepted at once
+void *accept_jobs(void *listen_fd_ptr) {
+  int listen_fd = *(int *) listen_fd_ptr;
+
+  while (true) {
+    pthread_mutex_lock(&Pool_lock);
+    while (Running_job_ct >= MAX_SERVER_JOBS)
+      pthread_cond_wait(&Job_ended, &Pool_lock);
+    Running_job_ct++;
+    pthread_mutex_unlock(&Pool_lock);
+
+    int fd = accept_job_connection(listen_fd);
+    pthread_t job_thread;
+    if (pthread_create(&job_thread, NULL, serve_job,
+                       (void *) (intptr_t) fd) != 0) {
+      warnx("unable to create job thread");
+      close(fd);
+      end_job();
+      continue;
+    }
+    pthread_detach(job_thread);
+  }
+  return NULL;
+}
+
+// Let the acceptor take another job in place of one that's ended
+void end_job() {
+  pthread_mutex_lock(&Pool_lock);
+  Running_job_ct--;
+  pthread_cond_signal(&Job_ended);
+  pthread_mutex_unlock(&Pool_lock);
+}
+
+// Run one client's job, ending w/ its stats or an error message; a
+// failed job doesn't affect the server or other jobs
+void *serve_job(void *fd_ptr) {
+  int fd = (int) (intptr_t) fd_ptr;
+  vector<char> message;
+  char type;
+  string error;
+  bool interleaved = false;
+
+  if (! recv_job_message(fd, type, message) || type != JOB_OPTIONS) {
+    error = "expected job options";
+  }
+  else {
+    istringstream options(string(message.begin(), message.end()));
+    string option;
+    while (options >> option) {
+      if (option == "paired")
+        interleaved = true;
+      else
+        error = "unknown job option " + option;
+    }
+  }
+  if (! error.empty()) {
+    send_job_message(fd, JOB_ERROR, error.data(), error.size());
+    close(fd);
+    end_job();
+    return NULL;
+  }
+
+  WorkUnitRing ring;
+  pthread_t writer_thread;
+  double start_time = wall_clock_time();
+  init_ring(ring);
+  ring.output_fd = fd;
+  if (pthread_create(&writer_thread, NULL, write_output, &ring) != 0) {
+    error = "unable to start job";
+    send_job_message(fd, JOB_ERROR, error.data(), error.size());
+    warnx("unable to create writer thread");
+    close(fd);
+    destroy_ring(ring);
+    end_job();
+    return NULL;
+  }
+  pthread_mutex_lock(&Pool_lock);
+  uint64_t job_id = ++Job_ct;
+  Active_rings.push_back(&ring);
+  pthread_mutex_unlock(&Pool_lock);
+
+  error = receive_job_input(ring, fd, interleaved);
+  pthread_join(writer_thread, NULL);
+
+  pthread_mutex_lock(&Pool_lock);
+  for (size_t i = 0; i < Active_rings.size(); i++) {
+    if (Active_rings[i] == &ring) {
+      Active_rings.erase(Active_rings.begin() + i);
+      break;
+    }
+  }
+  Next_ring = 0;
+  pthread_mutex_unlock(&Pool_lock);
+
+  if (error.empty() && ring.output_failed)
+    error = "lost connection to client";
+  if (error.empty()) {
+    string stats = classification_stats(ring.sequence_ct, ring.base_ct,
+                                        ring.classified_ct,
+                                        wall_clock_time() - start_time);
+    send_job_message(fd, JOB_DONE, stats.data(), stats.size());
+    fprintf(stderr, "Job %llu: %llu sequences (%.2f Mbp) in %.3fs\n",
+            (unsigned long long) job_id,
+            (unsigned long long) ring.sequence_ct, ring.base_ct / 1.0e6,
+            wall_clock_time() - start_time);
+  }
+  else {
+    send_job_message(fd, JOB_ERROR, error.data(), error.size());
+    fprintf(stderr, "Job %llu failed: %s\n", (unsigned long long) job_id,
+            error.c_str());
+  }
+  close(fd);
+  destroy_ring(ring);
+  end_job();
+  return NULL;
+}
+
+// Parser stage for a job: fill units w/ records received from its
+// client until the end of input.  Returns an error message if the
+// input was cut short.
+string receive_job_input(WorkUnitRing &ring, int fd, bool interleaved) {
+  string error;
+  char type;
+
+  while (true) {
+    size_t slot = ring.fill_ct % ring.size;
+    pthread_mutex_lock(&Pool_lock);
+    while (ring.states[slot] != UNIT_EMPTY)
+      pthread_cond_wait(&ring.unit_emptied, &Pool_lock);
+    pthread_mutex_unlock(&Pool_lock);
+
+    WorkUnit &unit = ring.units[slot];
+    bool have_input = false;
+    if (! recv_job_message(fd, type, unit.job_data))
+      error = "lost connection to client";
+    else if (type == JOB_RECORDS) {
+      have_input = unpack_records(unit, interleaved);
+      if (! have_input)
+        error = "malformed records";
+    }
+    else if (type != JOB_INPUT_END)
+      error = "unexpected message type";
+
+    pthread_mutex_lock(&Pool_lock);
+    if (have_input) {
+      ring.states[slot] = UNIT_FILLED;
+      ring.fill_ct++;
+      pthread_cond_signal(&Work_available);
+    }
+    else {
+      ring.input_done = true;
+      pthread_cond_broadcast(&ring.unit_classified);
+    }
+    pthread_mutex_unlock(&Pool_lock);
+    if (! have_input)
+      break;
+  }
+  return error;
+}
+
+// Point unit's input records into the JOB_RECORDS message in job_data
+bool unpack_records(WorkUnit &unit, bool interleaved) {
+  vector<char> &data = unit.job_data;
+  size_t pos = 0;
+  uint32_t record_ct, id_len, seq_len;
+
+  unit.input.clear();
+  unit.mates.clear();
+  unit.interleaved = interleaved;
+  if (! read_uint32(data, pos, record_ct)
+      || (interleaved && record_ct % 2 != 0))
+    return false;
+  for (uint32_t i = 0; i < record_ct; i++) {
+    if (! read_uint32(data, pos, id_len) || ! read_uint32(data, pos, seq_len)
+        || data.size() - pos < (uint64_t) id_len + seq_len)
+      return false;
+    SequenceView view;
+    view.id = view.header = data.data() + pos;
+    view.id_len = view.header_len = id_len;
+    view.seq = data.data() + pos + id_len;
+    view.seq_len = seq_len;
+    view.quals = NULL;
+    view.quals_len = 0;
+    unit.input.records.push_back(view);
+    unit.input.total_nt += seq_len;
+    pos += id_len + seq_len;
+  }
+  return true;
+}
+
+void classify_work_unit(WorkUnit &unit, ClassifyScratch &scratch) {
+  scan_work_unit(unit, scratch);
+  lookup_kmers(scratch);
+  classify_fragments(unit, scratch);
+}
+
+// Classify a batch of work units in out-of-core mode: their k-mers are
+// gathered & sorted by bin, then looked up in one sweep of the DB
+void classify_batch(vector<WorkUnit *> &units,
+                    vector<ClassifyScratch> &scratch, SweepBatch &batch)
+{
+  size_t unit_ct = units.size();
+  bool drop = ! Filter_filename.empty() || Shard_db;
+
+  #pragma omp parallel for schedule(dynamic)
+  for (size_t u = 0; u < unit_ct; u++) {
+    scan_work_unit(*units[u], scratch[u]);
+    scratch[u].kmer_taxa.assign(scratch[u].kmers.size(), 0);
+    if (drop)
+      drop_absent_kmers(scratch[u]);
+  }
+  sort_batch_kmers(scratch, unit_ct, batch);
+  sweep_batch(batch);
+
+  // Kept k-mers' taxa go to their places among all of a unit's k-mers
+  vector<BinQuery> &queries = batch.queries;
+  #pragma omp parallel for
+  for (size_t i = 0; i < queries.size(); i++) {
+    ClassifyScratch &unit_scratch = scratch[queries[i].unit];
+    size_t pos = queries[i].pos;
+    if (drop)
+      pos = unit_scratch.filter_hits[pos];
+    unit_scratch.kmer_taxa[pos] = batch.taxa[i];
+  }
+
+  #pragma omp parallel for schedule(dynamic)
+  for (size_t u = 0; u < unit_ct; u++)
+    classify_fragments(*units[u], scratch[u]);
+}
+
+// Clear unit's output, then gather the k-mers of all its fragments
+void scan_work_unit(WorkUnit &unit, ClassifyScratch &scratch) {
+  size_t fragment_ct = fragment_count(unit);
+  SequenceView *dna, *mate;
+
+  unit.classified_ct = 0;
+  unit.kraken_output.clear();
+  unit.classified_output.clear();
+  unit.classified_output2.clear();
+  unit.unclassified_output.clear();
+  unit.unclassified_output2.clear();
+
+  // All of the work unit's k-mers are looked up in one batch
+  scratch.kmers.clear();
+  scratch.bin_keys.clear();
+  scratch.mmer_pos.clear();
+  scratch.ambig_flags.clear();
+  scratch.kmer_cts.clear();
+  for (size_t j = 0; j < fragment_ct; j++) {
+    get_fragment(unit, j, dna, mate);
+    scratch.kmer_cts.push_back(scan_fragment(*dna, mate, scratch));
+  }
+}
+
+// Classify unit's fragments once their k-mers' taxa are in kmer_taxa
+void classify_fragments(WorkUnit &unit, ClassifyScratch &scratch) {
+  size_t fragment_ct = fragment_count(unit);
+  SequenceView *dna, *mate;
+
+  size_t ambig_pos = 0, taxa_pos = 0;
+  for (size_t j = 0; j < fragment_ct; j++) {
+    size_t kmer_ct = scratch.kmer_cts[j];
+    get_fragment(unit, j, dna, mate);
+    if (classify_sequence( *dna, mate, kmer_ct,
+                           scratch.ambig_flags.data() + ambig_pos,
+                           scratch.kmer_taxa.data() + taxa_pos, scratch,
+                           unit.kraken_output,
+                           unit.classified_output, unit.unclassified_output,
+                           unit.classified_output2, unit.unclassified_output2))
+      unit.classified_ct++;
+    for (size_t i = ambig_pos; i < ambig_pos + kmer_ct; i++)
+      taxa_pos += ! scratch.ambig_flags[i];
+    ambig_pos += kmer_ct;
+  }
+}
+
+// Number of fragments (reads, or pairs of mates) in unit
+size_t fragment_count(WorkUnit &unit) {
+  if (unit.interleaved)
+    return unit.input.records.size() / 2;
+  return unit.input.records.size();
+}
+
+// Set dna (and mate, or NULL for unpaired input) to fragment i's reads
+void get_fragment(WorkUnit &unit, size_t i,
+                  SequenceView *&dna, SequenceView *&mate)
+{
+  vector<SequenceView> &records = unit.input.records;
+  mate = NULL;
+  if (unit.interleaved) {
+    dna = &records[2 * i];
+    mate = &records[2 * i + 1];
+  }
+  else {
+    dna = &records[i];
+    if (Paired_input)
+      mate = &unit.mates.records[i];
+  }
+}
+
+void check_mate_ids(WorkUnit &unit) {
+  SequenceView *dna, *mate;
+  size_t fragment_ct = fragment_count(unit);
+
+  for (size_t i = 0; i < fragment_ct; i++) {
+    get_fragment(unit, i, dna, mate);
+    kraken::check_mate_ids(*dna, *mate);
+  }
+}
+
+// Scan dna (and mate) w/ scan_sequence(), returning the number of k-mer
+// positions.  Mates are scanned as if joined by one ambiguous base, so
+// the k-mers spanning the junction are flagged as ambiguous.
+size_t scan_fragment(SequenceView &dna, SequenceView *mate,
+                     ClassifyScratch &scratch)
+{
+  size_t k = Database.get_k();
+  size_t start_ct = scratch.ambig_flags.size();
+
+  scan_sequence(dna, scratch);
+  if (mate != NULL) {
+    size_t joined_len = dna.seq_len + 1 + mate->seq_len;
+    if (joined_len >= k) {
+      size_t first = dna.seq_len + 1 >= k ? dna.seq_len + 1 - k : 0;
+      size_t last = min(dna.seq_len, joined_len - k);
+      scratch.ambig_flags.insert(scratch.ambig_flags.end(),
+                                 last - first + 1, 1);
+    }
+    scan_sequence(*mate, scratch);
+  }
+  return scratch.ambig_flags.size() - start_ct;
+}
+
+// Append the canonical form of each unambiguous k-mer in dna to kmers
+// (and its bin key to bin_keys, and w/ a compact DB its minimizer's
+// position to mmer_pos), and one flag per k-mer position (1 if
+// ambiguous) to ambig_flags
+void scan_sequence(SequenceView &dna, ClassifyScratch &scratch) {
+  uint64_t *kmer_ptr;
+  bool compact = Database.is_compact();
+
+  if (dna.seq_len < Database.get_k())
+    return;
+  KmerScanner scanner(dna.seq, dna.seq_len);
+  while ((kmer_ptr = scanner.next_kmer()) != NULL) {
+    if (scanner.ambig_kmer()) {
+      scratch.ambig_flags.push_back(1);
+    }
+    else {
+      scratch.ambig_flags.push_back(0);
+      uint64_t canonical = Database.canonical_representation(*kmer_ptr);
+      scratch.kmers.push_back(canonical);
+      scratch.bin_keys.push_back(scanner.bin_key());
+      if (compact)
+        scratch.mmer_pos.push_back(
+          scanner.minimizer_pos(canonical != *kmer_ptr));
+    }
+  }
+}
+
+// Set kmer_taxa to the taxa of kmers, skipping DB searches for k-mers
+// the filter (if any) rejects, or outside a shard's bins
+void lookup_kmers(ClassifyScratch &scratch) {
+  size_t kmer_ct = scratch.kmers.size();
+  bool drop = scratch.filter != NULL || Shard_db;
+
+  if (drop)
+    drop_absent_kmers(scratch);
+  vector<uint32_t> &taxa = drop ? scratch.filtered_taxa : scratch.kmer_taxa;
+  taxa.resize(scratch.kmers.size());
+  if (! scratch.kmers.empty())
+    scratch.database->kmer_query_batch(scratch.kmers.data(),
+                                       scratch.kmers.size(),
+                                       taxa.data(),
+                                       scratch.bin_keys.data(),
+                                       scratch.mmer_pos.empty() ? NULL
+                                         : scratch.mmer_pos.data());
+  if (drop) {
+    scratch.kmer_taxa.assign(kmer_ct, 0);
+    for (size_t i = 0; i < scratch.filter_hits.size(); i++)
+      scratch.kmer_taxa[scratch.filter_hits[i]] = taxa[i];
+  }
+}
+
+static bool bin_query_less(const BinQuery &a, const BinQuery &b) {
+  return a.bin_key < b.bin_key || (a.bin_key == b.bin_key && a.kmer < b.kmer);
+}
+
+// Gather a batch's k-mers into its queries, sorted by bin (then by
+// k-mer), and its k-mers, bin keys, & minimizer positions in the same
+// order.  Each unit's k-mers are counted & scattered into partitions of
+// the bins, which are sorted in parallel; part_starts holds each unit's
+// counts, then its next position, in each partition.
+void sort_batch_kmers(vector<ClassifyScratch> &scratch, size_t unit_ct,
+                      SweepBatch &batch)
+{
+  int key_bits = 2 * Database.get_index()->indexed_nt();
+  int shift = max(key_bits - SWEEP_PARTITION_BITS, 0);
+  size_t part_ct = (size_t) 1 << (key_bits - shift);
+  vector<size_t> &part_starts = batch.part_starts;
+  vector<size_t> &part_ends = batch.part_ends;
+  vector<BinQuery> &queries = batch.queries;
+
+  part_starts.assign(unit_ct * part_ct, 0);
+  #pragma omp parallel for schedule(dynamic)
+  for (size_t u = 0; u < unit_ct; u++) {
+    size_t *counts = &part_starts[u * part_ct];
+    vector<uint64_t> &bin_keys = scratch[u].bin_keys;
+    for (size_t i = 0; i < bin_keys.size(); i++)
+      counts[bin_keys[i] >> shift]++;
+  }
+  // Partitions in order, each w/ its k-mers from the units in order
+  size_t n = 0;
+  part_ends.resize(part_ct);
+  for (size_t p = 0; p < part_ct; p++) {
+    for (size_t u = 0; u < unit_ct; u++) {
+      size_t ct = part_starts[u * part_ct + p];
+      part_starts[u * part_ct + p] = n;
+      n += ct;
+    }
+    part_ends[p] = n;
+  }
+
+  queries.resize(n);
+  #pragma omp parallel for schedule(dynamic)
+  for (size_t u = 0; u < unit_ct; u++) {
+    size_t *next = &part_starts[u * part_ct];
+    vector<uint64_t> &kmers = scratch[u].kmers;
+    vector<uint64_t> &bin_keys = scratch[u].bin_keys;
+    for (size_t i = 0; i < kmers.size(); i++) {
+      BinQuery &query = queries[next[bin_keys[i] >> shift]++];
+      query.bin_key = bin_keys[i];
+      query.kmer = kmers[i];
+      query.unit = u;
+      query.pos = i;
+    }
+  }
+  #pragma omp parallel for schedule(dynamic)
+  for (size_t p = 0; p < part_ct; p++)
+    sort(queries.begin() + (p > 0 ? part_ends[p - 1] : 0),
+         queries.begin() + part_ends[p], bin_query_less);
+
+  bool compact = Database.is_compact();
+  batch.kmers.resize(n);
+  batch.bin_keys.resize(n);
+  batch.mmer_pos.resize(compact ? n : 0);
+  #pragma omp parallel for
+  for (size_t i = 0; i < n; i++) {
+    batch.kmers[i] = queries[i].kmer;
+    batch.bin_keys[i] = queries[i].bin_key;
+    if (compact)
+      batch.mmer_pos[i] = scratch[queries[i].unit].mmer_pos[queries[i].pos];
+  }
+}
+
+// Read ahead a window's spans of bins
+static void read_ahead_window(SweepBatch &batch, size_t w) {
+  size_t first_span = w > 0 ? batch.windows[w - 1].span_end : 0;
+  for (size_t i = first_span; i < batch.windows[w].span_end; i++)
+    Database.advise_bins(batch.spans[i].first_bin, batch.spans[i].last_bin,
+                         MADV_WILLNEED);
+}
+
+// Release bins first..last (see advise_bins() for inner), evicting them
+// from the page cache if the kernel can (MADV_DONTNEED only unmaps them)
+static void release_bins(uint64_t first, uint64_t last, bool inner) {
+  #ifdef MADV_PAGEOUT
+  if (Database.advise_bins(first, last, MADV_PAGEOUT, inner))
+    return;
+  #endif
+  Database.advise_bins(first, last, MADV_DONTNEED, inner);
+}
+
+// Release a searched window's spans.  Other threads may be searching
+// the windows on either side, so pages the window shares w/ them are
+// kept, and released once the sweep is done.
+static void release_window(SweepBatch &batch, size_t w) {
+  size_t first_span = w > 0 ? batch.windows[w - 1].span_end : 0;
+  size_t span_end = batch.windows[w].span_end;
+  for (size_t i = first_span; i < span_end; i++)
+    release_bins(batch.spans[i].first_bin, batch.spans[i].last_bin,
+                 i == first_span || i == span_end - 1);
+}
+
+// Out-of-core lookup of a sorted batch: search the DB in bin order, a
+// window of up to Sweep_window_size bytes at a time, w/ the threads
+// taking windows in turn.  Only the bins w/ queries (and small gaps
+// between them) are read, each window Num_threads windows ahead of its
+// search, and released once searched, so a DB larger than RAM is
+// streamed through in order rather than faulted in at random.
+void sweep_batch(SweepBatch &batch) {
+  vector<uint64_t> &bin_keys = batch.bin_keys;
+  vector<BinSpan> &spans = batch.spans;
+  vector<SweepWindow> &windows = batch.windows;
+  size_t n = bin_keys.size();
+
+  // A window holds at least one bin, however large
+  spans.clear();
+  windows.clear();
+  size_t window_first_span = 0;
+  uint64_t window_bytes = 0;
+  for (size_t i = 0; i < n; ) {
+    size_t start = i;
+    uint64_t bin = bin_keys[i];
+    while (i < n && bin_keys[i] == bin)
+      i++;
+    uint64_t bytes = Database.bin_bytes(bin, bin);
+    bool window_open = spans.size() > window_first_span;
+    uint64_t gap = window_open
+                   ? Database.bin_bytes(spans.back().last_bin + 1, bin - 1)
+                   : 0;
+    bool join = window_open && gap <= SWEEP_READ_GAP;
+    if (join)
+      bytes += gap;
+    if (window_open && window_bytes + bytes > Sweep_window_size) {
+      SweepWindow window = { start, spans.size() };
+      windows.push_back(window);
+      window_first_span = spans.size();
+      window_bytes = 0;
+      if (join)
+        bytes -= gap;
+      join = false;
+    }
+    if (join) {
+      spans.back().last_bin = bin;
+    }
+    else {
+      BinSpan span = { bin, bin };
+      spans.push_back(span);
     }
+    window_bytes += bytes;
+  }
+  if (spans.size() > window_first_span) {
+    SweepWindow window = { n, spans.size() };
+    windows.push_back(window);
+  }
+
+  size_t window_ct = windows.size();
+  size_t ahead = Num_threads;
+  batch.taxa.resize(n);
+  for (size_t w = 0; w < min(window_ct, ahead); w++)
+    read_ahead_window(batch, w);
+  #pragma omp parallel for schedule(dynamic, 1)
+  for (size_t w = 0; w < window_ct; w++) {
+    if (w + ahead < window_ct)
+      read_ahead_window(batch, w + ahead);
+    size_t start = w > 0 ? windows[w - 1].query_end : 0;
+    size_t end = windows[w].query_end;
+    Database.kmer_query_batch(batch.kmers.data() + start, end - start,
+                              batch.taxa.data() + start,
+                              bin_keys.data() + start,
+                              batch.mmer_pos.empty() ? NULL
+                                : batch.mmer_pos.data() + start);
+    release_window(batch, w);
+  }
+  if (n > 0)
+    release_bins(bin_keys[0], bin_keys[n - 1], false);
+}
+
+// Blocks ahead in kmers that drop_absent_kmers() prefetches
+const size_t FILTER_PREFETCH_DISTANCE = 16;
+
+// Drop the k-mers (and their bin keys, etc.) that can't be in the DB,
+// being outside a shard's bins or shown absent by the filter, saving
+// the remaining ones' positions in filter_hits
+void drop_absent_kmers(ClassifyScratch &scratch) {
+  KrakenDBFilter *filter = scratch.filter;
+  vector<uint64_t> &kmers = scratch.kmers;
+  vector<uint64_t> &bin_keys = scratch.bin_keys;
+  vector<uint8_t> &mmer_pos = scratch.mmer_pos;
+  size_t kmer_ct = kmers.size(), kept = 0;
+
+  scratch.filter_hits.clear();
+  for (size_t i = 0; i < kmer_ct; i++) {
+    if (Shard_db && (bin_keys[i] < Shard_first_bin
+                     || bin_keys[i] > Shard_last_bin))
+      continue;
+    if (filter != NULL) {
+      if (i + FILTER_PREFETCH_DISTANCE < kmer_ct)
+        filter->prefetch(kmers[i + FILTER_PREFETCH_DISTANCE]);
+      if (! filter->may_contain(kmers[i]))
+        continue;
+    }
+    scratch.filter_hits.push_back(i);
+    kmers[kept] = kmers[i];
+    bin_keys[kept] = bin_keys[i];
+    if (! mmer_pos.empty())
+      mmer_pos[kept] = mmer_pos[i];
+    kept++;
+  }
+  kmers.resize(kept);
+  bin_keys.resize(kept);
+  if (! mmer_pos.empty())
+    mmer_pos.resize(kept);
+}
+
+// ambig_flags and kmer_taxa hold the fragment's section of the results
+// gathered by scan_fragment() and kmer_query_batch()
+// Returns true if the fragment was classified
+bool classify_sequence(SequenceView &dna, SequenceView *mate, size_t kmer_ct,
+                       uint8_t *ambig_flags,
+                       uint32_t *kmer_taxa, ClassifyScratch &scratch,
+                       OutputBuffer &kbuf,
+                       OutputBuffer &cbuf, OutputBuffer &ubuf,
+                       OutputBuffer &cbuf2, OutputBuffer &ubuf2) {
+  TaxonCounter &hit_counts = scratch.hit_counts;
+  vector<HitlistRun> &hitlist = scratch.hitlist;
+  uint32_t taxon = 0;
+  uint32_t hits = 0;  // only maintained if in quick mode
+
+  hit_counts.clear();
+  hitlist.clear();
+  for (size_t i = 0; i < kmer_ct; i++) {
+    int64_t code = -1;
+    taxon = 0;
+    if (! ambig_flags[i]) {
+      taxon = *kmer_taxa++;
+      code = taxon;
+      if (taxon && Quick_mode && ++hits >= Minimum_hit_count)
+        break;
+    }
+    if (Quick_mode)
+      continue;
+    if (taxon)
+      hit_counts.add(taxon);
+    // Extend the run-length encoded hitlist
+    if (! hitlist.empty() && hitlist.back().taxon == code) {
+      hitlist.back().count++;
+    }
+    else {
+      HitlistRun run = { code, 1 };
+      hitlist.push_back(run);
+    }
+  }
+
+  // A shard's hitlist only has its own hits; merge_shards combines
+  // all shards' to make the call
+  if (Partial_output) {
+    kbuf.append("P\t", 2);
+    kbuf.append(dna.id, dna.id_len);
+    kbuf.append('\t');
+    kbuf.append_uint(dna.seq_len + (mate != NULL ? 1 + mate->seq_len : 0));
+    kbuf.append('\t');
+    if (hitlist.empty())
+      kbuf.append("0:0", 3);
+    else
+      print_hitlist(kbuf, hitlist);
+    kbuf.append('\n');
+    return false;
   }
 
   uint32_t call = 0;
   if (Quick_mode)
     call = hits >= Minimum_hit_count ? taxon : 0;
   else
-    call = resolve_tree(hit_counts, Parent_map);
-
-  if (call)
-    #pragma omp atomic
-    total_classified++;
+    call = resolve_tree(hit_counts, Taxonomy_tree);
 
   if (Print_unclassified || Print_classified) {
-    ostringstream *oss_ptr;
-    ostringstream *oss_ptr2;
+    OutputBuffer *buf_ptr;
+    OutputBuffer *buf_ptr2;
     if (call) {
-      oss_ptr = &coss;
-      oss_ptr2 = &coss2;
+      buf_ptr = &cbuf;
+      buf_ptr2 = &cbuf2;
     }
     else {
-      oss_ptr = &uoss;
-      oss_ptr2 = &uoss2;
+      buf_ptr = &ubuf;
+      buf_ptr2 = &ubuf2;
     }
     bool print = call ? Print_classified : Print_unclassified;
-    if (print) {
-      string delimiter = "|";
-      if (Fastq_output && Output_format == "paired") {
-	size_t delimiter_pos = 0;
-	delimiter_pos = dna.header_line.find(delimiter);
-	string header1 = dna.header_line.substr(0, delimiter_pos);
-	string header2 = dna.header_line.substr(delimiter_pos + delimiter.length());
-	delimiter_pos = dna.seq.find(delimiter);
-	string seq1 = dna.seq.substr(0, delimiter_pos);
-	string seq2 = dna.seq.substr(delimiter_pos + delimiter.length());
-	delimiter_pos = dna.quals.find(delimiter);
-	string quals1 = dna.quals.substr(0, delimiter_pos);
-	string quals2 = dna.quals.substr(delimiter_pos + delimiter.length());
-	(*oss_ptr) << "@" << header1 << endl
-		   << seq1 << endl
-		   << "+" << endl
-		   << quals1 << endl;
-	(*oss_ptr2) << "@" << header2 << endl
-		    << seq2 << endl
-		    << "+" << endl
-		    << quals2 << endl;
-      }
-      else if (! Fastq_output && Output_format == "paired") {
-	size_t delimiter_pos = 0;
-	delimiter_pos = dna.header_line.find(delimiter);
-	string header1 = dna.header_line.substr(0, delimiter_pos);
-	string header2 = dna.header_line.substr(delimiter_pos + delimiter.length());
-	delimiter_pos = dna.seq.find(delimiter);
-	string seq1 = dna.seq.substr(0, delimiter_pos);
-	string seq2 = dna.seq.substr(delimiter_pos + delimiter.length());
-	(*oss_ptr) << ">" << header1 << endl
-		   << seq1 << endl;
-	(*oss_ptr2) << ">" << header2 << endl
-		    << seq2 << endl;
-      }
-      else if (Fastq_output && Output_format == "legacy") {
-	(*oss_ptr) << "@" << dna.header_line << endl
-		   << dna.seq << endl
-		   << "+" << endl
-		   << dna.quals << endl;
-      }
-      else if (Fastq_output && Output_format == "interleaved") {
-	size_t delimiter_pos = 0;
-	delimiter_pos = dna.header_line.find(delimiter);
-	string header1 = dna.header_line.substr(0, delimiter_pos);
-	string header2 = dna.header_line.substr(delimiter_pos + delimiter.length());
-	delimiter_pos = dna.seq.find(delimiter);
-	string seq1 = dna.seq.substr(0, delimiter_pos);
-	string seq2 = dna.seq.substr(delimiter_pos + delimiter.length());
-	delimiter_pos = dna.quals.find(delimiter);
-	string quals1 = dna.quals.substr(0, delimiter_pos);
-	string quals2 = dna.quals.substr(delimiter_pos + delimiter.length());
-	(*oss_ptr) << "@" << header1 << endl
-		   << seq1 << endl
-		   << "+" << endl
-		   << quals1 << endl;
-	(*oss_ptr) << "@" << header2 << endl
-		   << seq2 << endl
-		   << "+" << endl
-		   << quals2 << endl;
+    if (print && mate != NULL) {
+      if (Output_format == "paired") {
+        print_record(*buf_ptr, dna);
+        print_record(*buf_ptr2, *mate);
       }
-      else if (! Fastq_output && Output_format == "interleaved") {
-	size_t delimiter_pos = 0;
-	delimiter_pos = dna.header_line.find(delimiter);
-	string header1 = dna.header_line.substr(0, delimiter_pos);
-	string header2 = dna.header_line.substr(delimiter_pos + delimiter.length());
-	delimiter_pos = dna.seq.find(delimiter);
-	string seq1 = dna.seq.substr(0, delimiter_pos);
-	string seq2 = dna.seq.substr(delimiter_pos + delimiter.length());
-	(*oss_ptr) << ">" << header1 << endl
-		   << seq1 << endl;
-	(*oss_ptr) << ">" << header2 << endl
-		   << seq2 << endl;
+      else if (Output_format == "interleaved") {
+        print_record(*buf_ptr, dna);
+        print_record(*buf_ptr, *mate);
       }
-      else if (! Fastq_output && Output_format == "legacy") {
-	(*oss_ptr) << ">" << dna.header_line << endl
-		   << dna.seq << endl;
+      else if (Output_format == "legacy") {
+        // Mates joined by an 'N' (output is FASTA)
+        buf_ptr->append('>');
+        buf_ptr->append(dna.header, dna.header_len);
+        buf_ptr->append('\n');
+        buf_ptr->append(dna.seq, dna.seq_len);
+        buf_ptr->append('N');
+        buf_ptr->append(mate->seq, mate->seq_len);
+        buf_ptr->append('\n');
       }
     }
+    else if (print && Output_format == "legacy") {
+      print_record(*buf_ptr, dna);
+    }
   }
 
   if (! Print_kraken)
-    return;
+    return call;
 
   if (call) {
-    koss << "C\t";
+    kbuf.append("C\t", 2);
   }
   else {
     if (Only_classified_kraken_output)
-      return;
-    koss << "U\t";
+      return call;
+    kbuf.append("U\t", 2);
   }
-  koss << dna.id << "\t" << call << "\t" << dna.seq.size() << "\t";
+  kbuf.append(dna.id, dna.id_len);
+  // Paired length is that of mates joined by one base, as in the old
+  // merged-read format
+  size_t seq_len = dna.seq_len;
+  if (mate != NULL)
+    seq_len += 1 + mate->seq_len;
+  kbuf.append('\t');
+  kbuf.append_uint(call);
+  kbuf.append('\t');
+  kbuf.append_uint(seq_len);
+  kbuf.append('\t');
 
   if (Quick_mode) {
-    koss << "Q:" << hits;
+    kbuf.append("Q:", 2);
+    kbuf.append_uint(hits);
   }
   else {
-    if (taxa.empty())
-      koss << "0:0";
+    if (hitlist.empty())
+      kbuf.append("0:0", 3);
     else
-      koss << hitlist_string(taxa, ambig_list);
+      print_hitlist(kbuf, hitlist);
   }
 
-  koss << endl;
+  kbuf.append('\n');
+  return call;
 }
 
-string hitlist_string(vector<uint32_t> &taxa, vector<uint8_t> &ambig)
+void print_hitlist(OutputBuffer &buf, vector<HitlistRun> &hitlist)
 {
-  int64_t last_code;
-  int code_count = 1;
-  ostringstream hitlist;
-
-  if (ambig[0])   { last_code = -1; }
-  else            { last_code = taxa[0]; }
-
-  for (size_t i = 1; i < taxa.size(); i++) {
-    int64_t code;
-    if (ambig[i]) { code = -1; }
-    else          { code = taxa[i]; }
-
-    if (code == last_code) {
-      code_count++;
-    }
-    else {
-      if (last_code >= 0) {
-        hitlist << last_code << ":" << code_count << " ";
-      }
-      else {
-        hitlist << "A:" << code_count << " ";
-      }
-      code_count = 1;
-      last_code = code;
-    }
-  }
-  if (last_code >= 0) {
-    hitlist << last_code << ":" << code_count;
-  }
-  else {
-    hitlist << "A:" << code_count;
+  for (size_t i = 0; i < hitlist.size(); i++) {
+    if (i > 0)
+      buf.append(' ');
+    if (hitlist[i].taxon >= 0)
+      buf.append_uint(hitlist[i].taxon);
+    else
+      buf.append('A');
+    buf.append(':');
+    buf.append_uint(hitlist[i].count);
   }
-  return hitlist.str();
 }
 
-set<uint32_t> get_ancestry(uint32_t taxon) {
-  set<uint32_t> path;
-
-  while (taxon > 0) {
-    path.insert(taxon);
-    taxon = Parent_map[taxon];
+// Print one sequence in the output format (FASTQ or FASTA)
+void print_record(OutputBuffer &buf, SequenceView &dna) {
+  buf.append(Fastq_output ? '@' : '>');
+  buf.append(dna.header, dna.header_len);
+  buf.append('\n');
+  buf.append(dna.seq, dna.seq_len);
+  buf.append('\n');
+  if (Fastq_output) {
+    buf.append("+\n", 2);
+    buf.append(dna.quals, dna.quals_len);
+    buf.append('\n');
   }
-  return path;
+}
+
+// Large writes bypass the stream's own buffer, so buf isn't copied
+void write_output_buffer(ostream *output, OutputBuffer &buf) {
+  output->write(buf.data(), buf.size());
 }
 
 void parse_command_line(int argc, char **argv) {
@@ -482,7 +1555,7 @@ void parse_command_line(int argc, char **argv) {
 
   if (argc > 1 && strcmp(argv[1], "-h") == 0)
     usage(0);
-  while ((opt = getopt(argc, argv, "d:i:t:u:n:m:o:qfFPcC:O:U:M")) != -1) {
+  while ((opt = getopt(argc, argv, "d:i:t:u:n:m:o:qfFPIKcC:O:U:MN:S:B:L:A:Hb:")) != -1) {
     switch (opt) {
       case 'd' :
         DB_filename = optarg;
@@ -490,6 +1563,9 @@ void parse_command_line(int argc, char **argv) {
       case 'i' :
         Index_filename = optarg;
         break;
+      case 'B' :
+        Filter_filename = optarg;
+        break;
       case 't' :
         sig = atoll(optarg);
         if (sig <= 0)
@@ -542,12 +1618,49 @@ void parse_command_line(int argc, char **argv) {
           errx(EX_USAGE, "can't use nonpositive work unit size");
         Work_unit_size = sig;
         break;
+      case 'b' :
+        sig = atoll(optarg);
+        if (sig <= 0)
+          errx(EX_USAGE, "can't use nonpositive memory budget");
+        Memory_budget = sig << 20;
+        break;
       case 'P' :
 	Paired_input = true;
 	break;
+      case 'I' :
+        Paired_input = Interleaved_input = true;
+        break;
+      case 'K' :
+        Check_mate_ids = true;
+        break;
       case 'M' :
         Populate_memory = true;
         break;
+      case 'A' :
+        Shared_segment = optarg;
+        break;
+      case 'H' :
+        Partial_output = true;
+        break;
+      case 'N' :
+        Numa_placement = optarg;
+        if (Numa_placement != "interleave" && Numa_placement != "replicate")
+          errx(EX_USAGE, "unknown NUMA placement %s", optarg);
+        #ifndef HAVE_NUMA
+        errx(EX_USAGE, "NUMA placement requires building with NUMA=1");
+        #endif
+        break;
+      case 'L' :
+        Server_socket = optarg;
+        break;
+      case 'S' :
+        if (! strcmp(optarg, "binary"))
+          Search_method = BIN_SEARCH_BINARY;
+        else if (! strcmp(optarg, "interpolation"))
+          Search_method = BIN_SEARCH_INTERPOLATION;
+        else
+          errx(EX_USAGE, "unknown search method %s", optarg);
+        break;
       default:
         usage();
         break;
@@ -562,10 +1675,42 @@ void parse_command_line(int argc, char **argv) {
     cerr << "Missing mandatory option -i" << endl;
     usage();
   }
-  if (Nodes_filename.empty() && ! Quick_mode) {
+  if (Partial_output && (Quick_mode || Only_classified_kraken_output
+                         || Print_classified || Print_unclassified)) {
+    cerr << "Partial output (-H) can't be used w/ -q, -c, -C, or -U; "
+         << "merge_shards applies -q & -c" << endl;
+    usage();
+  }
+  if (Memory_budget > 0) {
+    // Released windows of a loaded (or shared) copy would be lost
+    if (Populate_memory || ! Numa_placement.empty()
+        || ! Shared_segment.empty()) {
+      cerr << "Out-of-core mode (-b) can't be used w/ -M, -N, or -A" << endl;
+      usage();
+    }
+    // Up to an eighth of the budget for the DB windows being searched &
+    // read ahead, and the rest for the batch of work units being
+    // classified (and the one being filled meanwhile)
+    Sweep_window_size = min(MAX_SWEEP_WINDOW,
+                            Memory_budget / 8 / (2 * Num_threads));
+    size_t batch_bp = (Memory_budget - 2 * Num_threads * Sweep_window_size)
+                      / SWEEP_BYTES_PER_BP;
+    Batch_units = max((size_t) 1, batch_bp / Work_unit_size);
+  }
+  if (Nodes_filename.empty() && ! Quick_mode && ! Partial_output) {
     cerr << "Must specify one of -q or -n" << endl;
     usage();
   }
+  if (! Server_socket.empty()) {
+    // Jobs' input & output are the clients' business
+    if (optind != argc || Paired_input || Check_mate_ids || Fastq_input
+        || Print_classified || Print_unclassified
+        || ! Kraken_output_file.empty()) {
+      cerr << "Server mode (-L) takes no input files or input/output options" << endl;
+      usage();
+    }
+    return;
+  }
   if (optind == argc) {
     cerr << "No sequence data files specified" << endl;
   }
@@ -573,6 +1718,14 @@ void parse_command_line(int argc, char **argv) {
     cerr << "Can't send paired output to stdout" << endl;
     usage();
   }
+  if (Paired_input && ! Interleaved_input && (argc - optind) % 2 != 0) {
+    cerr << "Paired input requires an even number of files" << endl;
+    usage();
+  }
+  if (Check_mate_ids && ! Paired_input) {
+    cerr << "Checking mate IDs requires paired input" << endl;
+    usage();
+  }
   if ((Output_format == "paired" || Output_format == "interleaved") && ! Paired_input) {
     cerr << "Output format " << Output_format << " requires paired input" << endl;
     usage();
@@ -593,6 +1746,8 @@ void usage(int exit_code) {
        << "Options: (*mandatory)" << endl
        << "* -d filename      Kraken DB filename" << endl
        << "* -i filename      Kraken DB index filename" << endl
+       << "  -B filename      Kraken DB filter filename (skips searches for" << endl
+       << "                   k-mers it shows are absent)" << endl
        << "  -n filename      NCBI Taxonomy nodes file" << endl
        << "  -o filename      Output file for Kraken output" << endl
        << "  -t #             Number of threads" << endl
@@ -604,12 +1759,26 @@ void usage(int exit_code) {
        << "  -O format        [Un]classified output format {legacy, paired}" << endl
        << "  -f               Input is in FASTQ format" << endl
        << "  -F               Output in FASTQ format" << endl
-       << "  -P               Input files are paired." << endl
+       << "  -P               Input is paired; mates are in consecutive files" << endl
+       << "  -I               Input is paired; mates are interleaved" << endl
+       << "  -K               Check that mates' IDs match (ignoring /1, /2)" << endl
        << "  -c               Only include classified reads in output" << endl
        << "  -M               Preload database files" << endl
+       << "  -b #             Out-of-core mode for DBs larger than RAM, w/ a" << endl
+       << "                   memory budget of # MB: a batch of work units'" << endl
+       << "                   k-mers are sorted by bin & searched in one" << endl
+       << "                   pass over the DB, which the threads stream" << endl
+       << "                   through in bin order" << endl
+       << "  -A segment       Attach DB files loaded into segment by db_shm" << endl
+       << "  -H               Print only reads' hitlists, for merge_shards" << endl
+       << "                   (required w/ a DB shard made by db_shard)" << endl
+       << "  -N placement     Place DB in NUMA memory {interleave, replicate}" << endl
+       << "  -S method        Search method for sorted DB bins {binary, interpolation}" << endl
+       << "  -L socket        Serve classification jobs from kraken_client on this" << endl
+       << "                   Unix-domain socket, w/ the DB loaded once" << endl
        << "  -h               Print this message" << endl
        << endl
-       << "At least one FASTA or FASTQ file must be specified." << endl
+       << "At least one FASTA or FASTQ file must be specified, unless serving." << endl
        << "Kraken output is to standard output by default." << endl;
   exit(exit_code);
 }
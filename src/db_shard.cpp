@@ -0,0 +1,171 @@
+/*
+ * Copyright 2013-2019, Derrick Wood, Jennifer Lu <jlu26@jhmi.edu>
+ *
+ * This file is part of the Kraken taxonomic sequence classification system.
+ *
+ * Kraken is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Kraken is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kraken.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Splits a finished DB (after set_lcas) into shards holding ranges of
+// bins, each w/ an index covering only its own bins, so the DB can be
+// spread over machines.  Classify reads against each shard w/ classify
+// -H and combine the results w/ merge_shards.
+
+#include "kraken_headers.hpp"
+#include "quickfile.hpp"
+#include "krakendb.hpp"
+
+using namespace std;
+using namespace kraken;
+
+string DB_filename, Index_filename, Output_prefix;
+int Shard_count = 0;
+
+static void parse_command_line(int argc, char **argv);
+static void usage(int exit_code=EX_USAGE);
+static uint64_t first_bin_at(KrakenDBIndex &idx, uint64_t pos);
+static void write_shard(KrakenDB &db, KrakenDBIndex &idx, int shard,
+                        uint64_t first, uint64_t last);
+
+int main(int argc, char **argv) {
+  parse_command_line(argc, argv);
+
+  QuickFile db_file(DB_filename);
+  KrakenDB db(db_file.ptr());
+  QuickFile idx_file(Index_filename);
+  KrakenDBIndex idx(idx_file.ptr());
+  db.set_index(&idx);
+
+  // Shards get about the same number of k-mers, w/o splitting a bin
+  uint64_t key_ct = db.get_key_ct();
+  uint64_t bin_ct = 1ull << (idx.indexed_nt() * 2);
+  vector<uint64_t> bounds;
+  bounds.push_back(0);
+  for (int i = 1; i < Shard_count; i++)
+    bounds.push_back(first_bin_at(idx, key_ct * i / Shard_count));
+  bounds.push_back(bin_ct);
+  for (int i = 0; i < Shard_count; i++)
+    if (bounds[i + 1] <= bounds[i])
+      errx(EX_DATAERR, "too many shards for a DB w/ these bins");
+
+  for (int i = 0; i < Shard_count; i++)
+    write_shard(db, idx, i, bounds[i], bounds[i + 1] - 1);
+  return 0;
+}
+
+// First bin whose pairs start at or after pos
+static uint64_t first_bin_at(KrakenDBIndex &idx, uint64_t pos) {
+  uint64_t lo = 0, hi = 1ull << (idx.indexed_nt() * 2);
+  while (lo < hi) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    if (idx.at(mid) < pos)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// Writes <prefix>.<shard>.kdb & .idx; the DB keeps the original's
+// header (but for its k-mer count) and layout
+static void write_shard(KrakenDB &db, KrakenDBIndex &idx, int shard,
+                        uint64_t first, uint64_t last)
+{
+  ostringstream prefix;
+  prefix << Output_prefix << "." << shard;
+  string db_name = prefix.str() + ".kdb";
+  string idx_name = prefix.str() + ".idx";
+  uint64_t start = idx.at(first), end = idx.at(last + 1);
+  uint64_t shard_key_ct = end - start;
+  uint64_t key_len = db.get_key_len(), val_len = db.get_val_len();
+
+  vector<char> header(db.get_ptr(), db.get_ptr() + db.header_size());
+  memcpy(&header[48], &shard_key_ct, 8);
+  ofstream db_out(db_name.c_str(), std::ofstream::binary);
+  db_out.write(header.data(), header.size());
+  char *pairs = db.get_pair_ptr();
+  if (db.is_split()) {
+    // Keys, padding to an 8-byte boundary, then values
+    char *vals = pairs + ((db.get_key_ct() * key_len + 7) & ~7ull);
+    uint64_t keys_size = shard_key_ct * key_len;
+    const char padding[8] = { 0 };
+    db_out.write(pairs + start * key_len, keys_size);
+    db_out.write(padding, ((keys_size + 7) & ~7ull) - keys_size);
+    db_out.write(vals + start * val_len, shard_key_ct * val_len);
+  }
+  else {
+    db_out.write(pairs + start * db.pair_size(),
+                 shard_key_ct * db.pair_size());
+  }
+  db_out.close();
+  if (! db_out)
+    err(EX_IOERR, "unable to write %s", db_name.c_str());
+
+  vector<char> contents = idx.slice(first, last);
+  ofstream idx_out(idx_name.c_str(), std::ofstream::binary);
+  idx_out.write(contents.data(), contents.size());
+  idx_out.close();
+  if (! idx_out)
+    err(EX_IOERR, "unable to write %s", idx_name.c_str());
+
+  fprintf(stderr, "Shard %d: bins %llu-%llu, %llu k-mers\n", shard,
+          (unsigned long long) first, (unsigned long long) last,
+          (unsigned long long) shard_key_ct);
+}
+
+static void parse_command_line(int argc, char **argv) {
+  int opt;
+  long long sig;
+
+  if (argc > 1 && strcmp(argv[1], "-h") == 0)
+    usage(0);
+  while ((opt = getopt(argc, argv, "d:i:o:s:")) != -1) {
+    switch (opt) {
+      case 'd' :
+        DB_filename = optarg;
+        break;
+      case 'i' :
+        Index_filename = optarg;
+        break;
+      case 'o' :
+        Output_prefix = optarg;
+        break;
+      case 's' :
+        sig = atoll(optarg);
+        if (sig < 1)
+          errx(EX_USAGE, "must have at least one shard");
+        Shard_count = sig;
+        break;
+      default:
+        usage();
+        break;
+    }
+  }
+
+  if (DB_filename.empty() || Index_filename.empty() || Output_prefix.empty()
+      || Shard_count == 0 || optind != argc)
+    usage();
+}
+
+static void usage(int exit_code) {
+  cerr << "Usage: db_shard [options]" << endl
+       << endl
+       << "Options: (*mandatory)" << endl
+       << "* -d filename      Kraken DB filename" << endl
+       << "* -i filename      Kraken DB index filename" << endl
+       << "* -o prefix        Shards are written to <prefix>.<N>.kdb & .idx" << endl
+       << "* -s #             Number of shards" << endl
+       << "  -h               Print this message" << endl;
+  exit(exit_code);
+}
@@ -0,0 +1,209 @@
+/*
+ * Copyright 2013-2019, Derrick Wood, Jennifer Lu <jlu26@jhmi.edu>
+ *
+ * This file is part of the Kraken taxonomic sequence classification system.
+ *
+ * Kraken is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Kraken is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kraken.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Copies DB files into a named shared memory segment (or a file on a
+// hugetlbfs mount) once, so that any number of classify processes can
+// map them (classify -A) w/o loading or counting them separately
+
+#include "kraken_headers.hpp"
+#include "quickfile.hpp"
+
+using namespace std;
+using namespace kraken;
+
+void parse_command_line(int argc, char **argv);
+void usage(int exit_code=EX_USAGE);
+void load_segment();
+void show_segment();
+void remove_segment();
+
+string Segment_name;
+vector<string> Member_names, Member_filenames;
+bool Remove_segment = false;
+bool Show_segment = false;
+
+int main(int argc, char **argv) {
+  parse_command_line(argc, argv);
+  if (Remove_segment)
+    remove_segment();
+  else if (Show_segment)
+    show_segment();
+  else
+    load_segment();
+  return 0;
+}
+
+void load_segment() {
+  SharedDBHeader header;
+  struct stat sb;
+  const char *name = Segment_name.c_str();
+
+  int fd = open_shared_segment(Segment_name, O_RDWR | O_CREAT | O_EXCL, 0644);
+  if (fd < 0) {
+    if (errno == EEXIST)
+      errx(EX_CANTCREAT, "segment %s exists (remove it w/ -r first)", name);
+    err(EX_CANTCREAT, "unable to create segment %s", name);
+  }
+  // Members start on (huge) page boundaries, so they can be mapped
+  // separately
+  if (fstat(fd, &sb) != 0)
+    err(EX_OSERR, "unable to fstat segment %s", name);
+  uint64_t align = max((uint64_t) getpagesize(), (uint64_t) sb.st_blksize);
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, "KRAKSHM1", 8);
+  header.member_ct = Member_names.size();
+  uint64_t offset = align;
+  for (size_t i = 0; i < Member_names.size(); i++) {
+    SharedDBMember &member = header.members[i];
+    if (stat(Member_filenames[i].c_str(), &sb) != 0)
+      err(EX_NOINPUT, "unable to stat %s", Member_filenames[i].c_str());
+    strncpy(member.name, Member_names[i].c_str(), sizeof(member.name));
+    member.offset = offset;
+    member.size = member.source_size = sb.st_size;
+    member.source_mtime_sec = sb.st_mtim.tv_sec;
+    member.source_mtime_nsec = sb.st_mtim.tv_nsec;
+    offset += (member.size + align - 1) / align * align;
+  }
+
+  if (ftruncate(fd, offset) != 0)
+    err(EX_CANTCREAT, "unable to size segment %s", name);
+  char *seg_ptr = (char *) mmap(0, offset, PROT_READ | PROT_WRITE,
+                                MAP_SHARED, fd, 0);
+  if (seg_ptr == MAP_FAILED)
+    err(EX_OSERR, "unable to mmap segment %s", name);
+  // Header is complete only once all members are in place
+  memcpy(seg_ptr, &header, sizeof(header));
+
+  for (size_t i = 0; i < Member_names.size(); i++) {
+    SharedDBMember &member = header.members[i];
+    const char *filename = Member_filenames[i].c_str();
+    cerr << "Loading " << filename << "... ";
+    int in_fd = open(filename, O_RDONLY);
+    if (in_fd < 0)
+      err(EX_NOINPUT, "unable to open %s", filename);
+    for (uint64_t pos = 0; pos < member.size; ) {
+      ssize_t read_ct = read(in_fd, seg_ptr + member.offset + pos,
+                             min(member.size - pos, (uint64_t) 1 << 30));
+      if (read_ct < 0 && errno == EINTR)
+        continue;
+      if (read_ct <= 0)
+        err(EX_IOERR, "unable to read %s", filename);
+      pos += read_ct;
+    }
+    close(in_fd);
+    cerr << "complete." << endl;
+  }
+
+  ((SharedDBHeader *) seg_ptr)->complete = 1;
+  msync(seg_ptr, offset, MS_SYNC);
+  munmap(seg_ptr, offset);
+  close(fd);
+  cerr << "Segment " << name << " holds " << offset << " bytes" << endl;
+}
+
+void show_segment() {
+  SharedDBHeader header;
+  const char *name = Segment_name.c_str();
+
+  int fd = open_shared_segment(Segment_name, O_RDONLY);
+  if (fd < 0)
+    err(EX_NOINPUT, "unable to open segment %s", name);
+  if (pread(fd, &header, sizeof(header), 0) != (ssize_t) sizeof(header)
+      || memcmp(header.magic, "KRAKSHM1", 8) != 0
+      || header.member_ct > SHARED_DB_MAX_MEMBERS)
+    errx(EX_DATAERR, "%s is not a Kraken DB segment", name);
+  printf("%s: %s\n", name, header.complete ? "complete" : "incomplete");
+  for (uint64_t i = 0; i < header.member_ct; i++) {
+    SharedDBMember &member = header.members[i];
+    printf("  %-8.8s %llu bytes at offset %llu\n", member.name,
+           (unsigned long long) member.size,
+           (unsigned long long) member.offset);
+  }
+  close(fd);
+}
+
+// Processes still attached keep their mappings; memory is freed once
+// they all exit
+void remove_segment() {
+  int ret;
+  if (Segment_name.find('/') != string::npos)
+    ret = unlink(Segment_name.c_str());
+  else
+    ret = shm_unlink(("/" + Segment_name).c_str());
+  if (ret != 0)
+    err(EX_NOINPUT, "unable to remove segment %s", Segment_name.c_str());
+}
+
+void parse_command_line(int argc, char **argv) {
+  int opt;
+
+  if (argc > 1 && strcmp(argv[1], "-h") == 0)
+    usage(0);
+  while ((opt = getopt(argc, argv, "d:i:B:rs")) != -1) {
+    switch (opt) {
+      case 'd' :
+        Member_names.push_back("kdb");
+        Member_filenames.push_back(optarg);
+        break;
+      case 'i' :
+        Member_names.push_back("idx");
+        Member_filenames.push_back(optarg);
+        break;
+      case 'B' :
+        Member_names.push_back("flt");
+        Member_filenames.push_back(optarg);
+        break;
+      case 'r' :
+        Remove_segment = true;
+        break;
+      case 's' :
+        Show_segment = true;
+        break;
+      default:
+        usage();
+        break;
+    }
+  }
+
+  if (optind != argc - 1)
+    usage();
+  Segment_name = argv[optind];
+  if (! Remove_segment && ! Show_segment && Member_names.empty()) {
+    cerr << "No DB files specified" << endl;
+    usage();
+  }
+  if (Member_names.size() > SHARED_DB_MAX_MEMBERS)
+    usage();
+}
+
+void usage(int exit_code) {
+  cerr << "Usage: db_shm [options] <segment name>" << endl
+       << endl
+       << "A name w/ a '/' is a file (e.g., on a hugetlbfs mount); others" << endl
+       << "are POSIX shared memory objects (e.g., /dev/shm/<name>)." << endl
+       << "Options:" << endl
+       << "  -d filename      Kraken DB filename to load" << endl
+       << "  -i filename      Kraken DB index filename to load" << endl
+       << "  -B filename      Kraken DB filter filename to load" << endl
+       << "  -r               Remove segment" << endl
+       << "  -s               Show segment's contents" << endl
+       << "  -h               Print this message" << endl;
+  exit(exit_code);
+}
@@ -24,17 +24,62 @@
 using namespace std;
 using namespace kraken;
 
+// Pair being sorted; key is the k-mer, or its residual w/ compact keys
+typedef struct {
+  uint64_t key;
+  uint32_t val;
+} SortPair;
+
+// Per-thread buffers for sorting partitions, reused across them
+typedef struct {
+  vector<uint64_t> bin_keys, bin_pos;
+  vector<char> pairs;
+  vector<SortPair> sort_pairs, sort_buf;
+} SortScratch;
+
+// Pairs are first scattered by partition: the top bits of their bin key
+const uint64_t PARTITION_BITS = 12;
+// Bins smaller than this are sorted by comparison rather than radix
+const uint64_t RADIX_MIN_PAIRS = 64;
+// Per-thread scratch needed for each pair of the largest partition
+// being sorted (partition copy, bin key, and two SortPair buffers)
+const uint64_t SCRATCH_BYTES_PER_PAIR = 8 + 2 * sizeof(SortPair);
+
 string Input_DB_filename, Output_DB_filename, Index_filename;
+string Filter_filename;
+double Filter_bits_per_kmer = 10;
 uint8_t Bin_key_nt = 15;
 int Num_threads = 1;
 bool Zero_vals = false;
 bool Operate_in_RAM = false;
-// Global until I can find a way to pass this to the sorting function
+bool Compact_keys = false;
+bool Split_arrays = false;
+bool Eytzinger_bins = false;
+bool Compress_index = false;
+// Bytes for sorting in passes (0 to sort all pairs in RAM at once)
+uint64_t Memory_budget = 0;
+// Length of keys in output (residual key length w/ Compact_keys)
 size_t Key_len = 8;
 
-static int pair_cmp(const void *a, const void *b);
 static void parse_command_line(int argc, char **argv);
-static void bin_and_sort_data(KrakenDB &kdb, char *data, KrakenDBIndex &idx);
+static void sort_data(KrakenDB &kdb, uint64_t *offsets,
+                      KrakenDBFilter *filter, ofstream &output_file,
+                      uint64_t header_size);
+static void sort_partition(KrakenDB &kdb, char *data, uint64_t data_begin,
+                           uint64_t *offsets, uint64_t part_begin,
+                           uint64_t part_end, uint64_t first_bin,
+                           uint64_t bin_ct, SortScratch &scratch);
+static void sort_bin(KrakenDB &kdb, char *bin, uint64_t pair_ct,
+                     uint64_t b_key, SortScratch &scratch);
+static void radix_sort(vector<SortPair> &pairs, vector<SortPair> &buf,
+                       uint64_t key_len);
+static bool sort_pair_less(const SortPair &a, const SortPair &b);
+static uint64_t eytzinger_fill(SortPair *dest, const SortPair *sorted,
+                               uint64_t node, uint64_t pair_ct,
+                               uint64_t next);
+static void write_pairs(ofstream &output_file, uint64_t header_size,
+                        const char *data, uint64_t first, uint64_t pair_ct,
+                        uint64_t key_ct, uint64_t val_len);
 static void usage(int exit_code=EX_USAGE);
 
 int main(int argc, char **argv) {
@@ -45,81 +90,386 @@ int main(int argc, char **argv) {
   parse_command_line(argc, argv);
 
   QuickFile input_db_file(Input_DB_filename);
-  KrakenDB *input_db = new KrakenDB(input_db_file.ptr());
-  Key_len = input_db->get_key_len();
-  uint64_t val_len = input_db->get_val_len();
-  uint64_t key_ct = input_db->get_key_ct();
-  input_db->make_index(Index_filename, Bin_key_nt);
-  QuickFile index_file(Index_filename);
-  KrakenDBIndex db_index(index_file.ptr());
-
-  uint64_t skip_len = input_db->header_size();
-  char *header = new char[ skip_len ];
-  memcpy(header, input_db_file.ptr(), skip_len);
-
-  delete input_db;
-  // No longer legit for traversal, but allows access to KDB functions
-  input_db = new KrakenDB(header);
-  input_db_file.close_file();  // Stop using memory-mapped file
+  if (Operate_in_RAM)
+    input_db_file.load_file();
+  KrakenDB input_db(input_db_file.ptr());
+  Key_len = input_db.get_key_len();
+  uint64_t key_ct = input_db.get_key_ct();
+
+  if (Compact_keys
+      && input_db.residual_key_bits(Bin_key_nt) >= input_db.get_key_bits())
+    errx(EX_USAGE, "compact keys would be no smaller w/ %d nt bin keys",
+         (int) Bin_key_nt);
 
-  char *data = new char[ key_ct * (Key_len + val_len) ];
-  // Populate data w/ pairs from DB and sort bins in parallel
-  bin_and_sort_data(*input_db, data, db_index);
+  QuickFile filter_file;
+  KrakenDBFilter filter;
+  if (! Filter_filename.empty()) {
+    uint64_t block_ct = KrakenDBFilter::block_count(key_ct,
+                                                    Filter_bits_per_kmer);
+    filter_file.open_file(Filter_filename, "w",
+                          KrakenDBFilter::file_size(block_ct));
+    filter = KrakenDBFilter(filter_file.ptr(), block_ct,
+                            KrakenDBFilter::hash_count(Filter_bits_per_kmer));
+  }
+
+  // Index is filled in place, so it needn't also be held in RAM
+  QuickFile index_file(Index_filename, "w",
+                       KrakenDBIndex::index_file_size(Bin_key_nt));
+  uint64_t *offsets = KrakenDBIndex::init_index(index_file.ptr(), Bin_key_nt);
 
+  vector<char> output_header = input_db.kraken_header(Compact_keys,
+                                                      Split_arrays,
+                                                      Eytzinger_bins,
+                                                      Bin_key_nt);
   ofstream output_file(Output_DB_filename.c_str(), std::ofstream::binary);
-  output_file.write(header, skip_len);
-  output_file.write(data, key_ct * (Key_len + val_len));
+  output_file.write(output_header.data(), output_header.size());
+  // Sort pairs from DB (and fill filter w/ k-mers) in parallel, writing
+  // them after the header (Key_len is changed to residual key length
+  // w/ Compact_keys)
+  sort_data(input_db, offsets, Filter_filename.empty() ? NULL : &filter,
+            output_file, output_header.size());
   output_file.close();
+  if (! output_file)
+    errx(EX_IOERR, "write error (%s)", Output_DB_filename.c_str());
+  input_db_file.close_file();  // Stop using memory-mapped file
+
+  if (! Filter_filename.empty()) {
+    filter_file.close_file();
+    fprintf(stderr, "Filter: %llu bytes, %d probes, "
+            "est. false positive rate %.3g%%\n",
+            (unsigned long long) KrakenDBFilter::file_size(filter.get_block_ct()),
+            (int) filter.get_hash_ct(),
+            100 * filter.false_positive_rate(key_ct));
+  }
+
+  if (Compress_index) {
+    KrakenDBIndex db_index(index_file.ptr());
+    vector<char> contents = db_index.compressed_index();
+    index_file.close_file();
+    QuickFile compressed_file(Index_filename, "w", contents.size());
+    memcpy(compressed_file.ptr(), contents.data(), contents.size());
+  }
   
   return 0;
 }
 
-static void bin_and_sort_data(KrakenDB &kdb, char *data, KrakenDBIndex &idx) {
-  uint8_t nt = idx.indexed_nt();
-  uint64_t *offsets = idx.get_array();
+static inline uint64_t read_kmer(const char *pair, uint64_t key_len) {
+  uint64_t kmer = 0;
+  memcpy(&kmer, pair, key_len);
+  return kmer;
+}
+
+// Sort the input DB's pairs into bins and write them to the output,
+// filling offsets w/ the bins' starting positions (the index array).
+// Each thread histograms its own slice of the input by partition.
+// Partitions are then sorted in passes, each over a range of
+// partitions that fits Memory_budget (or all of them): threads scatter
+// their slices' pairs from the range, and each partition in it is
+// binned and its bins sorted by a single thread, so no counter is
+// shared between threads.  Each pass's pairs are written as it ends.
+static void sort_data(KrakenDB &kdb, uint64_t *offsets,
+                      KrakenDBFilter *filter, ofstream &output_file,
+                      uint64_t header_size)
+{
+  uint8_t nt = Bin_key_nt;
   uint64_t entries = 1ull << (nt * 2);
+  uint64_t key_ct = kdb.get_key_ct();
   uint64_t key_len = kdb.get_key_len();
   uint64_t val_len = kdb.get_val_len();
   uint64_t pair_size = key_len + val_len;
-  char pair[pair_size];
-
-  ifstream input_file(Input_DB_filename.c_str(), std::ifstream::binary);
-  input_file.seekg(kdb.header_size(), ios_base::beg);
-
-  // Create a copy of the offsets array for use as insertion positions
-  vector<uint64_t> pos(offsets, offsets + entries);
-  for (uint64_t i = 0; i < kdb.get_key_ct(); i++) {
-    input_file.read(pair, pair_size);
-    uint64_t kmer = 0;
-    memcpy(&kmer, pair, key_len);
-    uint64_t b_key = kdb.bin_key(kmer, nt);
-    char *pair_pos = data + pair_size * pos[b_key]++;
-    // Copy pair into correct bin (but not final position)
-    memcpy(pair_pos, pair, pair_size);
-    if (Zero_vals)
-      memset(pair_pos + key_len, 0, val_len);
-  }
-  input_file.close();
-
-  // Sort all bins
-  #pragma omp parallel for schedule(dynamic)
-  for (uint64_t i = 0; i < entries; i++) {
-    qsort(data + offsets[i] * pair_size,
-          offsets[i+1] - offsets[i], pair_size,
-          pair_cmp);
+  char *input = kdb.get_pair_ptr();
+  uint64_t part_bits = min((uint64_t) nt * 2, PARTITION_BITS);
+  uint64_t part_shift = nt * 2 - part_bits;
+  uint64_t part_ct = 1ull << part_bits;
+  int thread_ct = omp_get_max_threads();
+
+  // Per-thread partition counts, later per-thread insertion positions
+  vector<vector<uint64_t> > part_pos(thread_ct,
+                                     vector<uint64_t>(part_ct, 0));
+  #pragma omp parallel for schedule(static,1)
+  for (int t = 0; t < thread_ct; t++) {
+    uint64_t begin = key_ct * t / thread_ct;
+    uint64_t end = key_ct * (t + 1) / thread_ct;
+    uint64_t *counts = part_pos[t].data();
+    for (uint64_t i = begin; i < end; i++) {
+      uint64_t kmer = read_kmer(input + i * pair_size, key_len);
+      if (filter != NULL)
+        filter->insert_atomic(kmer);
+      counts[kdb.bin_key(kmer, nt) >> part_shift]++;
+    }
+  }
+
+  vector<uint64_t> part_offsets(part_ct + 1);
+  uint64_t total = 0;
+  for (uint64_t p = 0; p < part_ct; p++) {
+    part_offsets[p] = total;
+    for (int t = 0; t < thread_ct; t++) {
+      uint64_t ct = part_pos[t][p];
+      part_pos[t][p] = total;
+      total += ct;
+    }
   }
+  part_offsets[part_ct] = total;
+
+  // Ends of passes' partition ranges; w/ a budget, each pass's pairs
+  // plus scratch for its largest partition must fit
+  vector<uint64_t> pass_ends;
+  uint64_t max_pass_ct = key_ct;
+  if (Memory_budget == 0) {
+    pass_ends.push_back(part_ct);
+  }
+  else {
+    max_pass_ct = 0;
+    for (uint64_t p = 0; p < part_ct; ) {
+      uint64_t first = p, max_part_ct = 0;
+      for (; p < part_ct; p++) {
+        uint64_t part_pair_ct = part_offsets[p+1] - part_offsets[p];
+        uint64_t scratch_ct = max(max_part_ct, part_pair_ct);
+        uint64_t bytes = (part_offsets[p+1] - part_offsets[first]) * pair_size
+            + thread_ct * scratch_ct * (pair_size + SCRATCH_BYTES_PER_PAIR);
+        if (bytes > Memory_budget) {
+          if (p == first)
+            errx(EX_USAGE, "memory budget too small (%llu MB needed to sort "
+                 "%llu k-mers in one partition)",
+                 (unsigned long long) (bytes >> 20) + 1,
+                 (unsigned long long) part_pair_ct);
+          break;
+        }
+        max_part_ct = scratch_ct;
+      }
+      pass_ends.push_back(p);
+      max_pass_ct = max(max_pass_ct, part_offsets[p] - part_offsets[first]);
+    }
+    fprintf(stderr, "Sorting in %llu passes\n",
+            (unsigned long long) pass_ends.size());
+  }
+
+  uint64_t sorted_pair_size = pair_size;
+  if (Compact_keys) {
+    uint64_t residual_bits = kdb.residual_key_bits(nt);
+    Key_len = residual_bits / 8 + !! (residual_bits % 8);
+    sorted_pair_size = Key_len + val_len;
+  }
+
+  char *data = new char[ max_pass_ct * pair_size ];
+  uint64_t first_part = 0;
+  for (size_t pass = 0; pass < pass_ends.size(); pass++) {
+    uint64_t last_part = pass_ends[pass];
+    uint64_t pass_begin = part_offsets[first_part];
+    uint64_t pass_end = part_offsets[last_part];
+
+    #pragma omp parallel for schedule(static,1)
+    for (int t = 0; t < thread_ct; t++) {
+      uint64_t begin = key_ct * t / thread_ct;
+      uint64_t end = key_ct * (t + 1) / thread_ct;
+      vector<uint64_t> pos(part_pos[t].begin() + first_part,
+                           part_pos[t].begin() + last_part);
+      for (uint64_t i = begin; i < end; i++) {
+        const char *pair = input + i * pair_size;
+        uint64_t kmer = read_kmer(pair, key_len);
+        uint64_t part = kdb.bin_key(kmer, nt) >> part_shift;
+        if (part < first_part || part >= last_part)
+          continue;
+        char *pair_pos = data + pair_size * (pos[part - first_part]++
+                                             - pass_begin);
+        // Copy pair into correct partition (but not final position)
+        memcpy(pair_pos, pair, pair_size);
+        if (Zero_vals)
+          memset(pair_pos + key_len, 0, val_len);
+      }
+    }
+
+    // Bin and sort the pass's partitions
+    #pragma omp parallel
+    {
+      SortScratch scratch;
+      #pragma omp for schedule(dynamic)
+      for (uint64_t p = first_part; p < last_part; p++) {
+        sort_partition(kdb, data, pass_begin, offsets, part_offsets[p],
+                       part_offsets[p+1], p << part_shift, 1ull << part_shift,
+                       scratch);
+      }
+    }
+
+    // Close gaps left at the end of each compacted bin
+    if (Compact_keys) {
+      uint64_t last_bin = last_part << part_shift;
+      for (uint64_t i = first_part << part_shift; i < last_bin; i++) {
+        uint64_t bin_end = i + 1 < last_bin ? offsets[i+1] : pass_end;
+        memmove(data + (offsets[i] - pass_begin) * sorted_pair_size,
+                data + (offsets[i] - pass_begin) * pair_size,
+                (bin_end - offsets[i]) * sorted_pair_size);
+      }
+    }
+
+    write_pairs(output_file, header_size, data, pass_begin,
+                pass_end - pass_begin, key_ct, val_len);
+    first_part = last_part;
+  }
+  delete[] data;
+  offsets[entries] = key_ct;
 }
 
-static int pair_cmp(const void *a, const void *b) {
-  uint64_t aval = 0, bval = 0;
-  memcpy(&aval, a, Key_len);
-  memcpy(&bval, b, Key_len);
-  if (aval < bval)
-    return -1;
-  else if (aval == bval)
-    return 0;
+// Scatter a partition's pairs into its bins (via a copy), setting the
+// bins' offsets, and sort each bin; data holds pairs from data_begin on
+static void sort_partition(KrakenDB &kdb, char *data, uint64_t data_begin,
+                           uint64_t *offsets, uint64_t part_begin,
+                           uint64_t part_end, uint64_t first_bin,
+                           uint64_t bin_ct, SortScratch &scratch)
+{
+  uint64_t key_len = kdb.get_key_len();
+  uint64_t pair_size = key_len + kdb.get_val_len();
+  uint64_t pair_ct = part_end - part_begin;
+  char *part = data + (part_begin - data_begin) * pair_size;
+
+  scratch.bin_keys.resize(pair_ct);
+  scratch.bin_pos.assign(bin_ct, 0);
+  uint64_t *bin_keys = scratch.bin_keys.data();
+  uint64_t *bin_pos = scratch.bin_pos.data();
+  for (uint64_t i = 0; i < pair_ct; i++) {
+    uint64_t kmer = read_kmer(part + i * pair_size, key_len);
+    bin_keys[i] = kdb.bin_key(kmer, Bin_key_nt) - first_bin;
+    bin_pos[bin_keys[i]]++;
+  }
+  uint64_t pos = part_begin;
+  for (uint64_t b = 0; b < bin_ct; b++) {
+    uint64_t ct = bin_pos[b];
+    offsets[first_bin + b] = bin_pos[b] = pos;
+    pos += ct;
+  }
+
+  scratch.pairs.assign(part, part + pair_ct * pair_size);
+  const char *pairs = scratch.pairs.data();
+  for (uint64_t i = 0; i < pair_ct; i++)
+    memcpy(data + (bin_pos[bin_keys[i]]++ - data_begin) * pair_size,
+           pairs + i * pair_size, pair_size);
+
+  // bin_pos now holds each bin's end
+  for (uint64_t b = 0; b < bin_ct; b++) {
+    uint64_t start = offsets[first_bin + b];
+    sort_bin(kdb, data + (start - data_begin) * pair_size,
+             bin_pos[b] - start, first_bin + b, scratch);
+  }
+}
+
+// Sort a bin's pairs by key (replacing keys w/ residual keys if
+// compacting), packed at the start of the bin's space
+static void sort_bin(KrakenDB &kdb, char *bin, uint64_t pair_ct,
+                     uint64_t b_key, SortScratch &scratch)
+{
+  if (pair_ct == 0)
+    return;
+  uint64_t key_len = kdb.get_key_len();
+  uint64_t val_len = kdb.get_val_len();
+  vector<SortPair> &pairs = scratch.sort_pairs;
+  pairs.resize(pair_ct);
+  for (uint64_t j = 0; j < pair_ct; j++) {
+    uint64_t kmer = read_kmer(bin + j * (key_len + val_len), key_len);
+    uint32_t val = 0;
+    memcpy(&val, bin + j * (key_len + val_len) + key_len, val_len);
+    pairs[j].key = Compact_keys ? kdb.residual_key(kmer, b_key, Bin_key_nt)
+                                : kmer;
+    pairs[j].val = val;
+  }
+
+  if (pair_ct < RADIX_MIN_PAIRS)
+    sort(pairs.begin(), pairs.end(), sort_pair_less);
   else
-    return 1;
+    radix_sort(pairs, scratch.sort_buf, Key_len);
+  // Rearrange into Eytzinger order (see KrakenDB)
+  if (Eytzinger_bins) {
+    scratch.sort_buf.resize(pair_ct);
+    eytzinger_fill(scratch.sort_buf.data(), pairs.data(), 1, pair_ct, 0);
+    pairs.swap(scratch.sort_buf);
+  }
+
+  for (uint64_t j = 0; j < pair_ct; j++) {
+    memcpy(bin + j * (Key_len + val_len), &pairs[j].key, Key_len);
+    memcpy(bin + j * (Key_len + val_len) + Key_len, &pairs[j].val, val_len);
+  }
+}
+
+// LSD radix sort on the low key_len bytes of the keys, a byte per pass;
+// passes where all keys share a digit are skipped
+static void radix_sort(vector<SortPair> &pairs, vector<SortPair> &buf,
+                       uint64_t key_len)
+{
+  uint64_t n = pairs.size();
+  uint64_t counts[8][256];
+  memset(counts, 0, sizeof(counts));
+  for (uint64_t i = 0; i < n; i++)
+    for (uint64_t d = 0; d < key_len; d++)
+      counts[d][(pairs[i].key >> (8 * d)) & 0xff]++;
+
+  buf.resize(n);
+  for (uint64_t d = 0; d < key_len; d++) {
+    uint64_t *pos = counts[d];
+    if (pos[(pairs[0].key >> (8 * d)) & 0xff] == n)
+      continue;
+    uint64_t total = 0;
+    for (int b = 0; b < 256; b++) {
+      uint64_t ct = pos[b];
+      pos[b] = total;
+      total += ct;
+    }
+    for (uint64_t i = 0; i < n; i++)
+      buf[pos[(pairs[i].key >> (8 * d)) & 0xff]++] = pairs[i];
+    pairs.swap(buf);
+  }
+}
+
+static bool sort_pair_less(const SortPair &a, const SortPair &b) {
+  return a.key < b.key;
+}
+
+// In-order traversal of the tree below node, filling each node w/
+// the next sorted pair; returns index of next unused sorted pair
+static uint64_t eytzinger_fill(SortPair *dest, const SortPair *sorted,
+                               uint64_t node, uint64_t pair_ct,
+                               uint64_t next)
+{
+  if (node > pair_ct)
+    return next;
+  next = eytzinger_fill(dest, sorted, 2 * node, pair_ct, next);
+  dest[node - 1] = sorted[next++];
+  return eytzinger_fill(dest, sorted, 2 * node + 1, pair_ct, next);
+}
+
+// Write output pairs first..first + pair_ct - 1 (packed in data) to
+// their place after the header.  W/ split arrays, the file holds all
+// keys, then padding to an 8-byte boundary, then all values.
+static void write_pairs(ofstream &output_file, uint64_t header_size,
+                        const char *data, uint64_t first, uint64_t pair_ct,
+                        uint64_t key_ct, uint64_t val_len)
+{
+  uint64_t pair_size = Key_len + val_len;
+  if (! Split_arrays) {
+    output_file.seekp(header_size + first * pair_size);
+    output_file.write(data, pair_ct * pair_size);
+    return;
+  }
+
+  const uint64_t chunk_ct = 1 << 20;
+  vector<char> buf(chunk_ct * max((uint64_t) Key_len, val_len));
+  output_file.seekp(header_size + first * Key_len);
+  for (uint64_t i = 0; i < pair_ct; i += chunk_ct) {
+    uint64_t ct = min(chunk_ct, pair_ct - i);
+    for (uint64_t j = 0; j < ct; j++)
+      memcpy(&buf[j * Key_len], data + (i + j) * pair_size, Key_len);
+    output_file.write(buf.data(), ct * Key_len);
+  }
+  uint64_t pad_len = (8 - key_ct * Key_len % 8) % 8;
+  if (first == 0) {
+    output_file.seekp(header_size + key_ct * Key_len);
+    output_file.write("\0\0\0\0\0\0\0", pad_len);
+  }
+  output_file.seekp(header_size + key_ct * Key_len + pad_len + first * val_len);
+  for (uint64_t i = 0; i < pair_ct; i += chunk_ct) {
+    uint64_t ct = min(chunk_ct, pair_ct - i);
+    for (uint64_t j = 0; j < ct; j++)
+      memcpy(&buf[j * val_len], data + (i + j) * pair_size + Key_len, val_len);
+    output_file.write(buf.data(), ct * val_len);
+  }
 }
 
 void parse_command_line(int argc, char **argv) {
@@ -128,7 +478,7 @@ void parse_command_line(int argc, char **argv) {
 
   if (argc > 1 && strcmp(argv[1], "-h") == 0)
     usage(0);
-  while ((opt = getopt(argc, argv, "n:d:o:i:t:zM")) != -1) {
+  while ((opt = getopt(argc, argv, "n:d:o:i:t:zMm:csexB:b:")) != -1) {
     switch (opt) {
       case 'n' :
         sig = atoll(optarg);
@@ -148,6 +498,12 @@ void parse_command_line(int argc, char **argv) {
       case 'M' :
         Operate_in_RAM = true;
         break;
+      case 'm' :
+        sig = atoll(optarg);
+        if (sig <= 0)
+          errx(EX_USAGE, "can't use nonpositive memory budget");
+        Memory_budget = (uint64_t) sig << 20;
+        break;
       case 't' :
         sig = atoll(optarg);
         if (sig <= 0)
@@ -162,18 +518,50 @@ void parse_command_line(int argc, char **argv) {
       case 'z' :
         Zero_vals = true;
         break;
+      case 'c' :
+        Compact_keys = true;
+        break;
+      case 's' :
+        Split_arrays = true;
+        break;
+      case 'e' :
+        Eytzinger_bins = true;
+        break;
+      case 'x' :
+        Compress_index = true;
+        break;
+      case 'B' :
+        Filter_filename = optarg;
+        break;
+      case 'b' :
+        Filter_bits_per_kmer = atof(optarg);
+        if (Filter_bits_per_kmer < 1 || Filter_bits_per_kmer > 64)
+          errx(EX_USAGE, "filter bits per k-mer must be between 1 and 64");
+        break;
       default:
         usage();
         break;
     }
   }
 
+  if (Operate_in_RAM && Memory_budget)
+    errx(EX_USAGE, "can't load DB into RAM w/ a memory budget");
   if (Input_DB_filename.empty() || Output_DB_filename.empty()
       || Index_filename.empty())
     usage();
 }
 
 void usage(int exit_code) {
-  cerr << "Usage: db_sort [-z] [-M] [-t threads] [-n nt] <-d input db> <-o output db> <-i output idx>\n";
+  cerr << "Usage: db_sort [-z] [-M | -m MB] [-c] [-s] [-e] [-x] [-B filter [-b bits]] [-t threads] [-n nt] <-d input db> <-o output db> <-i output idx>\n"
+       << "  -M  Load input DB into RAM before scanning it\n"
+       << "  -m  Sort in passes, using about MB megabytes of RAM for\n"
+       << "      pairs (input is re-read each pass)\n"
+       << "  -c  Store compact (residual) keys\n"
+       << "  -s  Store keys and values in separate arrays\n"
+       << "  -e  Store bins in Eytzinger (breadth-first search tree) order\n"
+       << "  -x  Write a compressed (v3) index\n"
+       << "  -B  Write a Bloom filter of the k-mers to given file\n"
+       << "  -b  Filter bits per k-mer (default 10; more is larger\n"
+       << "      w/ fewer false positives)\n";
   exit(exit_code);
 }
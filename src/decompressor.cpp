@@ -0,0 +1,552 @@
+/*
+ * Copyright 2013-2019, Derrick Wood, Jennifer Lu <jlu26@jhmi.edu>
+ *
+ * This file is part of the Kraken taxonomic sequence classification system.
+ *
+ * Kraken is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Kraken is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kraken.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "kraken_headers.hpp"
+#include "decompressor.hpp"
+#include <bzlib.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+using namespace std;
+
+namespace kraken {
+  // Compressed input read from a fd at a time
+  static const size_t STREAM_INPUT_SIZE = 1 << 20;
+  // Largest amount handed to the decompression libraries per call
+  static const size_t MAX_STEP_SIZE = 1 << 30;
+  // Target compressed size of parts decompressed in parallel
+  static const size_t PART_INPUT_SIZE = 1 << 20;
+  // Parts w/ more output than this are decompressed serially instead
+  static const size_t PART_MAX_OUTPUT = PART_INPUT_SIZE << 6;
+  static const size_t PART_SLOTS_PER_THREAD = 2;
+
+  static const char *compression_name(CompressionType type) {
+    switch (type) {
+      case COMPRESSION_GZIP : return "gzip";
+      case COMPRESSION_BZIP2 : return "bzip2";
+      case COMPRESSION_ZSTD : return "zstd";
+      default : return "uncompressed";
+    }
+  }
+
+  CompressionType detect_compression(const char *data, size_t size) {
+    const unsigned char *bytes = (const unsigned char *) data;
+    if (size >= 2 && bytes[0] == 0x1f && bytes[1] == 0x8b)
+      return COMPRESSION_GZIP;
+    if (size >= 4 && memcmp(data, "BZh", 3) == 0
+        && bytes[3] >= '1' && bytes[3] <= '9')
+      return COMPRESSION_BZIP2;
+    if (size >= 4 && bytes[0] == 0x28 && bytes[1] == 0xb5
+        && bytes[2] == 0x2f && bytes[3] == 0xfd)
+      return COMPRESSION_ZSTD;
+    return COMPRESSION_NONE;
+  }
+
+  // Whether c can be the first byte of a member/stream/frame
+  static bool starts_stream(CompressionType type, char c) {
+    switch (type) {
+      case COMPRESSION_GZIP : return (unsigned char) c == 0x1f;
+      case COMPRESSION_BZIP2 : return c == 'B';
+      default : return true;  // zstd handles its own frame checks
+    }
+  }
+
+  // Serial decompression of concatenated members/streams/frames, held
+  // in memory and optionally followed by the rest of a fd's contents.
+  // Output is written directly into the caller's buffer.
+  class DecompressStream {
+    public:
+    DecompressStream(CompressionType type, const char *data, size_t size,
+                     int fd=-1, bool strict=false);
+    ~DecompressStream();
+    size_t read(char *buf, size_t len);
+    bool failed() { return error; }
+
+    private:
+    DecompressStream(const DecompressStream &);
+    DecompressStream &operator=(const DecompressStream &);
+
+    enum StepStatus { STEP_OK, STEP_END, STEP_ERROR };
+    bool refill();
+    void start_stream();
+    StepStatus step(char *buf, size_t len, size_t &out_ct);
+
+    CompressionType type;
+    const char *in_ptr;
+    size_t in_avail;
+    int fd;
+    char *in_buf;  // NULL unless reading from fd
+    bool strict;  // input must end at a member/stream/frame end
+    bool codec_ready, stream_ended, finished, error;
+    z_stream zs;
+    bz_stream bzs;
+    #ifdef HAVE_ZSTD
+    ZSTD_DCtx *zstd_ctx;
+    #endif
+  };
+
+  DecompressStream::DecompressStream(CompressionType type, const char *data,
+                                     size_t size, int fd, bool strict)
+  {
+    this->type = type;
+    this->fd = fd;
+    this->strict = strict;
+    in_buf = NULL;
+    in_ptr = data;
+    in_avail = size;
+    if (fd >= 0) {
+      in_buf = new char[STREAM_INPUT_SIZE];
+      memcpy(in_buf, data, size);
+      in_ptr = in_buf;
+    }
+    codec_ready = false;
+    stream_ended = true;
+    finished = false;
+    error = false;
+    memset(&zs, 0, sizeof(zs));
+    memset(&bzs, 0, sizeof(bzs));
+    #ifdef HAVE_ZSTD
+    zstd_ctx = NULL;
+    #endif
+  }
+
+  DecompressStream::~DecompressStream() {
+    if (codec_ready) {
+      switch (type) {
+        case COMPRESSION_GZIP :
+          inflateEnd(&zs);
+          break;
+        case COMPRESSION_BZIP2 :
+          BZ2_bzDecompressEnd(&bzs);
+          break;
+        #ifdef HAVE_ZSTD
+        case COMPRESSION_ZSTD :
+          ZSTD_freeDCtx(zstd_ctx);
+          break;
+        #endif
+        default :
+          break;
+      }
+    }
+    delete[] in_buf;
+  }
+
+  bool DecompressStream::refill() {
+    if (fd < 0)
+      return false;
+    ssize_t read_ct;
+    do {
+      read_ct = ::read(fd, in_buf, STREAM_INPUT_SIZE);
+    } while (read_ct < 0 && errno == EINTR);
+    if (read_ct < 0)
+      err(EX_IOERR, "read error");
+    if (read_ct == 0) {
+      fd = -1;
+      return false;
+    }
+    in_ptr = in_buf;
+    in_avail = read_ct;
+    return true;
+  }
+
+  void DecompressStream::start_stream() {
+    switch (type) {
+      case COMPRESSION_GZIP :
+        // 15 + 32: gzip or zlib header, detected automatically
+        if (codec_ready ? inflateReset(&zs) : inflateInit2(&zs, 15 + 32))
+          errx(EX_SOFTWARE, "unable to initialize gzip decompression");
+        break;
+      case COMPRESSION_BZIP2 :
+        if (codec_ready)
+          BZ2_bzDecompressEnd(&bzs);
+        memset(&bzs, 0, sizeof(bzs));
+        if (BZ2_bzDecompressInit(&bzs, 0, 0) != BZ_OK)
+          errx(EX_SOFTWARE, "unable to initialize bzip2 decompression");
+        break;
+      #ifdef HAVE_ZSTD
+      case COMPRESSION_ZSTD :
+        if (! codec_ready)
+          zstd_ctx = ZSTD_createDCtx();
+        if (zstd_ctx == NULL)
+          errx(EX_SOFTWARE, "unable to initialize zstd decompression");
+        ZSTD_DCtx_reset(zstd_ctx, ZSTD_reset_session_only);
+        break;
+      #endif
+      default :
+        errx(EX_SOFTWARE, "unsupported compression format");
+    }
+    codec_ready = true;
+  }
+
+  DecompressStream::StepStatus
+  DecompressStream::step(char *buf, size_t len, size_t &out_ct)
+  {
+    size_t in_len = in_avail < MAX_STEP_SIZE ? in_avail : MAX_STEP_SIZE;
+    size_t out_len = len < MAX_STEP_SIZE ? len : MAX_STEP_SIZE;
+    size_t in_ct = 0;
+    StepStatus status = STEP_ERROR;
+    int ret;
+
+    switch (type) {
+      case COMPRESSION_GZIP :
+        zs.next_in = (Bytef *) in_ptr;
+        zs.avail_in = in_len;
+        zs.next_out = (Bytef *) buf;
+        zs.avail_out = out_len;
+        ret = inflate(&zs, Z_NO_FLUSH);
+        in_ct = in_len - zs.avail_in;
+        out_ct = out_len - zs.avail_out;
+        if (ret == Z_STREAM_END)
+          status = STEP_END;
+        else if (ret == Z_OK || ret == Z_BUF_ERROR)
+          status = STEP_OK;
+        break;
+      case COMPRESSION_BZIP2 :
+        bzs.next_in = (char *) in_ptr;
+        bzs.avail_in = in_len;
+        bzs.next_out = buf;
+        bzs.avail_out = out_len;
+        ret = BZ2_bzDecompress(&bzs);
+        in_ct = in_len - bzs.avail_in;
+        out_ct = out_len - bzs.avail_out;
+        if (ret == BZ_STREAM_END)
+          status = STEP_END;
+        else if (ret == BZ_OK)
+          status = STEP_OK;
+        break;
+      #ifdef HAVE_ZSTD
+      case COMPRESSION_ZSTD : {
+        ZSTD_inBuffer input = { in_ptr, in_len, 0 };
+        ZSTD_outBuffer output = { buf, out_len, 0 };
+        size_t zret = ZSTD_decompressStream(zstd_ctx, &output, &input);
+        in_ct = input.pos;
+        out_ct = output.pos;
+        if (! ZSTD_isError(zret))
+          status = zret == 0 ? STEP_END : STEP_OK;
+        break;
+      }
+      #endif
+      default :
+        out_ct = 0;
+        break;
+    }
+    in_ptr += in_ct;
+    in_avail -= in_ct;
+    return status;
+  }
+
+  size_t DecompressStream::read(char *buf, size_t len) {
+    size_t total = 0;
+
+    while (total < len && ! finished) {
+      if (in_avail == 0 && ! refill()) {
+        if (! stream_ended)
+          error = true;  // truncated input
+        finished = true;
+        break;
+      }
+      if (stream_ended) {
+        if (! starts_stream(type, *in_ptr)) {
+          // Trailing garbage is ignored, as by gzip and bzip2
+          error = strict;
+          finished = true;
+          break;
+        }
+        start_stream();
+        stream_ended = false;
+      }
+      size_t out_ct, in_avail_before = in_avail;
+      StepStatus status = step(buf + total, len - total, out_ct);
+      total += out_ct;
+      if (status == STEP_OK && out_ct == 0 && in_avail == in_avail_before)
+        status = STEP_ERROR;  // no progress possible
+      if (status == STEP_ERROR) {
+        error = true;
+        finished = true;
+      }
+      else if (status == STEP_END) {
+        stream_ended = true;
+      }
+    }
+    return total;
+  }
+
+  // Size of BGZF member at p, or 0 if p isn't a BGZF member header
+  static size_t bgzf_member_size(const char *p, size_t avail) {
+    const unsigned char *bytes = (const unsigned char *) p;
+    if (avail < 18 || bytes[0] != 0x1f || bytes[1] != 0x8b || bytes[2] != 8
+        || ! (bytes[3] & 4))
+      return 0;
+    size_t extra_end = 12 + (bytes[10] | (bytes[11] << 8));
+    size_t pos = 12;
+    while (pos + 4 <= extra_end && pos + 6 <= avail) {
+      size_t subfield_len = bytes[pos + 2] | (bytes[pos + 3] << 8);
+      if (bytes[pos] == 'B' && bytes[pos + 1] == 'C' && subfield_len == 2)
+        return (bytes[pos + 4] | (bytes[pos + 5] << 8)) + 1;
+      pos += 4 + subfield_len;
+    }
+    return 0;
+  }
+
+  // Position of first possible gzip member header at/after pos
+  static size_t find_gzip_header(const char *data, size_t size, size_t pos) {
+    while (pos < size) {
+      const char *p = (const char *) memchr(data + pos, 0x1f, size - pos);
+      if (p == NULL)
+        return size;
+      pos = p - data;
+      const unsigned char *bytes = (const unsigned char *) p;
+      // ID bytes, deflate method, and no reserved flags set
+      if (pos + 10 <= size && bytes[1] == 0x8b && bytes[2] == 8
+          && (bytes[3] & 0xe0) == 0)
+        return pos;
+      pos++;
+    }
+    return size;
+  }
+
+  // Position of first possible bzip2 stream header at/after pos
+  static size_t find_bzip2_header(const char *data, size_t size, size_t pos) {
+    static const char block_magic[] = "\x31\x41\x59\x26\x53\x59";
+    static const char end_magic[] = "\x17\x72\x45\x38\x50\x90";
+    while (pos < size) {
+      const char *p = (const char *) memchr(data + pos, 'B', size - pos);
+      if (p == NULL)
+        return size;
+      pos = p - data;
+      // "BZh", block size, then a block (or end of stream)
+      if (pos + 10 <= size && memcmp(p, "BZh", 3) == 0
+          && p[3] >= '1' && p[3] <= '9'
+          && (memcmp(p + 4, block_magic, 6) == 0
+              || memcmp(p + 4, end_magic, 6) == 0))
+        return pos;
+      pos++;
+    }
+    return size;
+  }
+
+  Decompressor::Decompressor(CompressionType type, const char *data,
+                             size_t size, int thread_ct)
+  {
+    this->type = type;
+    this->data = data;
+    this->size = size;
+    serial = NULL;
+    claim_ct = deliver_ct = 0;
+    next_start = 0;
+    deliver_pos = 0;
+    stopping = false;
+    #ifndef HAVE_ZSTD
+    if (type == COMPRESSION_ZSTD)
+      errx(EX_DATAERR, "zstd-compressed input not supported (rebuild w/ ZSTD=1)");
+    #endif
+
+    // Only worth using threads if input can be split
+    if (thread_ct <= 1 || find_part_end(0) >= size) {
+      serial = new DecompressStream(type, data, size);
+      return;
+    }
+
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&part_done, NULL);
+    pthread_cond_init(&slot_freed, NULL);
+    Part empty_part = { 0, 0, NULL, 0, 0, false, false };
+    parts.assign(PART_SLOTS_PER_THREAD * thread_ct, empty_part);
+    threads.resize(thread_ct);
+    for (int i = 0; i < thread_ct; i++)
+      if (pthread_create(&threads[i], NULL, decompress_parts, this) != 0)
+        errx(EX_OSERR, "unable to create decompression thread");
+  }
+
+  Decompressor::Decompressor(CompressionType type, int fd,
+                             const char *prefix, size_t prefix_len)
+  {
+    this->type = type;
+    data = NULL;
+    size = 0;
+    claim_ct = deliver_ct = 0;
+    next_start = 0;
+    deliver_pos = 0;
+    stopping = false;
+    #ifndef HAVE_ZSTD
+    if (type == COMPRESSION_ZSTD)
+      errx(EX_DATAERR, "zstd-compressed input not supported (rebuild w/ ZSTD=1)");
+    #endif
+    serial = new DecompressStream(type, prefix, prefix_len, fd);
+  }
+
+  Decompressor::~Decompressor() {
+    if (! parts.empty()) {
+      stop_threads();
+      for (size_t i = 0; i < parts.size(); i++)
+        delete[] parts[i].output;
+      pthread_cond_destroy(&slot_freed);
+      pthread_cond_destroy(&part_done);
+      pthread_mutex_destroy(&lock);
+    }
+    delete serial;
+  }
+
+  void Decompressor::stop_threads() {
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    pthread_cond_broadcast(&slot_freed);
+    pthread_mutex_unlock(&lock);
+    for (size_t i = 0; i < threads.size(); i++)
+      pthread_join(threads[i], NULL);
+    threads.clear();
+  }
+
+  // End of the part starting at start, at least PART_INPUT_SIZE bytes
+  // later (unless input ends first)
+  size_t Decompressor::find_part_end(size_t start) {
+    size_t target = start + PART_INPUT_SIZE;
+    if (target >= size)
+      return size;
+
+    size_t pos = start;
+    switch (type) {
+      case COMPRESSION_GZIP :
+        // BGZF members give their own size, so cut points are exact
+        while (pos < target) {
+          size_t member_size = bgzf_member_size(data + pos, size - pos);
+          if (member_size == 0)
+            return find_gzip_header(data, size, target);
+          pos += member_size;
+        }
+        return pos < size ? pos : size;
+      case COMPRESSION_BZIP2 :
+        return find_bzip2_header(data, size, target);
+      #ifdef HAVE_ZSTD
+      case COMPRESSION_ZSTD :
+        while (pos < target) {
+          size_t frame_size = ZSTD_findFrameCompressedSize(data + pos,
+                                                           size - pos);
+          if (ZSTD_isError(frame_size))
+            return size;  // serial decompression will report the error
+          pos += frame_size;
+        }
+        return pos < size ? pos : size;
+      #endif
+      default :
+        return size;
+    }
+  }
+
+  // Thread pool body: claim parts in order, decompress each into its
+  // slot's buffer
+  void *Decompressor::decompress_parts(void *decompressor_ptr) {
+    Decompressor &dc = *(Decompressor *) decompressor_ptr;
+
+    pthread_mutex_lock(&dc.lock);
+    while (true) {
+      while (! dc.stopping && dc.next_start < dc.size
+             && dc.claim_ct >= dc.deliver_ct + dc.parts.size())
+        pthread_cond_wait(&dc.slot_freed, &dc.lock);
+      if (dc.stopping || dc.next_start >= dc.size)
+        break;
+      Part &part = dc.parts[dc.claim_ct++ % dc.parts.size()];
+      part.start = dc.next_start;
+      part.end = dc.find_part_end(part.start);
+      dc.next_start = part.end;
+      pthread_mutex_unlock(&dc.lock);
+
+      DecompressStream stream(dc.type, dc.data + part.start,
+                              part.end - part.start, -1, true);
+      part.output_size = 0;
+      while (part.output_size <= PART_MAX_OUTPUT) {
+        if (part.output_size == part.output_capacity) {
+          size_t new_capacity = part.output_capacity
+                                ? part.output_capacity * 2
+                                : 4 * (part.end - part.start);
+          char *new_output = new char[new_capacity];
+          memcpy(new_output, part.output, part.output_size);
+          delete[] part.output;
+          part.output = new_output;
+          part.output_capacity = new_capacity;
+        }
+        size_t read_ct = stream.read(part.output + part.output_size,
+                                     part.output_capacity - part.output_size);
+        if (read_ct == 0)
+          break;
+        part.output_size += read_ct;
+      }
+      bool failed = stream.failed() || part.output_size > PART_MAX_OUTPUT;
+
+      pthread_mutex_lock(&dc.lock);
+      part.failed = failed;
+      part.done = true;
+      pthread_cond_broadcast(&dc.part_done);
+    }
+    pthread_mutex_unlock(&dc.lock);
+    return NULL;
+  }
+
+  size_t Decompressor::read_serial(char *buf, size_t len) {
+    size_t read_ct = serial->read(buf, len);
+    if (serial->failed())
+      errx(EX_DATAERR, "%s decompression error", compression_name(type));
+    return read_ct;
+  }
+
+  size_t Decompressor::read(char *buf, size_t len) {
+    size_t total = 0;
+
+    while (total < len) {
+      if (serial != NULL)
+        return total + read_serial(buf + total, len - total);
+
+      Part &part = parts[deliver_ct % parts.size()];
+      pthread_mutex_lock(&lock);
+      while (! part.done && ! (deliver_ct == claim_ct && next_start >= size))
+        pthread_cond_wait(&part_done, &lock);
+      bool have_part = part.done;
+      pthread_mutex_unlock(&lock);
+      if (! have_part)
+        break;
+
+      if (part.failed) {
+        // Part's start is known to be good (previous part ended cleanly
+        // there), but its end may not be; go serial from its start
+        stop_threads();
+        serial = new DecompressStream(type, data + part.start,
+                                      size - part.start);
+        continue;
+      }
+
+      size_t copy_ct = part.output_size - deliver_pos;
+      if (copy_ct > len - total)
+        copy_ct = len - total;
+      memcpy(buf + total, part.output + deliver_pos, copy_ct);
+      total += copy_ct;
+      deliver_pos += copy_ct;
+      if (deliver_pos == part.output_size) {
+        deliver_pos = 0;
+        pthread_mutex_lock(&lock);
+        part.done = false;
+        deliver_ct++;
+        pthread_cond_broadcast(&slot_freed);
+        pthread_mutex_unlock(&lock);
+      }
+    }
+    return total;
+  }
+}
@@ -0,0 +1,96 @@
+/*
+ * Copyright 2013-2019, Derrick Wood, Jennifer Lu <jlu26@jhmi.edu>
+ *
+ * This file is part of the Kraken taxonomic sequence classification system.
+ *
+ * Kraken is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Kraken is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kraken.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DECOMPRESSOR_HPP
+#define DECOMPRESSOR_HPP
+
+#include "kraken_headers.hpp"
+
+namespace kraken {
+  enum CompressionType {
+    COMPRESSION_NONE,
+    COMPRESSION_GZIP,
+    COMPRESSION_BZIP2,
+    COMPRESSION_ZSTD
+  };
+
+  // Identify compression format from the first bytes of input
+  // (at least DETECT_COMPRESSION_BYTES of them, unless input is shorter)
+  const size_t DETECT_COMPRESSION_BYTES = 4;
+  CompressionType detect_compression(const char *data, size_t size);
+
+  class DecompressStream;
+
+  // Decompresses gzip (including BGZF), bzip2, or zstd input, which may
+  // be several concatenated members/streams/frames.
+  //
+  // When all input is in memory and more than one thread is allowed,
+  // the input is cut into parts at member/stream/frame starts, and the
+  // parts are decompressed by a thread pool and read back in order.
+  // Cut points that can't be located exactly (gzip w/o BGZF headers,
+  // bzip2) are found by searching for the format's magic bytes; if a
+  // part then fails to end cleanly, the rest of the input is
+  // decompressed serially from that part's start.
+  class Decompressor {
+    public:
+    Decompressor(CompressionType type, const char *data, size_t size,
+                 int thread_ct=1);
+    // Input is prefix followed by the rest of fd's contents
+    Decompressor(CompressionType type, int fd,
+                 const char *prefix, size_t prefix_len);
+    ~Decompressor();
+
+    // Decompress up to len bytes into buf; returns 0 at end of input
+    size_t read(char *buf, size_t len);
+
+    private:
+    Decompressor(const Decompressor &);
+    Decompressor &operator=(const Decompressor &);
+
+    typedef struct {
+      size_t start, end;  // compressed range
+      char *output;
+      size_t output_size, output_capacity;
+      bool done, failed;
+    } Part;
+
+    static void *decompress_parts(void *decompressor_ptr);
+    size_t find_part_end(size_t start);
+    size_t read_serial(char *buf, size_t len);
+    void stop_threads();
+
+    CompressionType type;
+    const char *data;
+    size_t size;
+    DecompressStream *serial;  // NULL while reading parallel parts
+
+    // Parallel state; parts are kept in a ring of slots
+    std::vector<Part> parts;
+    std::vector<pthread_t> threads;
+    uint64_t claim_ct;    // parts claimed by threads
+    uint64_t deliver_ct;  // parts fully read
+    size_t next_start;    // start of next unclaimed part
+    size_t deliver_pos;   // read position in current part's output
+    bool stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t part_done, slot_freed;
+  };
+}
+
+#endif
@@ -0,0 +1,163 @@
+/*
+ * Original file Copyright 2013-2015, Derrick Wood <dwood@cs.jhu.edu>
+ * Portions (c) 2017-2018, Florian Breitwieser <fbreitwieser@jhu.edu> as part of KrakenUniq
+ *
+ * This file is part of the Kraken taxonomic sequence classification system.
+ *
+ * Kraken is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Kraken is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kraken.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "kraken_headers.hpp"
+#include "jobsocket.hpp"
+#include <sys/socket.h>
+#include <sys/un.h>
+
+using std::string;
+using std::vector;
+
+namespace kraken {
+
+static void make_address(string &path, struct sockaddr_un &addr) {
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path))
+    errx(EX_USAGE, "socket path too long: %s", path.c_str());
+  strcpy(addr.sun_path, path.c_str());
+}
+
+int listen_job_socket(string path) {
+  struct sockaddr_un addr;
+  struct stat sb;
+
+  make_address(path, addr);
+  if (lstat(path.c_str(), &sb) == 0) {
+    if (! S_ISSOCK(sb.st_mode))
+      errx(EX_USAGE, "%s exists and is not a socket", path.c_str());
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0)
+      errx(EX_UNAVAILABLE, "a server is already listening on %s", path.c_str());
+    if (fd >= 0)
+      close(fd);
+    if (unlink(path.c_str()) != 0)
+      err(EX_OSERR, "unable to remove stale socket %s", path.c_str());
+  }
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    err(EX_OSERR, "unable to create socket");
+  if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0)
+    err(EX_OSERR, "unable to bind socket %s", path.c_str());
+  if (listen(fd, SOMAXCONN) != 0)
+    err(EX_OSERR, "unable to listen on socket %s", path.c_str());
+  return fd;
+}
+
+int connect_job_socket(string path) {
+  struct sockaddr_un addr;
+
+  make_address(path, addr);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    err(EX_OSERR, "unable to create socket");
+  if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0)
+    err(EX_UNAVAILABLE, "unable to connect to server at %s", path.c_str());
+  return fd;
+}
+
+// Running out of descriptors or memory is taken as transient (jobs
+// ending will free them), so it's waited out rather than ending the
+// server; other errors mean listen_fd is unusable
+int accept_job_connection(int listen_fd) {
+  while (true) {
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd >= 0)
+      return fd;
+    if (errno == EINTR || errno == ECONNABORTED || errno == EPROTO)
+      continue;
+    if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS
+        || errno == ENOMEM) {
+      warn("unable to accept connection, retrying");
+      usleep(ACCEPT_RETRY_DELAY_US);
+      continue;
+    }
+    err(EX_OSERR, "unable to accept connection");
+  }
+}
+
+// MSG_NOSIGNAL: a vanished peer is an error return, not a SIGPIPE
+static bool send_fully(int fd, const char *data, size_t size) {
+  while (size > 0) {
+    ssize_t sent = send(fd, data, size, MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR)
+      continue;
+    if (sent <= 0)
+      return false;
+    data += sent;
+    size -= sent;
+  }
+  return true;
+}
+
+static bool recv_fully(int fd, char *data, size_t size) {
+  while (size > 0) {
+    ssize_t received = recv(fd, data, size, 0);
+    if (received < 0 && errno == EINTR)
+      continue;
+    if (received <= 0)
+      return false;
+    data += received;
+    size -= received;
+  }
+  return true;
+}
+
+bool send_job_message(int fd, char type, const char *data, size_t size) {
+  char header[5];
+  uint32_t size32 = size;
+
+  if (size > MAX_JOB_MESSAGE_SIZE)
+    return false;
+  header[0] = type;
+  memcpy(header + 1, &size32, 4);
+  return send_fully(fd, header, 5) && send_fully(fd, data, size);
+}
+
+bool recv_job_message(int fd, char &type, vector<char> &data) {
+  char header[5];
+  uint32_t size;
+
+  if (! recv_fully(fd, header, 5))
+    return false;
+  type = header[0];
+  memcpy(&size, header + 1, 4);
+  if (size > MAX_JOB_MESSAGE_SIZE)
+    return false;
+  data.resize(size);
+  return recv_fully(fd, data.data(), size);
+}
+
+void append_uint32(vector<char> &data, uint32_t value) {
+  const char *bytes = (const char *) &value;
+  data.insert(data.end(), bytes, bytes + 4);
+}
+
+bool read_uint32(const vector<char> &data, size_t &pos, uint32_t &value) {
+  if (data.size() - pos < 4)
+    return false;
+  memcpy(&value, data.data() + pos, 4);
+  pos += 4;
+  return true;
+}
+
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright 2013-2019, Derrick Wood, Jennifer Lu <jlu26@jhmi.edu>
+ *
+ * This file is part of the Kraken taxonomic sequence classification system.
+ *
+ * Kraken is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Kraken is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kraken.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef JOBSOCKET_HPP
+#define JOBSOCKET_HPP
+
+#include "kraken_headers.hpp"
+
+// Messages exchanged w/ a classify server (classify -L) over a
+// Unix-domain socket.  Each is a type byte, a 4-byte length, and that
+// many bytes of data; integers are in host byte order, as both ends
+// are on one machine.
+//
+// A client sends JOB_OPTIONS, any number of JOB_RECORDS, and then
+// JOB_INPUT_END.  The server answers w/ JOB_OUTPUT messages holding
+// the job's Kraken output, in input order, and ends w/ JOB_DONE or,
+// if the job failed, JOB_ERROR.
+
+namespace kraken {
+  enum JobMessageType {
+    // Space-separated words; "paired" means records alternate between
+    // mates 1 and 2
+    JOB_OPTIONS = 'J',
+    // 4-byte record count, then per record 4-byte ID & sequence
+    // lengths followed by the ID & sequence
+    JOB_RECORDS = 'R',
+    JOB_INPUT_END = 'E',
+    JOB_OUTPUT = 'O',
+    // Job's stats report, as classify prints it
+    JOB_DONE = 'D',
+    // Error message text
+    JOB_ERROR = 'X'
+  };
+
+  // Largest message either end accepts
+  const size_t MAX_JOB_MESSAGE_SIZE = 1 << 30;
+  // Pause before accept_job_connection() retries after running short of
+  // descriptors or memory
+  const useconds_t ACCEPT_RETRY_DELAY_US = 100000;
+
+  // Bind & listen on a socket at path, replacing any stale socket file
+  // left by a server that's no longer running
+  int listen_job_socket(std::string path);
+  int connect_job_socket(std::string path);
+  // Waits out transient failures (e.g., too many open files)
+  int accept_job_connection(int listen_fd);
+
+  // Return false if the connection was lost (or, when receiving, the
+  // message was too large)
+  bool send_job_message(int fd, char type, const char *data, size_t size);
+  bool recv_job_message(int fd, char &type, std::vector<char> &data);
+
+  // Append a 4-byte integer to data, or read one at pos
+  void append_uint32(std::vector<char> &data, uint32_t value);
+  bool read_uint32(const std::vector<char> &data, size_t &pos, uint32_t &value);
+}
+
+#endif
@@ -0,0 +1,239 @@
+/*
+ * Copyright 2013-2019, Derrick Wood, Jennifer Lu <jlu26@jhmi.edu>
+ *
+ * This file is part of the Kraken taxonomic sequence classification system.
+ *
+ * Kraken is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Kraken is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kraken.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Thin client for a classify server (classify -L): reads FASTA/FASTQ
+// input here, sends its records as a job, and writes the Kraken output
+// that comes back.  Classification options are the server's.
+
+#include "kraken_headers.hpp"
+#include "jobsocket.hpp"
+#include "seqreader.hpp"
+
+const size_t DEF_WORK_UNIT_SIZE = 500000;
+
+using namespace std;
+using namespace kraken;
+
+void parse_command_line(int argc, char **argv);
+void usage(int exit_code=EX_USAGE);
+void *send_input(void *arg);
+void send_batch(SequenceBatch &batch, SequenceBatch *mates);
+
+string Socket_filename, Kraken_output_file;
+bool Fastq_input = false;
+bool Paired_input = false;
+bool Interleaved_input = false;
+bool Check_mate_ids = false;
+size_t Work_unit_size = DEF_WORK_UNIT_SIZE;
+vector<string> Input_filenames;
+int Server_fd;
+vector<char> Message;  // records being sent
+
+int main(int argc, char **argv) {
+  parse_command_line(argc, argv);
+
+  FILE *output = stdout;
+  if (! Kraken_output_file.empty()) {
+    output = fopen(Kraken_output_file.c_str(), "w");
+    if (output == NULL)
+      err(EX_CANTCREAT, "unable to open %s", Kraken_output_file.c_str());
+  }
+
+  Server_fd = connect_job_socket(Socket_filename);
+  string options = Paired_input ? "paired" : "";
+  if (! send_job_message(Server_fd, JOB_OPTIONS, options.data(),
+                         options.size()))
+    errx(EX_UNAVAILABLE, "lost connection to server");
+
+  // Input is sent by another thread, so output is read as it comes
+  pthread_t sender_thread;
+  if (pthread_create(&sender_thread, NULL, send_input, NULL) != 0)
+    errx(EX_OSERR, "unable to create sender thread");
+
+  vector<char> message;
+  char type;
+  while (true) {
+    if (! recv_job_message(Server_fd, type, message))
+      errx(EX_UNAVAILABLE, "lost connection to server");
+    if (type == JOB_OUTPUT) {
+      if (fwrite(message.data(), 1, message.size(), output) != message.size())
+        err(EX_IOERR, "unable to write output");
+    }
+    else if (type == JOB_DONE) {
+      break;
+    }
+    else if (type == JOB_ERROR) {
+      errx(EX_SOFTWARE, "server error: %.*s", (int) message.size(),
+           message.data());
+    }
+    else {
+      errx(EX_PROTOCOL, "unexpected message type from server");
+    }
+  }
+  pthread_join(sender_thread, NULL);
+  close(Server_fd);
+  if (fflush(output) != 0 || (output != stdout && fclose(output) != 0))
+    err(EX_IOERR, "unable to write output");
+
+  // Server's stats for the job, as classify would report them
+  fwrite(message.data(), 1, message.size(), stderr);
+  return 0;
+}
+
+// Send each file's (or pair of files') records in batches of about
+// Work_unit_size bp, as classify would read them
+void *send_input(void *arg) {
+  SequenceBatch batch, mates;
+
+  for (size_t i = 0; i < Input_filenames.size(); i++) {
+    BlockSequenceReader reader(Input_filenames[i], Fastq_input);
+    if (Paired_input && ! Interleaved_input) {
+      BlockSequenceReader mate_reader(Input_filenames[++i], Fastq_input);
+      // Read mates in lockstep, w/ batch size split between them
+      while (reader.next_batch(batch, (Work_unit_size + 1) / 2)) {
+        size_t record_ct = batch.records.size();
+        mate_reader.next_batch(mates, SIZE_MAX, 1, record_ct);
+        if (mates.records.size() != record_ct)
+          errx(EX_DATAERR, "paired input files have different sequence counts");
+        send_batch(batch, &mates);
+      }
+      if (mate_reader.next_batch(mates, 1, 1, 1))
+        errx(EX_DATAERR, "paired input files have different sequence counts");
+    }
+    else {
+      size_t group_size = Interleaved_input ? 2 : 1;
+      while (reader.next_batch(batch, Work_unit_size, group_size)) {
+        if (batch.records.size() % group_size != 0)
+          errx(EX_DATAERR, "interleaved input has an odd number of sequences");
+        send_batch(batch, NULL);
+      }
+    }
+  }
+  if (! send_job_message(Server_fd, JOB_INPUT_END, NULL, 0))
+    errx(EX_UNAVAILABLE, "lost connection to server");
+  return NULL;
+}
+
+static void append_record(SequenceView &dna) {
+  append_uint32(Message, dna.id_len);
+  append_uint32(Message, dna.seq_len);
+  Message.insert(Message.end(), dna.id, dna.id + dna.id_len);
+  Message.insert(Message.end(), dna.seq, dna.seq + dna.seq_len);
+}
+
+// Send batch's records (alternating w/ those of mates, if not NULL) as
+// one JOB_RECORDS message
+void send_batch(SequenceBatch &batch, SequenceBatch *mates) {
+  size_t record_ct = batch.records.size();
+
+  Message.clear();
+  append_uint32(Message, mates != NULL ? 2 * record_ct : record_ct);
+  for (size_t i = 0; i < record_ct; i++) {
+    if (mates != NULL) {
+      if (Check_mate_ids)
+        check_mate_ids(batch.records[i], mates->records[i]);
+      append_record(batch.records[i]);
+      append_record(mates->records[i]);
+    }
+    else {
+      if (Check_mate_ids && i % 2 == 1)
+        check_mate_ids(batch.records[i - 1], batch.records[i]);
+      append_record(batch.records[i]);
+    }
+  }
+  if (! send_job_message(Server_fd, JOB_RECORDS, Message.data(),
+                         Message.size()))
+    errx(EX_UNAVAILABLE, "lost connection to server");
+}
+
+void parse_command_line(int argc, char **argv) {
+  int opt;
+  long long sig;
+
+  if (argc > 1 && strcmp(argv[1], "-h") == 0)
+    usage(0);
+  while ((opt = getopt(argc, argv, "s:o:u:fPIK")) != -1) {
+    switch (opt) {
+      case 's' :
+        Socket_filename = optarg;
+        break;
+      case 'o' :
+        Kraken_output_file = optarg;
+        break;
+      case 'u' :
+        sig = atoll(optarg);
+        if (sig <= 0)
+          errx(EX_USAGE, "can't use nonpositive work unit size");
+        Work_unit_size = sig;
+        break;
+      case 'f' :
+        Fastq_input = true;
+        break;
+      case 'P' :
+        Paired_input = true;
+        break;
+      case 'I' :
+        Paired_input = Interleaved_input = true;
+        break;
+      case 'K' :
+        Check_mate_ids = true;
+        break;
+      default:
+        usage();
+        break;
+    }
+  }
+
+  if (Socket_filename.empty()) {
+    cerr << "Missing mandatory option -s" << endl;
+    usage();
+  }
+  if (optind == argc) {
+    cerr << "No sequence data files specified" << endl;
+    usage();
+  }
+  if (Paired_input && ! Interleaved_input && (argc - optind) % 2 != 0) {
+    cerr << "Paired input requires an even number of files" << endl;
+    usage();
+  }
+  if (Check_mate_ids && ! Paired_input) {
+    cerr << "Checking mate IDs requires paired input" << endl;
+    usage();
+  }
+  for (int i = optind; i < argc; i++)
+    Input_filenames.push_back(argv[i]);
+}
+
+void usage(int exit_code) {
+  cerr << "Usage: kraken_client [options] <fasta/fastq file(s)>" << endl
+       << endl
+       << "Options: (*mandatory)" << endl
+       << "* -s socket        Socket of a classify server (classify -L)" << endl
+       << "  -o filename      Output file for Kraken output" << endl
+       << "  -u #             Records sent per message (in bp)" << endl
+       << "  -f               Input is in FASTQ format" << endl
+       << "  -P               Input is paired; mates are in consecutive files" << endl
+       << "  -I               Input is paired; mates are interleaved" << endl
+       << "  -K               Check that mates' IDs match (ignoring /1, /2)" << endl
+       << "  -h               Print this message" << endl
+       << endl
+       << "The database and classification options are the server's." << endl
+       << "Kraken output is to standard output by default." << endl;
+  exit(exit_code);
+}
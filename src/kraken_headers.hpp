@@ -24,9 +24,12 @@
 #define _XOPEN_SOURCE 1
 #endif
 
+#include <algorithm>
+#include <cmath>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -34,7 +37,9 @@
 #include <iostream>
 #include <map>
 #include <omp.h>
+#include <pthread.h>
 #include <set>
+#include <signal.h>
 #include <sstream>
 #include <stdint.h>
 #include <string.h>
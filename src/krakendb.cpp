@@ -21,6 +21,11 @@
 #include "krakendb.hpp"
 #include "quickfile.hpp"
 
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define X86_SEARCH_KERNELS
+#endif
+
 using std::string;
 using std::vector;
 
@@ -29,6 +34,42 @@ namespace kraken {
 // File type code for Jellyfish/Kraken DBs
 static const char * DATABASE_FILE_TYPE = "JFLISTDN";
 
+// File type code for Kraken DBs w/ key/value pairs
+static const char * PAIRED_DATABASE_FILE_TYPE = "KRAKCDB1";
+
+// File type code for Kraken DBs w/ keys & values in separate arrays
+static const char * SPLIT_DATABASE_FILE_TYPE = "KRAKSDB1";
+
+// Kraken DB headers are Jellyfish's, followed by an 8-byte layout word:
+// low byte is minimizer length if keys are residuals (0 otherwise),
+// and LAYOUT_EYTZINGER is set if bins are in Eytzinger order
+static const size_t KRAKEN_HEADER_EXTRA = 8;
+static const uint64_t LAYOUT_NT_MASK = 0xff;
+static const uint64_t LAYOUT_EYTZINGER = 0x100;
+
+// Load a key of key_len bytes, plus any bytes after it up to 8; callers
+// mask off the excess.  Keys are followed by at least 4 bytes (their
+// value, or in split DBs the value array), so for key_len >= 4 this
+// stays in the file, and is a single load instead of a memcpy() call.
+static inline uint64_t load_key(const char *ptr, uint64_t key_len) {
+  uint64_t key = 0;
+  if (key_len >= 4)
+    memcpy(&key, ptr, 8);
+  else
+    memcpy(&key, ptr, key_len);
+  return key;
+}
+
+// Position to probe in [min, max], assuming keys there lie between
+// lo_key and hi_key, and are close to uniformly distributed
+static inline int64_t interpolate(uint64_t kmer, uint64_t lo_key,
+                                  uint64_t hi_key, int64_t min, int64_t max)
+{
+  double frac = (double) (kmer - lo_key) / (double) (hi_key - lo_key);
+  int64_t pos = min - 1 + (int64_t) (frac * (max - min + 2));
+  return pos < min ? min : pos > max ? max : pos;
+}
+
 // File type code on Kraken DB index
 // Next byte determines # of indexed nt
 static const char * KRAKEN_INDEX_STRING = "KRAKIDX";
@@ -38,10 +79,229 @@ static const char * KRAKEN_INDEX_STRING = "KRAKIDX";
 // Next byte determines # of indexed nt
 static const char * KRAKEN_INDEX2_STRING = "KRAKIX2";
 
+// File type code for compressed Kraken DB index (v3)
+// Same bin order as v2; next byte determines # of indexed nt, then
+// 8-byte block count & overflow block count, and padding so blocks
+// are cache-line aligned
+static const char * KRAKEN_INDEX3_STRING = "KRAKIX3";
+static const size_t INDEX3_HEADER_SIZE = 64;
+// Each block: 32 14-bit deltas (packed, little-endian), then the
+// 64-bit anchor (offset of block's first bin) that they're added to
+static const uint64_t INDEX3_BLOCK_BINS = 32;
+static const uint64_t INDEX3_BLOCK_SIZE = 64;
+static const uint64_t INDEX3_DELTA_BITS = 14;
+static const uint64_t INDEX3_ANCHOR_POS = 56;
+// Set in anchor if block's offsets are in the overflow table instead
+// (remaining bits then give the block's position there)
+static const uint64_t INDEX3_OVERFLOW = 1ull << 63;
+
+// File type code for a DB shard's index (v4): a slice of a v2 index
+// Next byte determines # of indexed nt, then 8-byte first & last bin
+// keys covered, then offsets (relative to the shard) of those bins
+// and of the end of the last one
+static const char * KRAKEN_INDEX4_STRING = "KRAKIXS";
+static const size_t INDEX4_HEADER_SIZE = 24;
+
+// File type code for Kraken DB filter (blocked Bloom filter)
+// Next 8 bytes give block count, then 1 byte hash count, then padding
+// so blocks are cache-line aligned
+static const char * KRAKEN_FILTER_STRING = "KRAKBLM1";
+static const size_t FILTER_HEADER_SIZE = 64;
+static const uint64_t FILTER_BLOCK_BITS = 512;
+// Each probe takes 9 bits (a position in the block) of a 64-bit hash
+static const uint8_t FILTER_MAX_HASHES = 7;
+
 // XOR mask for minimizer bin keys (allows for better distribution)
 // scrambles minimizer sort order
 static const uint64_t INDEX2_XOR_MASK = 0xe37e28c4271b5a2dULL;
 
+// Number of independent searches kmer_query_batch() keeps in flight
+static const size_t BATCH_QUERY_LANES = 16;
+
+// Bin searches narrow the window until it holds fewer than this many
+// keys, then scan it
+static const int64_t SCAN_WINDOW = 16;
+
+// Key comparison kernels for bin searches.  SIMD kernels load keys w/
+// 8-byte loads, so (like load_key()) need key_len >= 4.  Keys are
+// loaded individually rather than gathered, as gathers are slow (or
+// microcode-mitigated) on many CPUs, and the loads are independent.
+typedef struct {
+  const char *name;
+  // Position in [min, max] of key, or -1 if absent
+  int64_t (*scan)(const char *keys, size_t stride, uint64_t key_len,
+                  uint64_t key, uint64_t mask, int64_t min, int64_t max);
+  // One k-ary search step: compares key to several pivots at once, and
+  // returns pivot's position if one matches, else -1 after narrowing
+  // [*min, *max] to the keys between pivots that may hold it.  NULL
+  // if kernel has none (binary search is used).  Window must hold at
+  // least SCAN_WINDOW keys, and key must be <= mask < 2^63.
+  int64_t (*narrow)(const char *keys, size_t stride, uint64_t key,
+                    uint64_t mask, int64_t *min, int64_t *max);
+} SearchKernels;
+
+static int64_t scan_keys_scalar(const char *keys, size_t stride,
+                                uint64_t key_len, uint64_t key,
+                                uint64_t mask, int64_t min, int64_t max)
+{
+  for (; min <= max; min++)
+    if ((load_key(keys + stride * min, key_len) & mask) == key)
+      return min;
+  return -1;
+}
+
+static const SearchKernels SCALAR_KERNELS = {
+  "scalar", scan_keys_scalar, NULL
+};
+
+#ifdef X86_SEARCH_KERNELS
+// Scans have no data-dependent branches (other than loop's), since
+// keys are unique w/in a bin; lanes past max repeat key at max
+__attribute__((target("avx2")))
+static int64_t scan_keys_avx2(const char *keys, size_t stride,
+                              uint64_t key_len, uint64_t key,
+                              uint64_t mask, int64_t min, int64_t max)
+{
+  __m256i key_vec = _mm256_set1_epi64x(key);
+  __m256i mask_vec = _mm256_set1_epi64x(mask);
+  const char *last = keys + stride * max;
+  int64_t pos = -1;
+  for (; min <= max; min += 4) {
+    const char *first = keys + stride * min;
+    __m256i found = _mm256_set_epi64x(
+      load_key(std::min(first + 3 * stride, last), 8),
+      load_key(std::min(first + 2 * stride, last), 8),
+      load_key(std::min(first + stride, last), 8),
+      load_key(first, 8));
+    found = _mm256_and_si256(found, mask_vec);
+    int eq = _mm256_movemask_pd(_mm256_castsi256_pd(
+               _mm256_cmpeq_epi64(found, key_vec)));
+    pos = eq ? min + __builtin_ctz(eq) : pos;
+  }
+  return pos;
+}
+
+// Four pivots, splitting window into five parts
+__attribute__((target("avx2")))
+static int64_t narrow_avx2(const char *keys, size_t stride, uint64_t key,
+                           uint64_t mask, int64_t *min, int64_t *max)
+{
+  int64_t pivots[5];
+  int64_t width = *max - *min + 1;
+  for (int i = 0; i < 4; i++)
+    pivots[i] = *min + (i + 1) * width / 5;
+  __m256i found = _mm256_set_epi64x(load_key(keys + pivots[3] * stride, 8),
+                                    load_key(keys + pivots[2] * stride, 8),
+                                    load_key(keys + pivots[1] * stride, 8),
+                                    load_key(keys + pivots[0] * stride, 8));
+  found = _mm256_and_si256(found, _mm256_set1_epi64x(mask));
+  __m256i key_vec = _mm256_set1_epi64x(key);
+  int eq = _mm256_movemask_pd(_mm256_castsi256_pd(
+             _mm256_cmpeq_epi64(found, key_vec)));
+  if (eq)
+    return pivots[__builtin_ctz(eq)];
+  // Keys are < 2^63, so signed comparison works
+  int less = _mm256_movemask_pd(_mm256_castsi256_pd(
+               _mm256_cmpgt_epi64(key_vec, found)));
+  int below = __builtin_popcount(less);
+  pivots[4] = *max + 1;
+  if (below > 0)
+    *min = pivots[below - 1] + 1;
+  *max = pivots[below] - 1;
+  return -1;
+}
+
+static const SearchKernels AVX2_KERNELS = {
+  "avx2", scan_keys_avx2, narrow_avx2
+};
+
+__attribute__((target("avx512f")))
+static int64_t scan_keys_avx512(const char *keys, size_t stride,
+                                uint64_t key_len, uint64_t key,
+                                uint64_t mask, int64_t min, int64_t max)
+{
+  __m512i key_vec = _mm512_set1_epi64(key);
+  __m512i mask_vec = _mm512_set1_epi64(mask);
+  const char *last = keys + stride * max;
+  long long lanes[8];
+  int64_t pos = -1;
+  for (; min <= max; min += 8) {
+    const char *first = keys + stride * min;
+    for (int i = 0; i < 8; i++)
+      lanes[i] = load_key(std::min(first + i * stride, last), 8);
+    __m512i found = _mm512_and_si512(_mm512_loadu_si512(lanes), mask_vec);
+    __mmask8 eq = _mm512_cmpeq_epi64_mask(found, key_vec);
+    pos = eq ? min + __builtin_ctz(eq) : pos;
+  }
+  return pos;
+}
+
+// Eight pivots, splitting window into nine parts
+__attribute__((target("avx512f")))
+static int64_t narrow_avx512(const char *keys, size_t stride, uint64_t key,
+                             uint64_t mask, int64_t *min, int64_t *max)
+{
+  int64_t pivots[9];
+  long long lanes[8];
+  int64_t width = *max - *min + 1;
+  for (int i = 0; i < 8; i++) {
+    pivots[i] = *min + (i + 1) * width / 9;
+    lanes[i] = load_key(keys + pivots[i] * stride, 8);
+  }
+  __m512i found = _mm512_and_si512(_mm512_loadu_si512(lanes),
+                                   _mm512_set1_epi64(mask));
+  __m512i key_vec = _mm512_set1_epi64(key);
+  __mmask8 eq = _mm512_cmpeq_epi64_mask(found, key_vec);
+  if (eq)
+    return pivots[__builtin_ctz(eq)];
+  int below = __builtin_popcount(_mm512_cmplt_epu64_mask(found, key_vec));
+  pivots[8] = *max + 1;
+  if (below > 0)
+    *min = pivots[below - 1] + 1;
+  *max = pivots[below] - 1;
+  return -1;
+}
+
+static const SearchKernels AVX512_KERNELS = {
+  "avx512", scan_keys_avx512, narrow_avx512
+};
+#endif
+
+// Best kernels CPU supports
+static const SearchKernels *select_search_kernels() {
+  #ifdef X86_SEARCH_KERNELS
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f"))
+    return &AVX512_KERNELS;
+  if (__builtin_cpu_supports("avx2"))
+    return &AVX2_KERNELS;
+  #endif
+  return &SCALAR_KERNELS;
+}
+
+static const SearchKernels *Search_kernels = select_search_kernels();
+
+const char *search_kernel() {
+  return Search_kernels->name;
+}
+
+bool set_search_kernel(const string &name) {
+  const SearchKernels *kernels = NULL;
+  if (name == SCALAR_KERNELS.name)
+    kernels = &SCALAR_KERNELS;
+  #ifdef X86_SEARCH_KERNELS
+  __builtin_cpu_init();
+  if (name == AVX2_KERNELS.name && __builtin_cpu_supports("avx2"))
+    kernels = &AVX2_KERNELS;
+  if (name == AVX512_KERNELS.name && __builtin_cpu_supports("avx512f"))
+    kernels = &AVX512_KERNELS;
+  #endif
+  if (kernels == NULL)
+    return false;
+  Search_kernels = kernels;
+  return true;
+}
+
 // Basic constructor
 KrakenDB::KrakenDB() {
   fptr = NULL;
@@ -51,13 +311,28 @@ KrakenDB::KrakenDB() {
   key_len = 0;
   key_bits = 0;
   k = 0;
+  kraken_format = false;
+  compact = false;
+  split = false;
+  eytzinger = false;
+  search_method = BIN_SEARCH_BINARY;
+  key_base = val_base = NULL;
+  key_stride = val_stride = 0;
+  stored_key_bits = 0;
+  mmer_nt = 0;
+  mmer_xor_mask = 0;
 }
 
 // Assumes ptr points to start of a readable mmap'ed file
 KrakenDB::KrakenDB(char *ptr) {
   index_ptr = NULL;
   fptr = ptr;
-  if (strncmp(ptr, DATABASE_FILE_TYPE, strlen(DATABASE_FILE_TYPE)))
+  split = ! strncmp(ptr, SPLIT_DATABASE_FILE_TYPE,
+                    strlen(SPLIT_DATABASE_FILE_TYPE));
+  kraken_format = split || ! strncmp(ptr, PAIRED_DATABASE_FILE_TYPE,
+                                     strlen(PAIRED_DATABASE_FILE_TYPE));
+  if (! kraken_format
+      && strncmp(ptr, DATABASE_FILE_TYPE, strlen(DATABASE_FILE_TYPE)))
     errx(EX_DATAERR, "database in improper format");
   memcpy(&key_bits, ptr + 8, 8);
   memcpy(&val_len, ptr + 16, 8);
@@ -65,36 +340,33 @@ KrakenDB::KrakenDB(char *ptr) {
   if (val_len != 4)
     errx(EX_DATAERR, "can only handle 4 byte DB values");
   k = key_bits / 2;
-  key_len = key_bits / 8 + !! (key_bits % 8);
-}
-
-// Creates an index, indicating starting positions of each bin
-// Bins contain k-mer/taxon pairs with k-mers that share a bin key
-void KrakenDB::make_index(string index_filename, uint8_t nt) {
-  uint64_t entries = 1ull << (nt * 2);
-  vector<uint64_t> bin_counts(entries);
-  char *ptr = get_pair_ptr();
-  #pragma omp parallel for schedule(dynamic,400)
-  for (uint64_t i = 0; i < key_ct; i++) {
-    uint64_t kmer = 0;
-    memcpy(&kmer, ptr + i * pair_size(), key_len);
-    uint64_t b_key = bin_key(kmer, nt);
-    #pragma omp atomic
-    bin_counts[b_key]++;
+  stored_key_bits = key_bits;
+  mmer_nt = 0;
+  mmer_xor_mask = 0;
+  compact = eytzinger = false;
+  search_method = BIN_SEARCH_BINARY;
+  if (kraken_format) {
+    uint64_t layout;
+    memcpy(&layout, ptr + header_size() - KRAKEN_HEADER_EXTRA, 8);
+    mmer_nt = layout & LAYOUT_NT_MASK;
+    compact = mmer_nt != 0;
+    eytzinger = layout & LAYOUT_EYTZINGER;
   }
+  if (compact)
+    stored_key_bits = residual_key_bits(mmer_nt);
+  key_len = stored_key_bits / 8 + !! (stored_key_bits % 8);
 
-  uint64_t *bin_offsets = new uint64_t[ entries + 1 ];
-  bin_offsets[0] = 0;
-  for (uint64_t i = 1; i <= entries; i++)
-    bin_offsets[i] = bin_offsets[i-1] + bin_counts[i-1];
-
-  QuickFile idx_file(index_filename, "w",
-    strlen(KRAKEN_INDEX2_STRING) + 1 + sizeof(*bin_offsets) * (entries + 1));
-  char *idx_ptr = idx_file.ptr();
-  memcpy(idx_ptr, KRAKEN_INDEX2_STRING, strlen(KRAKEN_INDEX2_STRING));
-  idx_ptr += strlen(KRAKEN_INDEX2_STRING);
-  memcpy(idx_ptr++, &nt, 1);
-  memcpy(idx_ptr, bin_offsets, sizeof(*bin_offsets) * (entries + 1));
+  key_base = get_pair_ptr();
+  if (split) {
+    // Value array starts at next 8-byte boundary after key array
+    key_stride = key_len;
+    val_base = key_base + ((key_ct * key_len + 7) & ~7ull);
+    val_stride = val_len;
+  }
+  else {
+    key_stride = val_stride = pair_size();
+    val_base = key_base + key_len;
+  }
 }
 
 // Simple accessor
@@ -115,6 +387,11 @@ KrakenDBIndex *KrakenDB::get_index() {
 // Associates the index with this database
 void KrakenDB::set_index(KrakenDBIndex *i_ptr) {
   index_ptr = i_ptr;
+  if (compact) {
+    if (i_ptr->indexed_nt() != mmer_nt)
+      errx(EX_DATAERR, "index doesn't match compact database");
+    mmer_xor_mask = i_ptr->xor_mask();
+  }
 }
 
 // Simple accessors/convenience methods
@@ -124,7 +401,36 @@ uint64_t KrakenDB::get_key_len() { return key_len; }
 uint64_t KrakenDB::get_val_len() { return val_len; }
 uint64_t KrakenDB::get_key_ct() { return key_ct; }
 uint64_t KrakenDB::pair_size() { return key_len + val_len; }
-size_t KrakenDB::header_size() { return 72 + 2 * (4 + 8 * key_bits); }
+bool KrakenDB::is_compact() { return compact; }
+bool KrakenDB::is_split() { return split; }
+bool KrakenDB::is_eytzinger() { return eytzinger; }
+size_t KrakenDB::header_size() {
+  return 72 + 2 * (4 + 8 * key_bits) + (kraken_format ? KRAKEN_HEADER_EXTRA : 0);
+}
+
+void KrakenDB::set_search_method(BinSearchMethod method) {
+  search_method = method;
+}
+
+// Copy of Jellyfish header, relabeled and extended w/ layout word
+// (plain copy if layout is Jellyfish's)
+vector<char> KrakenDB::kraken_header(bool residual_keys, bool split_arrays,
+                                     bool eytzinger_bins, uint8_t idx_nt)
+{
+  if (kraken_format)
+    errx(EX_SOFTWARE, "database already has a Kraken header");
+  vector<char> header(fptr, fptr + header_size());
+  if (! residual_keys && ! split_arrays && ! eytzinger_bins)
+    return header;
+  const char *file_type = split_arrays ? SPLIT_DATABASE_FILE_TYPE
+                                       : PAIRED_DATABASE_FILE_TYPE;
+  memcpy(header.data(), file_type, strlen(file_type));
+  uint64_t layout = residual_keys ? idx_nt : 0;
+  if (eytzinger_bins)
+    layout |= LAYOUT_EYTZINGER;
+  header.insert(header.end(), (char *) &layout, (char *) &layout + 8);
+  return header;
+}
 
 // Bin key: each k-mer is made of several overlapping m-mers, m < k
 // The bin key is the m-mer whose canonical representation is "smallest"
@@ -136,8 +442,12 @@ uint64_t KrakenDB::bin_key(uint64_t kmer, uint64_t idx_nt) {
   mask--;
   xor_mask &= mask;
   uint64_t min_bin_key = ~0;
+  // Each m-mer's rev. comp. is a window of the k-mer's rev. comp.
+  uint64_t revcom = reverse_complement(kmer, key_bits / 2);
   for (uint64_t i = 0; i < key_bits / 2 - nt + 1; i++) {
-    uint64_t temp_bin_key = xor_mask ^ canonical_representation(kmer & mask, nt);
+    uint64_t mmer = kmer & mask;
+    uint64_t rc_mmer = (revcom >> (key_bits - nt * 2 - i * 2)) & mask;
+    uint64_t temp_bin_key = xor_mask ^ (mmer < rc_mmer ? mmer : rc_mmer);
     if (temp_bin_key < min_bin_key)
       min_bin_key = temp_bin_key;
     kmer >>= 2;
@@ -155,8 +465,12 @@ uint64_t KrakenDB::bin_key(uint64_t kmer) {
   mask--;
   xor_mask &= mask;
   uint64_t min_bin_key = ~0;
+  // Each m-mer's rev. comp. is a window of the k-mer's rev. comp.
+  uint64_t revcom = reverse_complement(kmer, key_bits / 2);
   for (uint64_t i = 0; i < key_bits / 2 - nt + 1; i++) {
-    uint64_t temp_bin_key = xor_mask ^ canonical_representation(kmer & mask, nt);
+    uint64_t mmer = kmer & mask;
+    uint64_t rc_mmer = (revcom >> (key_bits - nt * 2 - i * 2)) & mask;
+    uint64_t temp_bin_key = xor_mask ^ (mmer < rc_mmer ? mmer : rc_mmer);
     if (temp_bin_key < min_bin_key)
       min_bin_key = temp_bin_key;
     kmer >>= 2;
@@ -164,7 +478,94 @@ uint64_t KrakenDB::bin_key(uint64_t kmer) {
   return min_bin_key;
 }
 
+// Residual: the k-mer's nt outside the minimizer occurrence at pos,
+// then pos (pos_bits wide), then 1 if the occurrence isn't fwd
+// (i.e., is the minimizer's rev. comp.)
+static inline uint64_t cut_minimizer(uint64_t kmer, uint64_t pos,
+                                     uint64_t fwd, uint8_t nt,
+                                     uint64_t pos_bits)
+{
+  uint64_t mmer = (kmer >> (2 * pos)) & ((1ull << (nt * 2)) - 1);
+  uint64_t low = kmer & ((1ull << (2 * pos)) - 1);
+  uint64_t residual = ((kmer >> (2 * (pos + nt))) << (2 * pos)) | low;
+  return (((residual << pos_bits) | pos) << 1) | (mmer != fwd);
+}
+
+// Find the first (lowest) occurrence of the minimizer (fwd or its
+// rev. comp. rev), and cut it out
+static uint64_t make_residual_key(uint64_t kmer, uint64_t fwd, uint64_t rev,
+                                  uint8_t k, uint8_t nt, uint64_t pos_bits)
+{
+  uint64_t mmer_mask = (1ull << (nt * 2)) - 1;
+  uint64_t rest = kmer;
+  for (uint64_t i = 0; i + nt <= k; i++, rest >>= 2) {
+    uint64_t mmer = rest & mmer_mask;
+    if (mmer == fwd || mmer == rev)
+      return cut_minimizer(kmer, i, fwd, nt, pos_bits);
+  }
+  return ~0ull;
+}
+
+uint64_t KrakenDB::residual_key_bits(uint64_t idx_nt) {
+  uint64_t pos_bits = 0;
+  while ((1ull << pos_bits) <= k - idx_nt)
+    pos_bits++;
+  return 2 * (k - idx_nt) + pos_bits + 1;
+}
+
+uint64_t KrakenDB::residual_key(uint64_t kmer, uint64_t b_key,
+                                uint64_t idx_nt)
+{
+  uint64_t xor_mask = INDEX2_XOR_MASK & ((1ull << (idx_nt * 2)) - 1);
+  uint64_t fwd = b_key ^ xor_mask;
+  return make_residual_key(kmer, fwd, reverse_complement(fwd, idx_nt),
+                           k, idx_nt,
+                           residual_key_bits(idx_nt) - 2 * (k - idx_nt) - 1);
+}
+
+uint64_t KrakenDB::residual_key(uint64_t kmer, uint64_t b_key) {
+  uint64_t fwd = b_key ^ mmer_xor_mask;
+  return make_residual_key(kmer, fwd, reverse_complement(fwd, mmer_nt),
+                           k, mmer_nt,
+                           stored_key_bits - 2 * (k - mmer_nt) - 1);
+}
+
+uint64_t KrakenDB::residual_key_at(uint64_t kmer, uint64_t b_key,
+                                   uint64_t pos)
+{
+  return cut_minimizer(kmer, pos, b_key ^ mmer_xor_mask, mmer_nt,
+                       stored_key_bits - 2 * (k - mmer_nt) - 1);
+}
+
 // Code mostly from Jellyfish 1.6 source
+uint64_t KrakenDB::bin_bytes(uint64_t first, uint64_t last) {
+  return (index_ptr->at(last + 1) - index_ptr->at(first)) * pair_size();
+}
+
+// Pages are rounded outward (so neighboring bins may be affected too),
+// or inward w/ inner
+bool KrakenDB::advise_bins(uint64_t first, uint64_t last, int advice,
+                           bool inner)
+{
+  uint64_t start = index_ptr->at(first), end = index_ptr->at(last + 1);
+  uintptr_t page_mask = sysconf(_SC_PAGESIZE) - 1;
+  uintptr_t round_lo = inner ? page_mask : 0;
+  uintptr_t round_hi = inner ? 0 : page_mask;
+  char *spans[2][2] = {
+    { key_base + start * key_stride, key_base + end * key_stride },
+    { val_base + start * val_stride, val_base + end * val_stride }
+  };
+  bool ok = true;
+  // Pairs' values lie among their keys
+  for (int i = 0; i < (split ? 2 : 1); i++) {
+    uintptr_t lo = ((uintptr_t) spans[i][0] + round_lo) & ~page_mask;
+    uintptr_t hi = ((uintptr_t) spans[i][1] + round_hi) & ~page_mask;
+    if (hi > lo && madvise((void *) lo, hi - lo, advice) < 0)
+      ok = false;
+  }
+  return ok;
+}
+
 uint64_t KrakenDB::reverse_complement(uint64_t kmer, uint8_t n) {
   kmer = ((kmer >> 2)  & 0x3333333333333333UL) | ((kmer & 0x3333333333333333UL) << 2);
   kmer = ((kmer >> 4)  & 0x0F0F0F0F0F0F0F0FUL) | ((kmer & 0x0F0F0F0F0F0F0F0FUL) << 4);
@@ -201,11 +602,8 @@ uint32_t *KrakenDB::kmer_query(uint64_t kmer, uint64_t *last_bin_key,
                                int64_t *min_pos, int64_t *max_pos,
                                bool retry_on_failure)
 {
-  int64_t min, max, mid;
-  uint64_t comp_kmer;
+  int64_t min, max;
   uint64_t b_key;
-  char *ptr = get_pair_ptr();
-  size_t pair_sz = pair_size();
 
   // Use provided values if they exist and are valid
   if (retry_on_failure && *min_pos <= *max_pos) {
@@ -226,29 +624,10 @@ uint32_t *KrakenDB::kmer_query(uint64_t kmer, uint64_t *last_bin_key,
     }
   }
 
-  // Binary search with large window
-  while (min + 15 <= max) {
-    mid = min + (max - min) / 2;
-    comp_kmer = 0;
-    memcpy(&comp_kmer, ptr + pair_sz * mid, key_len);
-    comp_kmer &= (1ull << key_bits) - 1;  // trim any excess
-    if (kmer > comp_kmer)
-      min = mid + 1;
-    else if (kmer < comp_kmer)
-      max = mid - 1;
-    else
-      return (uint32_t *) (ptr + pair_sz * mid + key_len);
-  }
-  // Linear search once window shrinks
-  for (mid = min; mid <= max; mid++) {
-    comp_kmer = 0;
-    memcpy(&comp_kmer, ptr + pair_sz * mid, key_len);
-    comp_kmer &= (1ull << key_bits) - 1;  // trim any excess
-    if (kmer == comp_kmer)
-      return (uint32_t *) (ptr + pair_sz * mid + key_len);
-  }
+  uint32_t *answer = search_bin(kmer, b_key, min, max);
+  if (answer != NULL)
+    return answer;
 
-  uint32_t *answer = NULL;
   // ROF implies the provided values might be out of date
   // If they are, we'll update them and search again
   if (retry_on_failure) {
@@ -275,47 +654,542 @@ uint32_t *KrakenDB::kmer_query(uint64_t kmer) {
   return kmer_query(kmer, NULL, NULL, NULL, false);
 }
 
+// Binary search w/in a bin key already known to the caller
+// (e.g., from KmerScanner::bin_key())
+uint32_t *KrakenDB::kmer_query(uint64_t kmer, uint64_t b_key) {
+  return search_bin(kmer, b_key,
+                    index_ptr->at(b_key), index_ptr->at(b_key + 1) - 1);
+}
+
+// Search for kmer among the pairs at positions [min, max] of bin b_key
+uint32_t *KrakenDB::search_bin(uint64_t kmer, uint64_t b_key,
+                               int64_t min, int64_t max)
+{
+  int64_t mid;
+  uint64_t comp_kmer;
+  uint64_t key_mask = (1ull << stored_key_bits) - 1;
+
+  if (compact)
+    kmer = residual_key(kmer, b_key);
+  if (eytzinger)
+    return search_eytzinger_bin(kmer, min, max - min + 1);
+
+  // No stored key can match (e.g., k-mer isn't in a compact DB's bin)
+  if (kmer > key_mask)
+    return NULL;
+  const SearchKernels *kernels = key_len >= 4 ? Search_kernels
+                                              : &SCALAR_KERNELS;
+
+  if (search_method == BIN_SEARCH_BINARY && kernels->narrow != NULL) {
+    // k-ary search w/ large window
+    while (min + SCAN_WINDOW - 1 <= max) {
+      mid = kernels->narrow(key_base, key_stride, kmer, key_mask, &min, &max);
+      if (mid >= 0)
+        return (uint32_t *) (val_base + val_stride * mid);
+    }
+  }
+  // Binary (or interpolation) search with large window
+  // Interpolation falls back to bisection when a probe fails to halve
+  // the window, so is never much worse than binary search
+  uint64_t lo_key = 0, hi_key = key_mask;
+  int64_t last_width = INT64_MAX;
+  while (min + SCAN_WINDOW - 1 <= max) {
+    int64_t width = max - min + 1;
+    if (search_method == BIN_SEARCH_INTERPOLATION && 2 * width <= last_width)
+      mid = interpolate(kmer, lo_key, hi_key, min, max);
+    else
+      mid = min + (max - min) / 2;
+    last_width = width;
+    comp_kmer = load_key(key_base + key_stride * mid, key_len);
+    comp_kmer &= key_mask;  // trim any excess
+    if (kmer > comp_kmer) {
+      min = mid + 1;
+      lo_key = comp_kmer;
+    }
+    else if (kmer < comp_kmer) {
+      max = mid - 1;
+      hi_key = comp_kmer;
+    }
+    else
+      return (uint32_t *) (val_base + val_stride * mid);
+  }
+  // Scan once window shrinks
+  mid = kernels->scan(key_base, key_stride, key_len, kmer, key_mask, min, max);
+  if (mid < 0)
+    return NULL;
+  return (uint32_t *) (val_base + val_stride * mid);
+}
+
+// Search for key among the n pairs of a bin in Eytzinger order, starting
+// at position start: node i (1-based) is at start + i - 1, and its
+// children are nodes 2i and 2i + 1.  Descent is branchless, and
+// prefetches the 16 descendants four levels down, which are contiguous.
+uint32_t *KrakenDB::search_eytzinger_bin(uint64_t key, int64_t start,
+                                         int64_t n)
+{
+  uint64_t key_mask = (1ull << stored_key_bits) - 1;
+  char *nodes = key_base + key_stride * (start - 1);
+  int64_t i = 1;
+
+  while (i <= n) {
+    __builtin_prefetch(nodes + key_stride * 16 * i);
+    uint64_t comp_key = load_key(nodes + key_stride * i, key_len) & key_mask;
+    i = 2 * i + (comp_key < key);
+  }
+  // Undo the right turns made since the last left turn, leaving the
+  // smallest node >= key (or 0, if there's none)
+  i >>= __builtin_ffsll(~i);
+  if (i == 0 || (load_key(nodes + key_stride * i, key_len) & key_mask) != key)
+    return NULL;
+  return (uint32_t *) (val_base + val_stride * (start + i - 1));
+}
+
+// Interleaved binary searches; each lane holds one search and advances
+// it by a single probe per pass, prefetching the next probe's location.
+// By the time a lane is revisited its data should be in cache, so up
+// to BATCH_QUERY_LANES memory accesses are outstanding at once.
+// Results match kmer_query()'s, though lanes use binary search steps
+// rather than k-ary SIMD ones, which need several loads at once.
+// Eytzinger-ordered bins are descended one level per pass instead.
+void KrakenDB::kmer_query_batch(const uint64_t *kmers, size_t n,
+                                uint32_t *out, const uint64_t *bin_keys,
+                                const uint8_t *mmer_pos)
+{
+  enum { LANE_IDLE, LANE_INDEX, LANE_SEARCH };
+  uint8_t stage[BATCH_QUERY_LANES];
+  size_t query[BATCH_QUERY_LANES];
+  int64_t min[BATCH_QUERY_LANES], max[BATCH_QUERY_LANES];
+  uint64_t key[BATCH_QUERY_LANES];  // k-mer, or residual key if compact
+  int64_t probe[BATCH_QUERY_LANES];  // position (or node, if Eytzinger)
+  // Interpolation search state: bounds on keys in [min, max], and
+  // window width at last probe
+  uint64_t lo_key[BATCH_QUERY_LANES], hi_key[BATCH_QUERY_LANES];
+  int64_t last_width[BATCH_QUERY_LANES];
+  bool interpolating = search_method == BIN_SEARCH_INTERPOLATION;
+  const SearchKernels *kernels = key_len >= 4 ? Search_kernels
+                                              : &SCALAR_KERNELS;
+  uint64_t key_mask = (1ull << stored_key_bits) - 1;
+  size_t next_query = 0, active = 0;
+
+  for (size_t l = 0; l < BATCH_QUERY_LANES; l++)
+    stage[l] = LANE_IDLE;
+
+  do {
+    for (size_t l = 0; l < BATCH_QUERY_LANES; l++) {
+      int64_t mid;
+      uint64_t kmer, comp_kmer;
+      uint32_t *val_ptr = NULL;
+
+      switch (stage[l]) {
+        case LANE_IDLE:
+          if (next_query >= n)
+            continue;
+          // Start new search; bin key held in min until index is read
+          query[l] = next_query++;
+          min[l] = bin_keys != NULL ? bin_keys[query[l]]
+                                    : bin_key(kmers[query[l]]);
+          index_ptr->prefetch(min[l]);
+          if (! compact)
+            key[l] = kmers[query[l]];
+          else if (mmer_pos != NULL)
+            key[l] = residual_key_at(kmers[query[l]], min[l],
+                                     mmer_pos[query[l]]);
+          else
+            key[l] = residual_key(kmers[query[l]], min[l]);
+          stage[l] = LANE_INDEX;
+          active++;
+          continue;
+
+        case LANE_INDEX:
+          max[l] = index_ptr->at(min[l] + 1) - 1;
+          min[l] = index_ptr->at(min[l]);
+          probe[l] = 1;
+          lo_key[l] = 0;
+          hi_key[l] = key_mask;
+          last_width[l] = INT64_MAX;
+          stage[l] = LANE_SEARCH;
+          break;
+
+        case LANE_SEARCH:
+          kmer = key[l];
+          if (eytzinger) {
+            // Descend one level
+            mid = min[l] + probe[l] - 1;
+            comp_kmer = load_key(key_base + key_stride * mid, key_len);
+            comp_kmer &= key_mask;
+            if (kmer == comp_kmer) {
+              val_ptr = (uint32_t *) (val_base + val_stride * mid);
+              max[l] = min[l] - 1;
+            }
+            else {
+              probe[l] = 2 * probe[l] + (comp_kmer < kmer);
+              if (min[l] + probe[l] - 1 > max[l])
+                max[l] = min[l] - 1;
+            }
+            break;
+          }
+          if (min[l] + SCAN_WINDOW - 1 <= max[l]) {
+            // Binary (or interpolation) search with large window
+            mid = probe[l];
+            comp_kmer = load_key(key_base + key_stride * mid, key_len);
+            comp_kmer &= key_mask;
+            if (kmer > comp_kmer) {
+              min[l] = mid + 1;
+              lo_key[l] = comp_kmer;
+            }
+            else if (kmer < comp_kmer) {
+              max[l] = mid - 1;
+              hi_key[l] = comp_kmer;
+            }
+            else {
+              val_ptr = (uint32_t *) (val_base + val_stride * mid);
+              max[l] = min[l] - 1;
+            }
+            break;
+          }
+          // Scan once window shrinks
+          mid = kernels->scan(key_base, key_stride, key_len, kmer, key_mask,
+                              min[l], max[l]);
+          if (mid >= 0)
+            val_ptr = (uint32_t *) (val_base + val_stride * mid);
+          max[l] = min[l] - 1;
+          break;
+      }
+
+      if (min[l] > max[l]) {
+        // Search is done, free the lane for the next query
+        out[query[l]] = val_ptr ? *val_ptr : 0;
+        stage[l] = LANE_IDLE;
+        active--;
+      }
+      else if (eytzinger) {
+        __builtin_prefetch(key_base + key_stride * (min[l] + probe[l] - 1));
+      }
+      else if (min[l] + SCAN_WINDOW - 1 <= max[l]) {
+        int64_t width = max[l] - min[l] + 1;
+        if (interpolating && 2 * width <= last_width[l])
+          probe[l] = interpolate(key[l], lo_key[l], hi_key[l], min[l], max[l]);
+        else
+          probe[l] = min[l] + (max[l] - min[l]) / 2;
+        last_width[l] = width;
+        __builtin_prefetch(key_base + key_stride * probe[l]);
+      }
+      else {
+        char *first = key_base + key_stride * min[l];
+        char *last = key_base + key_stride * max[l] + key_len;
+        for (; first < last; first += 64)
+          __builtin_prefetch(first);
+        __builtin_prefetch(last);
+      }
+    }
+  } while (active || next_query < n);
+}
+
 KrakenDBIndex::KrakenDBIndex() {
   fptr = NULL;
   idx_type = 1;
   nt = 0;
+  array = NULL;
+  first_bin_key = last_bin_key = 0;
+  blocks = NULL;
+  overflow = NULL;
 }
 
 KrakenDBIndex::KrakenDBIndex(char *ptr) {
   fptr = ptr;
   idx_type = 1;
+  blocks = NULL;
+  overflow = NULL;
   if (strncmp(ptr, KRAKEN_INDEX_STRING, strlen(KRAKEN_INDEX_STRING))) {
     idx_type = 2;
-    if (strncmp(ptr, KRAKEN_INDEX2_STRING, strlen(KRAKEN_INDEX2_STRING)))
+    if (! strncmp(ptr, KRAKEN_INDEX3_STRING, strlen(KRAKEN_INDEX3_STRING)))
+      idx_type = 3;
+    else if (! strncmp(ptr, KRAKEN_INDEX4_STRING, strlen(KRAKEN_INDEX4_STRING)))
+      idx_type = 4;
+    else if (strncmp(ptr, KRAKEN_INDEX2_STRING, strlen(KRAKEN_INDEX2_STRING)))
       errx(EX_DATAERR, "illegal Kraken DB index format");
   }
   ptr += strlen(KRAKEN_INDEX_STRING);
   memcpy(&nt, ptr, 1);
+  array = (uint64_t *) (ptr + 1);
+  first_bin_key = 0;
+  last_bin_key = (1ull << (nt * 2)) - 1;
+  if (idx_type == 3) {
+    uint64_t block_ct;
+    memcpy(&block_ct, ptr + 1, sizeof(block_ct));
+    blocks = fptr + INDEX3_HEADER_SIZE;
+    overflow = (uint64_t *) (blocks + block_ct * INDEX3_BLOCK_SIZE);
+    array = NULL;
+  }
+  if (idx_type == 4) {
+    memcpy(&first_bin_key, ptr + 1, sizeof(first_bin_key));
+    memcpy(&last_bin_key, ptr + 9, sizeof(last_bin_key));
+    array = (uint64_t *) (fptr + INDEX4_HEADER_SIZE);
+  }
 }
 
-// Index version (v2 uses different minimizer sort order)
+// Index version (v2 uses different minimizer sort order, v3 is
+// compressed v2, v4 is a slice of v2 for a DB shard)
 uint8_t KrakenDBIndex::index_type() {
   return idx_type;
 }
 
+// XOR mask applied to canonical minimizers to produce bin keys
+uint64_t KrakenDBIndex::xor_mask() {
+  if (idx_type == 1)
+    return 0;
+  return bin_key_xor_mask(nt);
+}
+
+uint64_t KrakenDBIndex::bin_key_xor_mask(uint8_t nt) {
+  return INDEX2_XOR_MASK & ((1ull << (nt * 2)) - 1);
+}
+
+void KrakenDBIndex::write_index(string filename, uint8_t nt,
+                                const uint64_t *offsets)
+{
+  uint64_t entries = 1ull << (nt * 2);
+  QuickFile idx_file(filename, "w", index_file_size(nt));
+  memcpy(init_index(idx_file.ptr(), nt), offsets,
+         sizeof(*offsets) * (entries + 1));
+}
+
+size_t KrakenDBIndex::index_file_size(uint8_t nt) {
+  return strlen(KRAKEN_INDEX2_STRING) + 1
+         + sizeof(uint64_t) * ((1ull << (nt * 2)) + 1);
+}
+
+uint64_t *KrakenDBIndex::init_index(char *ptr, uint8_t nt) {
+  memcpy(ptr, KRAKEN_INDEX2_STRING, strlen(KRAKEN_INDEX2_STRING));
+  ptr += strlen(KRAKEN_INDEX2_STRING);
+  memcpy(ptr++, &nt, 1);
+  return (uint64_t *) ptr;
+}
+
 // How long are bin keys (i.e., what is minimizer length in bp?)
 uint8_t KrakenDBIndex::indexed_nt() {
   return nt;
 }
 
+bool KrakenDBIndex::is_compressed() {
+  return idx_type == 3;
+}
+
+// Range of bin keys w/ offsets in this index (all but a shard's cover
+// every bin)
+uint64_t KrakenDBIndex::first_bin() {
+  return first_bin_key;
+}
+
+uint64_t KrakenDBIndex::last_bin() {
+  return last_bin_key;
+}
+
 // Return start of index array (skips header)
 uint64_t *KrakenDBIndex::get_array() {
-  return (uint64_t *) (fptr + strlen(KRAKEN_INDEX_STRING) + 1);
+  if (idx_type == 3)
+    errx(EX_SOFTWARE, "can't get array of compressed index");
+  return array;
 }
 
 // Convenience method, allows for testing guard
 uint64_t KrakenDBIndex::at(uint64_t idx) {
-  uint64_t *array = get_array();
   #ifdef TESTING
-  if (idx > 1 + (1ull << (nt * 2)))
+  if (idx < first_bin_key || idx > last_bin_key + 1)
     errx(EX_SOFTWARE, "KrakenDBIndex::at() called with illegal index");
   #endif
-  return array[idx];
+  if (idx_type != 3)
+    return array[idx - first_bin_key];
+
+  const char *block = blocks + (idx / INDEX3_BLOCK_BINS) * INDEX3_BLOCK_SIZE;
+  uint64_t anchor;
+  memcpy(&anchor, block + INDEX3_ANCHOR_POS, sizeof(anchor));
+  uint64_t slot = idx % INDEX3_BLOCK_BINS;
+  if (anchor & INDEX3_OVERFLOW)
+    return overflow[(anchor & ~INDEX3_OVERFLOW) * INDEX3_BLOCK_BINS + slot];
+  // Last delta's 4 bytes end inside the anchor, so this stays in block
+  uint64_t bit = slot * INDEX3_DELTA_BITS;
+  uint32_t word;
+  memcpy(&word, block + bit / 8, sizeof(word));
+  return anchor + ((word >> (bit % 8)) & ((1u << INDEX3_DELTA_BITS) - 1));
+}
+
+void KrakenDBIndex::prefetch(uint64_t idx) {
+  if (idx_type != 3)
+    __builtin_prefetch(array + (idx - first_bin_key));
+  else
+    __builtin_prefetch(blocks + (idx / INDEX3_BLOCK_BINS) * INDEX3_BLOCK_SIZE);
+}
+
+vector<char> KrakenDBIndex::compressed_index() {
+  if (idx_type != 2)
+    errx(EX_SOFTWARE, "can only compress a v2 index");
+  uint64_t *array = get_array();
+  uint64_t entries = (1ull << (nt * 2)) + 1;
+  uint64_t block_ct = (entries + INDEX3_BLOCK_BINS - 1) / INDEX3_BLOCK_BINS;
+  vector<char> contents(INDEX3_HEADER_SIZE + block_ct * INDEX3_BLOCK_SIZE);
+  vector<uint64_t> overflow_offsets;
+
+  for (uint64_t b = 0; b < block_ct; b++) {
+    uint64_t first = b * INDEX3_BLOCK_BINS;
+    uint64_t last = std::min(first + INDEX3_BLOCK_BINS, entries) - 1;
+    char *block = &contents[INDEX3_HEADER_SIZE + b * INDEX3_BLOCK_SIZE];
+    uint64_t anchor = array[first];
+    if (array[last] - anchor >= (1ull << INDEX3_DELTA_BITS)) {
+      anchor = INDEX3_OVERFLOW | (overflow_offsets.size() / INDEX3_BLOCK_BINS);
+      for (uint64_t i = 0; i < INDEX3_BLOCK_BINS; i++)
+        overflow_offsets.push_back(array[std::min(first + i, last)]);
+    }
+    else {
+      for (uint64_t i = first + 1; i <= last; i++) {
+        uint64_t bit = (i - first) * INDEX3_DELTA_BITS;
+        uint32_t word;
+        memcpy(&word, block + bit / 8, sizeof(word));
+        word |= (uint32_t) (array[i] - anchor) << (bit % 8);
+        memcpy(block + bit / 8, &word, sizeof(word));
+      }
+    }
+    memcpy(block + INDEX3_ANCHOR_POS, &anchor, sizeof(anchor));
+  }
+
+  char *header = &contents[0];
+  uint64_t overflow_ct = overflow_offsets.size() / INDEX3_BLOCK_BINS;
+  memcpy(header, KRAKEN_INDEX3_STRING, strlen(KRAKEN_INDEX3_STRING));
+  header += strlen(KRAKEN_INDEX3_STRING);
+  memcpy(header++, &nt, 1);
+  memcpy(header, &block_ct, sizeof(block_ct));
+  memcpy(header + sizeof(block_ct), &overflow_ct, sizeof(overflow_ct));
+  contents.insert(contents.end(), (char *) overflow_offsets.data(),
+                  (char *) (overflow_offsets.data() + overflow_offsets.size()));
+  return contents;
+}
+
+vector<char> KrakenDBIndex::slice(uint64_t first, uint64_t last) {
+  if (idx_type != 2 && idx_type != 3)
+    errx(EX_SOFTWARE, "can only slice a v2 or v3 index");
+  uint64_t entries = last - first + 2;
+  vector<char> contents(INDEX4_HEADER_SIZE + entries * sizeof(uint64_t));
+  char *header = &contents[0];
+  memcpy(header, KRAKEN_INDEX4_STRING, strlen(KRAKEN_INDEX4_STRING));
+  header += strlen(KRAKEN_INDEX4_STRING);
+  memcpy(header++, &nt, 1);
+  memcpy(header, &first, sizeof(first));
+  memcpy(header + sizeof(first), &last, sizeof(last));
+
+  uint64_t base = at(first);
+  uint64_t *offsets = (uint64_t *) &contents[INDEX4_HEADER_SIZE];
+  for (uint64_t i = 0; i < entries; i++)
+    offsets[i] = at(first + i) - base;
+  return contents;
+}
+
+// 64-bit finalizer from MurmurHash3
+static inline uint64_t mix64(uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return x;
+}
+
+KrakenDBFilter::KrakenDBFilter() {
+  fptr = NULL;
+  blocks = NULL;
+  block_ct = 0;
+  hash_ct = 0;
+}
+
+KrakenDBFilter::KrakenDBFilter(char *ptr) {
+  fptr = ptr;
+  if (strncmp(ptr, KRAKEN_FILTER_STRING, strlen(KRAKEN_FILTER_STRING)))
+    errx(EX_DATAERR, "illegal Kraken DB filter format");
+  ptr += strlen(KRAKEN_FILTER_STRING);
+  memcpy(&block_ct, ptr, sizeof(block_ct));
+  memcpy(&hash_ct, ptr + sizeof(block_ct), 1);
+  blocks = (uint64_t *) (fptr + FILTER_HEADER_SIZE);
+}
+
+KrakenDBFilter::KrakenDBFilter(char *ptr, uint64_t block_ct,
+                               uint8_t hash_ct)
+{
+  if (block_ct == 0 || hash_ct == 0 || hash_ct > FILTER_MAX_HASHES)
+    errx(EX_SOFTWARE, "illegal Kraken DB filter dimensions");
+  memset(ptr, 0, file_size(block_ct));
+  memcpy(ptr, KRAKEN_FILTER_STRING, strlen(KRAKEN_FILTER_STRING));
+  memcpy(ptr + strlen(KRAKEN_FILTER_STRING), &block_ct, sizeof(block_ct));
+  memcpy(ptr + strlen(KRAKEN_FILTER_STRING) + sizeof(block_ct), &hash_ct, 1);
+  *this = KrakenDBFilter(ptr);
+}
+
+uint64_t KrakenDBFilter::block_count(uint64_t kmer_ct, double bits_per_kmer) {
+  uint64_t bits = (uint64_t) (kmer_ct * bits_per_kmer);
+  uint64_t ct = (bits + FILTER_BLOCK_BITS - 1) / FILTER_BLOCK_BITS;
+  return ct > 0 ? ct : 1;
+}
+
+// About bits_per_kmer * ln(2), the optimum for a standard Bloom filter
+uint8_t KrakenDBFilter::hash_count(double bits_per_kmer) {
+  int ct = (int) (bits_per_kmer * 0.693 + 0.5);
+  return ct < 1 ? 1 : ct > FILTER_MAX_HASHES ? FILTER_MAX_HASHES : ct;
+}
+
+size_t KrakenDBFilter::file_size(uint64_t block_ct) {
+  return FILTER_HEADER_SIZE + block_ct * (FILTER_BLOCK_BITS / 8);
+}
+
+uint64_t KrakenDBFilter::get_block_ct() { return block_ct; }
+uint8_t KrakenDBFilter::get_hash_ct() { return hash_ct; }
+
+// k-mers per block are ~Poisson distributed; a block w/ j k-mers has
+// the false positive rate of a standard 512-bit Bloom filter
+double KrakenDBFilter::false_positive_rate(uint64_t kmer_ct) {
+  double mean = (double) kmer_ct / block_ct;
+  double bit_clear = 1.0 - 1.0 / FILTER_BLOCK_BITS;
+  double p = exp(-mean);  // Poisson probability of j k-mers
+  double rate = 0;
+  uint64_t max_j = (uint64_t) (mean + 20 * sqrt(mean) + 20);
+  for (uint64_t j = 0; j <= max_j; j++) {
+    rate += p * pow(1.0 - pow(bit_clear, (double) hash_ct * j), hash_ct);
+    p *= mean / (j + 1);
+  }
+  return rate;
+}
+
+// Return kmer's block, and set hash to the hash giving its bits
+uint64_t *KrakenDBFilter::block_of(uint64_t kmer, uint64_t &hash) {
+  uint64_t block_hash = mix64(kmer);
+  uint64_t block = ((__uint128_t) block_hash * block_ct) >> 64;
+  hash = mix64(block_hash ^ 0x9e3779b97f4a7c15ULL);
+  return blocks + block * (FILTER_BLOCK_BITS / 64);
+}
+
+void KrakenDBFilter::insert(uint64_t kmer) {
+  uint64_t hash;
+  uint64_t *block = block_of(kmer, hash);
+  for (uint8_t i = 0; i < hash_ct; i++, hash >>= 9)
+    block[(hash >> 6) & 7] |= 1ull << (hash & 63);
+}
+
+void KrakenDBFilter::insert_atomic(uint64_t kmer) {
+  uint64_t hash;
+  uint64_t *block = block_of(kmer, hash);
+  for (uint8_t i = 0; i < hash_ct; i++, hash >>= 9)
+    __sync_fetch_and_or(&block[(hash >> 6) & 7], 1ull << (hash & 63));
+}
+
+bool KrakenDBFilter::may_contain(uint64_t kmer) {
+  uint64_t hash;
+  uint64_t *block = block_of(kmer, hash);
+  uint64_t missing = 0;
+  for (uint8_t i = 0; i < hash_ct; i++, hash >>= 9)
+    missing |= ~block[(hash >> 6) & 7] & (1ull << (hash & 63));
+  return missing == 0;
+}
+
+void KrakenDBFilter::prefetch(uint64_t kmer) {
+  uint64_t block = ((__uint128_t) mix64(kmer) * block_ct) >> 64;
+  __builtin_prefetch(blocks + block * (FILTER_BLOCK_BITS / 64));
 }
 
 } // namespace
@@ -23,6 +23,19 @@
 #include "kraken_headers.hpp"
 
 namespace kraken {
+  // How bins in sorted order are searched
+  enum BinSearchMethod {
+    BIN_SEARCH_BINARY,
+    BIN_SEARCH_INTERPOLATION  // for bins w/ near-uniform keys
+  };
+
+  // Name of key comparison kernels used in bin searches: "scalar",
+  // "avx2" or "avx512" (SIMD ones do k-ary searches and scan several
+  // keys at once).  Best one the CPU supports is chosen at startup.
+  const char *search_kernel();
+  // Use named kernels instead; returns false if CPU lacks support
+  bool set_search_kernel(const std::string &name);
+
   class KrakenDBIndex {
     public:
     KrakenDBIndex();
@@ -31,13 +44,82 @@ namespace kraken {
 
     uint8_t index_type();
     uint8_t indexed_nt();
-    uint64_t *get_array();
+    uint64_t xor_mask();
+    bool is_compressed();
+    uint64_t *get_array();      // uncompressed (v1/v2/v4) indexes only
+    uint64_t first_bin();       // bin keys covered (v4 covers a range)
+    uint64_t last_bin();
     uint64_t at(uint64_t idx);
+    void prefetch(uint64_t idx);  // prefetch memory holding at(idx)
+
+    // Contents of a compressed (v3) version of this v2 index.
+    // v3 stores offsets in 64-byte blocks of 32: a 64-bit anchor and
+    // 14-bit deltas from it, so one cache line holds both.  Blocks
+    // w/ too large a delta hold an overflow table index instead.
+    std::vector<char> compressed_index();
+
+    // Contents of a v4 index for a shard of this (v2/v3) index's DB,
+    // holding the pairs of bins first..last.  Only those bins may be
+    // searched w/ it.
+    std::vector<char> slice(uint64_t first, uint64_t last);
+
+    // XOR mask a v2+ index applies to nt-long canonical minimizers
+    // to make bin keys
+    static uint64_t bin_key_xor_mask(uint8_t nt);
+    // Write a v2 index w/ the starting offsets of the 4^nt bins
+    // (and the end of the last one)
+    static void write_index(std::string filename, uint8_t nt,
+                            const uint64_t *offsets);
+    // Size of a v2 index for nt bin keys; init_index() writes its header
+    // at ptr and returns where the 4^nt + 1 offsets go, for callers
+    // filling the index in place (e.g., in a file mapping)
+    static size_t index_file_size(uint8_t nt);
+    static uint64_t *init_index(char *ptr, uint8_t nt);
 
     private:
     uint8_t idx_type;
     char *fptr;
     uint8_t nt;
+    uint64_t *array;     // v1/v2/v4 only; v4's starts at first_bin_key
+    uint64_t first_bin_key, last_bin_key;
+    char *blocks;        // v3 only
+    uint64_t *overflow;  // v3 only
+  };
+
+  // Blocked Bloom filter of a DB's (canonical) k-mers, stored in a
+  // sidecar file.  Each k-mer's bits are all in one 64-byte block, so
+  // a query touches one cache line.  No false negatives, so k-mers it
+  // rejects are certainly absent from the DB.
+  class KrakenDBFilter {
+    public:
+    KrakenDBFilter();
+    // ptr points to mmap'ed existing file opened in read or read/write mode
+    KrakenDBFilter(char *ptr);
+    // Formats empty filter in ptr, which must hold file_size(block_ct)
+    KrakenDBFilter(char *ptr, uint64_t block_ct, uint8_t hash_ct);
+
+    // Blocks & bit probes per k-mer for a filter of kmer_ct k-mers
+    // using about bits_per_kmer bits each
+    static uint64_t block_count(uint64_t kmer_ct, double bits_per_kmer);
+    static uint8_t hash_count(double bits_per_kmer);
+    static size_t file_size(uint64_t block_ct);
+
+    uint64_t get_block_ct();
+    uint8_t get_hash_ct();
+    // Expected rate of false positives after inserting kmer_ct k-mers
+    double false_positive_rate(uint64_t kmer_ct);
+
+    void insert(uint64_t kmer);
+    void insert_atomic(uint64_t kmer);  // safe w/ concurrent inserts
+    bool may_contain(uint64_t kmer);
+    void prefetch(uint64_t kmer);  // prefetch kmer's block
+
+    private:
+    uint64_t *block_of(uint64_t kmer, uint64_t &hash);
+    char *fptr;
+    uint64_t *blocks;
+    uint64_t block_ct;
+    uint8_t hash_ct;
   };
 
   class KrakenDB {
@@ -45,6 +127,7 @@ namespace kraken {
 
     char *get_ptr();            // Return the file pointer
     char *get_pair_ptr();       // Return pointer to start of pairs
+                                // (or of key array, if split)
     KrakenDBIndex *get_index(); // Return ptr to assoc'd index obj
     uint8_t get_k();            // how many nt are in each key?
     uint64_t get_key_bits();    // how many bits are in each key?
@@ -52,6 +135,11 @@ namespace kraken {
     uint64_t get_val_len();     // how many bytes does each value occupy?
     uint64_t get_key_ct();      // how many key/value pairs are there?
     uint64_t pair_size();       // how many bytes does each pair occupy?
+    bool is_compact();          // are keys stored as residuals?
+    bool is_split();            // are keys & values in separate arrays?
+    bool is_eytzinger();        // are bins in Eytzinger order?
+    // Ignored if bins are in Eytzinger order
+    void set_search_method(BinSearchMethod method);
 
     size_t header_size();  // Jellyfish uses variable header sizes
     uint32_t *kmer_query(uint64_t kmer);  // return ptr to pair w/ kmer
@@ -60,12 +148,52 @@ namespace kraken {
     uint32_t *kmer_query(uint64_t kmer, uint64_t *last_bin_key,
                          int64_t *min_pos, int64_t *max_pos,
                          bool retry_on_failure=true);
+
+    // search only the given bin (precomputed by caller)
+    uint32_t *kmer_query(uint64_t kmer, uint64_t b_key);
+
+    // look up n k-mers at once, keeping several searches in flight
+    // out[i] is set to the value paired w/ kmers[i], or 0 if absent
+    // If bin_keys is NULL, bin keys are computed here
+    // mmer_pos (optional, needs bin_keys) gives minimizer positions
+    // (see KmerScanner::minimizer_pos()), saving compact DBs a search
+    void kmer_query_batch(const uint64_t *kmers, size_t n, uint32_t *out,
+                          const uint64_t *bin_keys=NULL,
+                          const uint8_t *mmer_pos=NULL);
+
+    // Bytes of keys & values held by bins first..last
+    uint64_t bin_bytes(uint64_t first, uint64_t last);
+    // madvise() the memory holding bins first..last (e.g., to read
+    // them ahead of a sweep of the DB in bin order, or release them);
+    // w/ inner, pages shared w/ neighboring bins are left alone.
+    // Returns false if madvise() failed.
+    bool advise_bins(uint64_t first, uint64_t last, int advice,
+                     bool inner=false);
     
     // return "bin key" for kmer, based on index
     // If idx_nt not specified, use index's value
     uint64_t bin_key(uint64_t kmer, uint64_t idx_nt);
     uint64_t bin_key(uint64_t kmer);
 
+    // Compact DBs store, in place of each k-mer, the k-mer with its
+    // minimizer cut out, plus the minimizer's position & orientation.
+    // The bin identifies the minimizer, so this is unique w/in a bin.
+    // Returns ~0 if kmer can't be in bin b_key.
+    // If idx_nt not specified, use DB's value (compact DBs only)
+    uint64_t residual_key(uint64_t kmer, uint64_t b_key, uint64_t idx_nt);
+    uint64_t residual_key(uint64_t kmer, uint64_t b_key);
+    // Same, w/ position of minimizer's first occurrence already known
+    uint64_t residual_key_at(uint64_t kmer, uint64_t b_key, uint64_t pos);
+    // Bits in a residual key for k-mers binned by idx_nt-long minimizers
+    uint64_t residual_key_bits(uint64_t idx_nt);
+    // Header for a version of this DB w/ residual keys (see above),
+    // split arrays (all keys, then all values at an 8-byte boundary,
+    // so searches only touch keys), and/or bins in Eytzinger order
+    // (a sorted bin's implicit binary search tree, stored breadth
+    // first, so the first probes of all searches share cache lines)
+    std::vector<char> kraken_header(bool residual_keys, bool split_arrays,
+                                    bool eytzinger_bins, uint8_t idx_nt);
+
     // Code from Jellyfish, rev. comp. of a k-mer with n nt.
     // If n is not specified, use k in DB, otherwise use first n nt in kmer
     uint64_t reverse_complement(uint64_t kmer, uint8_t n);
@@ -76,8 +204,6 @@ namespace kraken {
     uint64_t canonical_representation(uint64_t kmer, uint8_t n);
     uint64_t canonical_representation(uint64_t kmer);
 
-    void make_index(std::string index_filename, uint8_t nt);
-
     void set_index(KrakenDBIndex *i_ptr);
 
     // Null constructor
@@ -88,11 +214,26 @@ namespace kraken {
 
     private:
 
+    uint32_t *search_bin(uint64_t kmer, uint64_t b_key,
+                         int64_t min, int64_t max);
+    uint32_t *search_eytzinger_bin(uint64_t key, int64_t start, int64_t n);
+
     char *fptr;
     KrakenDBIndex *index_ptr;
     uint8_t k;
     uint64_t key_bits;
     uint64_t key_len;
+    bool kraken_format;  // has Kraken header (see kraken_header())
+    bool compact;
+    bool split;
+    bool eytzinger;
+    BinSearchMethod search_method;
+    // Key/value i is at key_base/val_base + i * key_stride/val_stride
+    char *key_base, *val_base;
+    size_t key_stride, val_stride;
+    uint64_t stored_key_bits;  // key_bits, or residual key bits if compact
+    uint8_t mmer_nt;           // minimizer length of compact DB
+    uint64_t mmer_xor_mask;    // from index, set by set_index()
     uint64_t val_len;
     uint64_t key_ct;
   };
@@ -110,24 +110,368 @@ namespace kraken {
     return max_taxon;
   }
 
+  // Same tree resolution as above, using the flat taxonomy
+  uint32_t resolve_tree(map<uint32_t, uint32_t> &hit_counts,
+                        Taxonomy &taxonomy)
+  {
+    uint32_t max_taxon = 0, max_score = 0;
+    map<uint32_t, uint32_t>::iterator it, count_it;
+
+    // Sum each taxon's LTR path
+    for (it = hit_counts.begin(); it != hit_counts.end(); it++) {
+      uint32_t taxon = it->first;
+      uint32_t score = it->second;
+      uint32_t node = taxonomy.internal_id(taxon);
+      if (node) {
+        for (node = taxonomy.parent(node); node; node = taxonomy.parent(node)) {
+          count_it = hit_counts.find(taxonomy.external_id(node));
+          if (count_it != hit_counts.end())
+            score += count_it->second;
+        }
+      }
+
+      // If two LTR paths are tied for max, return LCA of all
+      if (score > max_score) {
+        max_score = score;
+        max_taxon = taxon;
+      }
+      else if (score == max_score) {
+        max_taxon = taxonomy.lca(max_taxon, taxon);
+      }
+    }
+
+    return max_taxon;
+  }
+
+  // Same tree resolution, w/ hit counts from a TaxonCounter
+  // The result doesn't depend on the order taxa are visited in
+  uint32_t resolve_tree(TaxonCounter &hit_counts, Taxonomy &taxonomy) {
+    uint32_t max_taxon = 0, max_score = 0;
+
+    for (size_t i = 0; i < hit_counts.size(); i++) {
+      uint32_t taxon = hit_counts.taxon_at(i);
+      uint32_t score = hit_counts.get(taxon);
+      uint32_t node = taxonomy.internal_id(taxon);
+      if (node) {
+        for (node = taxonomy.parent(node); node; node = taxonomy.parent(node))
+          score += hit_counts.get(taxonomy.external_id(node));
+      }
+
+      if (score > max_score) {
+        max_score = score;
+        max_taxon = taxon;
+      }
+      else if (score == max_score) {
+        max_taxon = taxonomy.lca(max_taxon, taxon);
+      }
+    }
+
+    return max_taxon;
+  }
+
+  string classification_stats(uint64_t seq_ct, uint64_t base_ct,
+                              uint64_t classified_ct, double seconds,
+                              bool partial)
+  {
+    char line[256];
+    snprintf(line, sizeof(line),
+             "%llu sequences (%.2f Mbp) processed in %.3fs (%.1f Kseq/m, %.2f Mbp/m).\n",
+             (unsigned long long) seq_ct, base_ct / 1.0e6, seconds,
+             seq_ct / 1.0e3 / (seconds / 60),
+             base_ct / 1.0e6 / (seconds / 60) );
+    string stats = line;
+    if (! partial)
+      stats += classified_counts(seq_ct, classified_ct);
+    return stats;
+  }
+
+  string classified_counts(uint64_t seq_ct, uint64_t classified_ct) {
+    char lines[256];
+    snprintf(lines, sizeof(lines),
+             "  %llu sequences classified (%.2f%%)\n"
+             "  %llu sequences unclassified (%.2f%%)\n",
+             (unsigned long long) classified_ct,
+             classified_ct * 100.0 / seq_ct,
+             (unsigned long long) (seq_ct - classified_ct),
+             (seq_ct - classified_ct) * 100.0 / seq_ct);
+    return lines;
+  }
+
+  OutputBuffer::OutputBuffer(size_t capacity) {
+    buf = capacity ? new char[capacity] : NULL;
+    buf_size = 0;
+    buf_capacity = capacity;
+  }
+
+  OutputBuffer::~OutputBuffer() {
+    delete[] buf;
+  }
+
+  // Make room for at least min_extra more bytes
+  void OutputBuffer::grow(size_t min_extra) {
+    size_t new_capacity = buf_capacity ? buf_capacity * 2 : 4096;
+    while (new_capacity - buf_size < min_extra)
+      new_capacity *= 2;
+    char *new_buf = new char[new_capacity];
+    memcpy(new_buf, buf, buf_size);
+    delete[] buf;
+    buf = new_buf;
+    buf_capacity = new_capacity;
+  }
+
+  // capacity is rounded up to a power of 2
+  TaxonCounter::TaxonCounter(size_t capacity) {
+    size_t slot_ct = 16;
+    while (slot_ct < capacity * 2)
+      slot_ct *= 2;
+    slot_taxa.assign(slot_ct, 0);
+    slot_counts.assign(slot_ct, 0);
+    taxa.reserve(slot_ct / 2);
+    slot_mask = slot_ct - 1;
+  }
+
+  void TaxonCounter::clear() {
+    for (size_t i = 0; i < taxa.size(); i++) {
+      uint64_t slot = (taxa[i] * 0x9e3779b97f4a7c15ull) >> 32 & slot_mask;
+      while (slot_taxa[slot]) {
+        slot_taxa[slot] = 0;
+        slot = (slot + 1) & slot_mask;
+      }
+    }
+    taxa.clear();
+  }
+
+  void TaxonCounter::add(uint32_t taxon, uint32_t count) {
+    uint64_t slot = (taxon * 0x9e3779b97f4a7c15ull) >> 32 & slot_mask;
+    while (slot_taxa[slot] != taxon) {
+      if (! slot_taxa[slot]) {
+        // Keep load factor at or below 1/2
+        if (taxa.size() * 2 >= slot_mask) {
+          grow();
+          add(taxon, count);
+          return;
+        }
+        slot_taxa[slot] = taxon;
+        slot_counts[slot] = 0;
+        taxa.push_back(taxon);
+        break;
+      }
+      slot = (slot + 1) & slot_mask;
+    }
+    slot_counts[slot] += count;
+  }
+
+  uint32_t TaxonCounter::get(uint32_t taxon) {
+    uint64_t slot = (taxon * 0x9e3779b97f4a7c15ull) >> 32 & slot_mask;
+    while (slot_taxa[slot]) {
+      if (slot_taxa[slot] == taxon)
+        return slot_counts[slot];
+      slot = (slot + 1) & slot_mask;
+    }
+    return 0;
+  }
+
+  size_t TaxonCounter::size() {
+    return taxa.size();
+  }
+
+  uint32_t TaxonCounter::taxon_at(size_t i) {
+    return taxa[i];
+  }
+
+  void TaxonCounter::grow() {
+    vector<uint32_t> old_taxa(taxa);
+    vector<uint32_t> old_counts(taxa.size());
+    for (size_t i = 0; i < taxa.size(); i++)
+      old_counts[i] = get(taxa[i]);
+    clear();
+    size_t slot_ct = (slot_mask + 1) * 2;
+    slot_taxa.assign(slot_ct, 0);
+    slot_counts.assign(slot_ct, 0);
+    taxa.reserve(slot_ct / 2);
+    slot_mask = slot_ct - 1;
+    for (size_t i = 0; i < old_taxa.size(); i++)
+      add(old_taxa[i], old_counts[i]);
+  }
+
+  // Blocks of the DFS order scanned linearly by Taxonomy::range_min()
+  static const size_t RMQ_BLOCK_SIZE = 32;
+
+  Taxonomy::Taxonomy() {
+  }
+
+  Taxonomy::Taxonomy(map<uint32_t, uint32_t> &parent_map) {
+    map<uint32_t, uint32_t>::iterator it;
+    uint32_t max_taxon = 0;
+
+    for (it = parent_map.begin(); it != parent_map.end(); it++) {
+      if (it->first > max_taxon)
+        max_taxon = it->first;
+      if (it->second > max_taxon)
+        max_taxon = it->second;
+    }
+
+    // Taxa that only appear as parents are roots of their own trees,
+    // as are taxa w/ parent 0 (or themselves); 0 is the virtual root
+    vector<uint8_t> present(max_taxon + 1, 0);
+    vector<uint32_t> parent_taxa(max_taxon + 1, 0);
+    for (it = parent_map.begin(); it != parent_map.end(); it++) {
+      present[it->first] = present[it->second] = 1;
+      if (it->second != it->first)
+        parent_taxa[it->first] = it->second;
+    }
+    present[0] = 0;
+
+    // Children lists, CSR form
+    vector<uint32_t> child_starts(max_taxon + 2, 0);
+    for (uint32_t taxon = 1; taxon <= max_taxon; taxon++)
+      if (present[taxon])
+        child_starts[parent_taxa[taxon] + 1]++;
+    for (size_t i = 1; i < child_starts.size(); i++)
+      child_starts[i] += child_starts[i - 1];
+    vector<uint32_t> children(child_starts.back());
+    vector<uint32_t> fill_pos(child_starts.begin(), child_starts.end() - 1);
+    for (uint32_t taxon = 1; taxon <= max_taxon; taxon++)
+      if (present[taxon])
+        children[fill_pos[parent_taxa[taxon]]++] = taxon;
+
+    // DFS preorder from the virtual root assigns the internal IDs, so
+    // every subtree occupies a contiguous range of IDs
+    internal_ids.assign(max_taxon + 1, 0);
+    vector< std::pair<uint32_t, uint32_t> > stack;  // (taxon, parent node)
+    stack.push_back(std::make_pair(0, 0));
+    while (! stack.empty()) {
+      uint32_t taxon = stack.back().first;
+      uint32_t parent = stack.back().second;
+      uint32_t node = external_ids.size();
+      stack.pop_back();
+      internal_ids[taxon] = node;
+      external_ids.push_back(taxon);
+      parents.push_back(parent);
+      depths.push_back(node ? depths[parent] + 1 : 0);
+      for (uint32_t i = child_starts[taxon]; i < child_starts[taxon + 1]; i++)
+        stack.push_back(std::make_pair(children[i], node));
+    }
+
+    // For u < v, LCA(u,v) = min(parents[u+1 .. v]), so parents[] is the
+    // RMQ array; block minima are kept in a sparse table
+    size_t block_ct = (parents.size() + RMQ_BLOCK_SIZE - 1) / RMQ_BLOCK_SIZE;
+    block_min.push_back(vector<uint32_t>(block_ct, ~0u));
+    for (size_t i = 0; i < parents.size(); i++)
+      if (parents[i] < block_min[0][i / RMQ_BLOCK_SIZE])
+        block_min[0][i / RMQ_BLOCK_SIZE] = parents[i];
+    for (size_t span = 2; span <= block_ct; span *= 2) {
+      vector<uint32_t> &prev = block_min.back();
+      vector<uint32_t> level(block_ct - span + 1);
+      for (size_t i = 0; i < level.size(); i++)
+        level[i] = std::min(prev[i], prev[i + span / 2]);
+      block_min.push_back(level);
+    }
+  }
+
+  // Min of parents[first .. last]
+  uint32_t Taxonomy::range_min(size_t first, size_t last) {
+    size_t first_block = first / RMQ_BLOCK_SIZE;
+    size_t last_block = last / RMQ_BLOCK_SIZE;
+    uint32_t min = ~0u;
+
+    if (first_block == last_block) {
+      for (size_t i = first; i <= last; i++)
+        min = std::min(min, parents[i]);
+      return min;
+    }
+    for (size_t i = first; i < (first_block + 1) * RMQ_BLOCK_SIZE; i++)
+      min = std::min(min, parents[i]);
+    for (size_t i = last_block * RMQ_BLOCK_SIZE; i <= last; i++)
+      min = std::min(min, parents[i]);
+    if (first_block + 1 < last_block) {
+      size_t span = last_block - first_block - 1;
+      int level = 63 - __builtin_clzll(span);
+      min = std::min(min, block_min[level][first_block + 1]);
+      min = std::min(min, block_min[level][last_block - (1ull << level)]);
+    }
+    return min;
+  }
+
+  uint32_t Taxonomy::internal_lca(uint32_t u, uint32_t v) {
+    if (u == v)
+      return u;
+    if (u > v)
+      std::swap(u, v);
+    return range_min(u + 1, v);
+  }
+
+  // LCA(0,x) = LCA(x,0) = x
+  // Taxa in different trees (or not in the taxonomy) have LCA 1
+  uint32_t Taxonomy::lca(uint32_t a, uint32_t b) {
+    if (a == 0 || b == 0)
+      return a ? a : b;
+    if (a == b)
+      return a;
+    uint32_t u = internal_id(a), v = internal_id(b);
+    if (! u || ! v)
+      return 1;
+    uint32_t node = internal_lca(u, v);
+    return node ? external_ids[node] : 1;
+  }
+
+  uint32_t Taxonomy::internal_id(uint32_t taxon) {
+    return taxon < internal_ids.size() ? internal_ids[taxon] : 0;
+  }
+
+  uint32_t Taxonomy::external_id(uint32_t node) {
+    return external_ids[node];
+  }
+
+  uint32_t Taxonomy::parent(uint32_t node) {
+    return parents[node];
+  }
+
+  uint32_t Taxonomy::depth(uint32_t node) {
+    return depths[node];
+  }
+
+  size_t Taxonomy::node_count() {
+    return external_ids.size();
+  }
+
   uint8_t KmerScanner::k = 0;
   uint64_t KmerScanner::kmer_mask = 0;
   uint32_t KmerScanner::mini_kmer_mask = 0;
+  uint8_t KmerScanner::mmer_nt = 0;
+  uint64_t KmerScanner::mmer_mask = 0;
+  uint64_t KmerScanner::mmer_xor_mask = 0;
 
   // Create a scanner for the string over the interval [start, finish)
   KmerScanner::KmerScanner(string &seq, size_t start, size_t finish) {
+    init(seq.data(), seq.size(), start, finish);
+  }
+
+  // Same, for a sequence that isn't held in a string
+  KmerScanner::KmerScanner(const char *seq, size_t len, size_t start,
+                           size_t finish)
+  {
+    init(seq, len, start, finish);
+  }
+
+  void KmerScanner::init(const char *seq, size_t len, size_t start,
+                         size_t finish)
+  {
     if (! k)
       errx(EX_SOFTWARE, "KmerScanner created w/o setting k");
-    if (finish > seq.size())
-      finish = seq.size();
+    if (finish > len)
+      finish = len;
 
     kmer = 0;
     ambig = 0;
-    str = &seq;
+    str = seq;
     curr_pos = start;
     pos1 = start;
     pos2 = finish;
     loaded_nt = 0;
+    fwd_mmer = rev_mmer = 0;
+    mmer_ct = 0;
+    window_head = window_tail = 0;
     if (pos2 - pos1 + 1 < k)
       curr_pos = pos2;
   }
@@ -144,38 +488,91 @@ namespace kraken {
     mini_kmer_mask >>= sizeof(mini_kmer_mask) * 8 - k;
   }
 
+  void KmerScanner::set_minimizer(uint8_t nt, uint64_t xor_mask) {
+    if (! k)
+      errx(EX_SOFTWARE, "KmerScanner::set_minimizer() called before set_k()");
+    if (nt > k)
+      errx(EX_SOFTWARE, "minimizer length exceeds k");
+    mmer_nt = nt;
+    mmer_mask = (1ull << (nt * 2)) - 1;
+    mmer_xor_mask = xor_mask & mmer_mask;
+  }
+
   uint64_t *KmerScanner::next_kmer() {
     if (curr_pos >= pos2)
       return NULL;
     if (loaded_nt)  
       loaded_nt--;
     while (loaded_nt < k) {
+      uint8_t code = 0;
       loaded_nt++;
       kmer <<= 2;
       ambig <<= 1;
-      switch ((*str)[curr_pos++]) {
+      switch (str[curr_pos++]) {
         case 'A': case 'a':
           break;
         case 'C': case 'c':
-          kmer |= 1;
+          code = 1;
           break;
         case 'G': case 'g':
-          kmer |= 2;
+          code = 2;
           break;
         case 'T': case 't':
-          kmer |= 3;
+          code = 3;
           break;
         default:
           ambig |= 1;
           break;
       }
+      kmer |= code;
       kmer &= kmer_mask;
       ambig &= mini_kmer_mask;
+      if (mmer_nt)
+        add_to_window(code);
     }
     return &kmer;
   }
 
+  // Slide the m-mer window forward by one nucleotide.  Ambiguous nt
+  // are coded as A, same as in the kmer itself, so the result matches
+  // KrakenDB::bin_key() for every returned kmer.
+  void KmerScanner::add_to_window(uint8_t code) {
+    fwd_mmer = ((fwd_mmer << 2) | code) & mmer_mask;
+    rev_mmer = (rev_mmer >> 2) | ((uint64_t) (3 - code) << (mmer_nt * 2 - 2));
+    if (++mmer_ct < mmer_nt)
+      return;
+
+    uint64_t key = mmer_xor_mask ^ (fwd_mmer < rev_mmer ? fwd_mmer : rev_mmer);
+    // Drop m-mers that have slid out of the kmer...
+    while (window_tail != window_head
+           && window_pos[window_head & 31] + k - mmer_nt < mmer_ct)
+      window_head++;
+    // ...and those that can no longer be the minimum
+    while (window_tail != window_head
+           && window_key[(window_tail - 1) & 31] > key)
+      window_tail--;
+    window_pos[window_tail & 31] = mmer_ct;
+    window_key[window_tail & 31] = key;
+    window_tail++;
+  }
+
   bool KmerScanner::ambig_kmer() {
     return !! ambig;
   }
+
+  uint64_t KmerScanner::bin_key() {
+    return window_key[window_head & 31];
+  }
+
+  // Oldest minimal m-mer is furthest from the kmer's low end, so its
+  // position is lowest in the rev. comp.; otherwise take the newest
+  uint64_t KmerScanner::minimizer_pos(bool rev_comp) {
+    uint32_t i = window_head;
+    if (rev_comp)
+      return k - mmer_nt - (mmer_ct - window_pos[i & 31]);
+    while (i + 1 != window_tail
+           && window_key[(i + 1) & 31] == window_key[i & 31])
+      i++;
+    return mmer_ct - window_pos[i & 31];
+  }
 }
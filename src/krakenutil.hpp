@@ -35,28 +35,174 @@ namespace kraken {
   uint32_t resolve_tree(std::map<uint32_t, uint32_t> &hit_counts,
                         std::map<uint32_t, uint32_t> &parent_map);
 
+  // Flat, array-based copy of a parent map.  Nodes are renumbered with
+  // dense internal IDs in DFS preorder (0 is a virtual root above all
+  // parentless nodes), and LCA queries are answered w/ a range-minimum
+  // query over that order, in constant time and w/o heap allocation.
+  class Taxonomy {
+    public:
+
+    Taxonomy();
+    Taxonomy(std::map<uint32_t, uint32_t> &parent_map);
+
+    // Same semantics as lca(parent_map, a, b) above
+    uint32_t lca(uint32_t a, uint32_t b);
+
+    // Internal ID for a taxon, or 0 if taxon isn't in the taxonomy
+    uint32_t internal_id(uint32_t taxon);
+    uint32_t external_id(uint32_t node);
+    uint32_t parent(uint32_t node);  // internal IDs
+    uint32_t depth(uint32_t node);
+    size_t node_count();
+
+    private:
+
+    uint32_t internal_lca(uint32_t u, uint32_t v);
+    uint32_t range_min(size_t first, size_t last);
+
+    std::vector<uint32_t> internal_ids;  // indexed by taxon
+    std::vector<uint32_t> external_ids;
+    std::vector<uint32_t> parents;
+    std::vector<uint32_t> depths;
+    // Sparse table over the minima of each RMQ_BLOCK_SIZE-sized block
+    // of parents[], level i covers 2^i blocks
+    std::vector< std::vector<uint32_t> > block_min;
+  };
+
+  uint32_t resolve_tree(std::map<uint32_t, uint32_t> &hit_counts,
+                        Taxonomy &taxonomy);
+
+  // Small open-addressing taxon -> count table, meant to be reused
+  // (via clear()) across reads; it only allocates when it has to grow
+  // past its largest size so far.  Taxon 0 can't be stored.
+  class TaxonCounter {
+    public:
+
+    TaxonCounter(size_t capacity=64);
+    void clear();  // cost is proportional to # of taxa stored
+    void add(uint32_t taxon, uint32_t count=1);
+    uint32_t get(uint32_t taxon);  // 0 if taxon absent
+    size_t size();
+    uint32_t taxon_at(size_t i);  // i-th taxon stored, i < size()
+
+    private:
+
+    void grow();
+
+    std::vector<uint32_t> slot_taxa;
+    std::vector<uint32_t> slot_counts;
+    std::vector<uint32_t> taxa;  // in insertion order
+    uint64_t slot_mask;
+  };
+
+  uint32_t resolve_tree(TaxonCounter &hit_counts, Taxonomy &taxonomy);
+
+  // Classification stats as classify reports them (and sends a server
+  // job's client): throughput, then unless partial (i.e., only
+  // hitlists were printed), the counts of classified & unclassified
+  // sequences
+  std::string classification_stats(uint64_t seq_ct, uint64_t base_ct,
+                                   uint64_t classified_ct, double seconds,
+                                   bool partial=false);
+  // Just the counts of classified & unclassified sequences
+  std::string classified_counts(uint64_t seq_ct, uint64_t classified_ct);
+
+  // Byte buffer for building output text, meant to be reused (via
+  // clear()) so that its memory is allocated only once it has grown to
+  // its working size.  Appends are defined here so they can be inlined.
+  class OutputBuffer {
+    public:
+
+    OutputBuffer(size_t capacity=0);
+    ~OutputBuffer();
+    void clear() { buf_size = 0; }
+    const char *data() { return buf; }
+    size_t size() { return buf_size; }
+
+    void append(char c) {
+      if (buf_size == buf_capacity)
+        grow(1);
+      buf[buf_size++] = c;
+    }
+    void append(const char *str, size_t len) {
+      if (buf_capacity - buf_size < len)
+        grow(len);
+      memcpy(buf + buf_size, str, len);
+      buf_size += len;
+    }
+    void append(const char *str) {
+      append(str, strlen(str));
+    }
+    // Decimal representation of n
+    void append_uint(uint64_t n) {
+      char digits[20];
+      char *p = digits + sizeof(digits);
+      do {
+        *--p = '0' + n % 10;
+        n /= 10;
+      } while (n);
+      append(p, digits + sizeof(digits) - p);
+    }
+
+    private:
+
+    OutputBuffer(const OutputBuffer &);
+    OutputBuffer &operator=(const OutputBuffer &);
+    void grow(size_t min_extra);
+
+    char *buf;
+    size_t buf_size;
+    size_t buf_capacity;
+  };
+
   class KmerScanner {
     public:
 
     KmerScanner(std::string &seq, size_t start=0, size_t finish=~0);
+    KmerScanner(const char *seq, size_t len, size_t start=0, size_t finish=~0);
     uint64_t *next_kmer();  // NULL when seq exhausted
     bool ambig_kmer();  // does last returned kmer have non-ACGT?
-
+    // bin key (scrambled minimizer) of last returned kmer;
+    // only valid if set_minimizer() has been called
+    uint64_t bin_key();
+    // position (in nt from the low end) of the first occurrence of the
+    // minimizer in the last returned kmer, or in its rev. comp. if
+    // rev_comp is set; only valid if set_minimizer() has been called
+    uint64_t minimizer_pos(bool rev_comp);
 
     static uint8_t get_k();
     // MUST be called before first invocation of KmerScanner()
     static void set_k(uint8_t n);
+    // Enables bin key tracking; nt and xor_mask should come from the
+    // DB index (see KrakenDBIndex::indexed_nt() and xor_mask())
+    static void set_minimizer(uint8_t nt, uint64_t xor_mask);
 
     private:
-    std::string *str;
+    void init(const char *seq, size_t len, size_t start, size_t finish);
+    void add_to_window(uint8_t code);
+
+    const char *str;
     size_t curr_pos, pos1, pos2;
     uint64_t kmer;  // the kmer, address is returned (don't share b/t thr.)
     uint32_t ambig; // is there an ambiguous nucleotide in the kmer?
     int64_t loaded_nt;
 
+    // Rolling minimizer state: forward & rev. comp. of the last m-mer,
+    // and a ring buffer holding a monotone deque of (position, bin key)
+    // for the m-mers in the current kmer's window (equal keys are all
+    // kept, oldest first)
+    uint64_t fwd_mmer, rev_mmer;
+    uint64_t mmer_ct;
+    uint64_t window_pos[32];
+    uint64_t window_key[32];
+    uint32_t window_head, window_tail;
+
     static uint8_t k;  // init. to 0 b/c static
     static uint64_t kmer_mask;
     static uint32_t mini_kmer_mask;
+    static uint8_t mmer_nt;
+    static uint64_t mmer_mask;
+    static uint64_t mmer_xor_mask;
   };
 }
 
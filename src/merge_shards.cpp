@@ -0,0 +1,268 @@
+/*
+ * Copyright 2013-2019, Derrick Wood, Jennifer Lu <jlu26@jhmi.edu>
+ *
+ * This file is part of the Kraken taxonomic sequence classification system.
+ *
+ * Kraken is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Kraken is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kraken.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Combines the partial outputs (classify -H) of a read set classified
+// against each shard of a DB (see db_shard) into the Kraken output an
+// unsharded DB would give.  Each k-mer is in at most one shard, so a
+// position's taxon is the one shard that found it (0 if none).
+
+#include "kraken_headers.hpp"
+#include "krakenutil.hpp"
+
+using namespace std;
+using namespace kraken;
+
+static void parse_command_line(int argc, char **argv);
+static void usage(int exit_code=EX_USAGE);
+static void parse_partial(const string &line, int shard, string &id,
+                          string &length, vector<int64_t> &codes);
+static void merge_codes(vector<int64_t> &merged, vector<int64_t> &codes,
+                        const string &id);
+static void print_result(OutputBuffer &buf, const string &id,
+                         const string &length, vector<int64_t> &codes);
+
+string Nodes_filename, Kraken_output_file;
+vector<string> Partial_filenames;
+bool Quick_mode = false;
+bool Only_classified_kraken_output = false;
+uint32_t Minimum_hit_count = 1;
+Taxonomy Taxonomy_tree;
+TaxonCounter Hit_counts;
+uint64_t total_sequences = 0, total_classified = 0;
+
+int main(int argc, char **argv) {
+  parse_command_line(argc, argv);
+  if (! Nodes_filename.empty()) {
+    map<uint32_t, uint32_t> parent_map = build_parent_map(Nodes_filename);
+    Taxonomy_tree = Taxonomy(parent_map);
+  }
+
+  size_t shard_ct = Partial_filenames.size();
+  vector<ifstream *> inputs(shard_ct);
+  for (size_t i = 0; i < shard_ct; i++) {
+    inputs[i] = new ifstream(Partial_filenames[i].c_str());
+    if (! *inputs[i])
+      err(EX_NOINPUT, "unable to open %s", Partial_filenames[i].c_str());
+  }
+  ostream *output = &cout;
+  if (! Kraken_output_file.empty())
+    output = new ofstream(Kraken_output_file.c_str());
+
+  string line, id, length, shard_id, shard_length;
+  vector<int64_t> merged, codes;
+  OutputBuffer buf;
+  while (getline(*inputs[0], line)) {
+    parse_partial(line, 0, id, length, merged);
+    for (size_t i = 1; i < shard_ct; i++) {
+      if (! getline(*inputs[i], line))
+        errx(EX_DATAERR, "%s has fewer reads than %s",
+             Partial_filenames[i].c_str(), Partial_filenames[0].c_str());
+      parse_partial(line, i, shard_id, shard_length, codes);
+      if (shard_id != id || shard_length != length)
+        errx(EX_DATAERR, "%s has read %s where %s has %s",
+             Partial_filenames[i].c_str(), shard_id.c_str(),
+             Partial_filenames[0].c_str(), id.c_str());
+      merge_codes(merged, codes, id);
+    }
+    buf.clear();
+    print_result(buf, id, length, merged);
+    output->write(buf.data(), buf.size());
+  }
+  for (size_t i = 1; i < shard_ct; i++)
+    if (getline(*inputs[i], line))
+      errx(EX_DATAERR, "%s has more reads than %s",
+           Partial_filenames[i].c_str(), Partial_filenames[0].c_str());
+  output->flush();
+
+  fprintf(stderr, "%llu sequences merged from %llu shards\n",
+          (unsigned long long) total_sequences, (unsigned long long) shard_ct);
+  fputs(classified_counts(total_sequences, total_classified).c_str(), stderr);
+  return 0;
+}
+
+// Expand a "P <id> <length> <hitlist>" line's hitlist into a code per
+// k-mer position (taxon, or -1 if ambiguous)
+static void parse_partial(const string &line, int shard, string &id,
+                          string &length, vector<int64_t> &codes)
+{
+  size_t tab1 = line.find('\t');
+  size_t tab2 = tab1 == string::npos ? tab1 : line.find('\t', tab1 + 1);
+  size_t tab3 = tab2 == string::npos ? tab2 : line.find('\t', tab2 + 1);
+  if (line.compare(0, 2, "P\t") != 0 || tab3 == string::npos)
+    errx(EX_DATAERR, "%s: not classify -H output",
+         Partial_filenames[shard].c_str());
+  id.assign(line, tab1 + 1, tab2 - tab1 - 1);
+  length.assign(line, tab2 + 1, tab3 - tab2 - 1);
+
+  codes.clear();
+  const char *p = line.c_str() + tab3 + 1;
+  while (*p) {
+    int64_t code = -1;
+    char *end;
+    if (*p == 'A')
+      p++;
+    else
+      code = strtoll(p, (char **) &p, 10);
+    if (*p++ != ':')
+      errx(EX_DATAERR, "%s: malformed hitlist for %s",
+           Partial_filenames[shard].c_str(), id.c_str());
+    uint64_t count = strtoull(p, &end, 10);
+    p = end;
+    codes.insert(codes.end(), count, code);
+    if (*p == ' ')
+      p++;
+  }
+}
+
+static void merge_codes(vector<int64_t> &merged, vector<int64_t> &codes,
+                        const string &id)
+{
+  if (codes.size() != merged.size())
+    errx(EX_DATAERR, "shards disagree on %s's k-mer count", id.c_str());
+  for (size_t i = 0; i < codes.size(); i++) {
+    if ((codes[i] < 0) != (merged[i] < 0))
+      errx(EX_DATAERR, "shards disagree on %s's ambiguous k-mers", id.c_str());
+    if (codes[i] > 0) {
+      if (merged[i] > 0)
+        errx(EX_DATAERR, "k-mer of %s found in two shards", id.c_str());
+      merged[i] = codes[i];
+    }
+  }
+}
+
+// Make the call from all of the read's k-mers, as classify would have
+static void print_result(OutputBuffer &buf, const string &id,
+                         const string &length, vector<int64_t> &codes)
+{
+  uint32_t call = 0, taxon = 0, hits = 0;
+
+  Hit_counts.clear();
+  if (Quick_mode) {
+    for (size_t i = 0; i < codes.size(); i++) {
+      taxon = codes[i] > 0 ? codes[i] : 0;
+      if (taxon && ++hits >= Minimum_hit_count)
+        break;
+    }
+    call = hits >= Minimum_hit_count ? taxon : 0;
+  }
+  else {
+    for (size_t i = 0; i < codes.size(); i++)
+      if (codes[i] > 0)
+        Hit_counts.add(codes[i]);
+    call = resolve_tree(Hit_counts, Taxonomy_tree);
+  }
+
+  total_sequences++;
+  if (call)
+    total_classified++;
+  else if (Only_classified_kraken_output)
+    return;
+  buf.append(call ? "C\t" : "U\t", 2);
+  buf.append(id.data(), id.size());
+  buf.append('\t');
+  buf.append_uint(call);
+  buf.append('\t');
+  buf.append(length.data(), length.size());
+  buf.append('\t');
+  if (Quick_mode) {
+    buf.append("Q:", 2);
+    buf.append_uint(hits);
+  }
+  else if (codes.empty()) {
+    buf.append("0:0", 3);
+  }
+  else {
+    // Run-length encoded, as in classify's hitlists
+    for (size_t i = 0; i < codes.size(); ) {
+      size_t run_end = i + 1;
+      while (run_end < codes.size() && codes[run_end] == codes[i])
+        run_end++;
+      if (i > 0)
+        buf.append(' ');
+      if (codes[i] >= 0)
+        buf.append_uint(codes[i]);
+      else
+        buf.append('A');
+      buf.append(':');
+      buf.append_uint(run_end - i);
+      i = run_end;
+    }
+  }
+  buf.append('\n');
+}
+
+static void parse_command_line(int argc, char **argv) {
+  int opt;
+  long long sig;
+
+  if (argc > 1 && strcmp(argv[1], "-h") == 0)
+    usage(0);
+  while ((opt = getopt(argc, argv, "n:o:qm:c")) != -1) {
+    switch (opt) {
+      case 'n' :
+        Nodes_filename = optarg;
+        break;
+      case 'o' :
+        Kraken_output_file = optarg;
+        break;
+      case 'q' :
+        Quick_mode = true;
+        break;
+      case 'm' :
+        sig = atoll(optarg);
+        if (sig <= 0)
+          errx(EX_USAGE, "can't use nonpositive minimum hit count");
+        Minimum_hit_count = sig;
+        break;
+      case 'c' :
+        Only_classified_kraken_output = true;
+        break;
+      default:
+        usage();
+        break;
+    }
+  }
+
+  if (Nodes_filename.empty() && ! Quick_mode) {
+    cerr << "Must specify one of -q or -n" << endl;
+    usage();
+  }
+  if (optind == argc) {
+    cerr << "No partial output files specified" << endl;
+    usage();
+  }
+  for (int i = optind; i < argc; i++)
+    Partial_filenames.push_back(argv[i]);
+}
+
+static void usage(int exit_code) {
+  cerr << "Usage: merge_shards [options] <classify -H output(s)>" << endl
+       << endl
+       << "Give one file per DB shard, each from the same reads." << endl
+       << "Options:" << endl
+       << "  -n filename      NCBI Taxonomy nodes file" << endl
+       << "  -o filename      Output file for Kraken output" << endl
+       << "  -q               Quick operation" << endl
+       << "  -m #             Minimum hit count (ignored w/o -q)" << endl
+       << "  -c               Only include classified reads in output" << endl
+       << "  -h               Print this message" << endl
+       << endl
+       << "Kraken output is to standard output by default." << endl;
+  exit(exit_code);
+}
@@ -20,13 +20,39 @@
 
 #include "kraken_headers.hpp"
 #include "quickfile.hpp"
+#ifdef HAVE_NUMA
+#include <numa.h>
+#endif
 
 using std::string;
 
 namespace kraken {
 
+int numa_node_count() {
+  #ifdef HAVE_NUMA
+  if (numa_available() >= 0)
+    return numa_num_configured_nodes();
+  #endif
+  return 1;
+}
+
+void numa_bind_thread(int node) {
+  #ifdef HAVE_NUMA
+  if (numa_run_on_node(node) != 0)
+    err(EX_OSERR, "unable to run on NUMA node %d", node);
+  numa_set_preferred(node);
+  #endif
+}
+
+int open_shared_segment(string name, int flags, mode_t mode) {
+  if (name.find('/') != string::npos)
+    return open(name.c_str(), flags, mode);
+  return shm_open(("/" + name).c_str(), flags, mode);
+}
+
 QuickFile::QuickFile() {
   valid = false;
+  numa_copy = false;
   fptr = NULL;
   filesize = 0;
   fd = -1;
@@ -71,6 +97,56 @@ void QuickFile::open_file(string filename_str, string mode, size_t size) {
   if (fptr == MAP_FAILED)
     err(EX_OSERR, "unable to mmap %s", filename);
   valid = true;
+  numa_copy = false;
+}
+
+bool QuickFile::open_shared(string segment, string member,
+                            string source_filename)
+{
+  SharedDBHeader header;
+  struct stat sb;
+
+  int seg_fd = open_shared_segment(segment, O_RDONLY);
+  if (seg_fd < 0)
+    return false;
+  if (pread(seg_fd, &header, sizeof(header), 0) != (ssize_t) sizeof(header)
+      || memcmp(header.magic, "KRAKSHM1", 8) != 0
+      || header.member_ct > SHARED_DB_MAX_MEMBERS)
+    errx(EX_DATAERR, "%s is not a Kraken DB segment", segment.c_str());
+  if (! header.complete) {
+    warnx("segment %s is still being loaded", segment.c_str());
+    close(seg_fd);
+    return false;
+  }
+
+  SharedDBMember *found = NULL;
+  for (uint64_t i = 0; i < header.member_ct; i++)
+    if (strncmp(header.members[i].name, member.c_str(), 8) == 0)
+      found = &header.members[i];
+  if (found == NULL) {
+    close(seg_fd);
+    return false;
+  }
+  if (stat(source_filename.c_str(), &sb) == 0
+      && ((uint64_t) sb.st_size != found->source_size
+          || (uint64_t) sb.st_mtim.tv_sec != found->source_mtime_sec
+          || (uint64_t) sb.st_mtim.tv_nsec != found->source_mtime_nsec)) {
+    warnx("segment %s's copy of %s is stale", segment.c_str(),
+          source_filename.c_str());
+    close(seg_fd);
+    return false;
+  }
+
+  fptr = (char *) mmap(0, found->size, PROT_READ, MAP_SHARED, seg_fd,
+                       found->offset);
+  if (fptr == MAP_FAILED)
+    err(EX_OSERR, "unable to mmap %s in segment %s", member.c_str(),
+        segment.c_str());
+  fd = seg_fd;
+  filesize = found->size;
+  valid = true;
+  numa_copy = false;
+  return true;
 }
 
 void QuickFile::load_file() {
@@ -112,6 +188,44 @@ void QuickFile::load_file() {
   }
 }
 
+// Copy file to anonymous memory on node, or interleaved if node < 0
+char *QuickFile::numa_copy_of_file(int node) {
+  #ifdef HAVE_NUMA
+  char *copy = (char *) (node < 0 ? numa_alloc_interleaved(filesize)
+                                  : numa_alloc_onnode(filesize, node));
+  if (copy == NULL)
+    errx(EX_OSERR, "unable to allocate %llu bytes of NUMA memory",
+         (unsigned long long) filesize);
+
+  // Pages are placed by the allocation's policy, not by the thread
+  // first touching them, so any thread may copy any chunk
+  const size_t chunk_size = 1 << 24;
+  #pragma omp parallel for schedule(dynamic)
+  for (size_t pos = 0; pos < filesize; pos += chunk_size) {
+    size_t this_chunk_size = filesize - pos;
+    if (this_chunk_size > chunk_size)
+      this_chunk_size = chunk_size;
+    memcpy(copy + pos, fptr + pos, this_chunk_size);
+  }
+  return copy;
+  #else
+  errx(EX_UNAVAILABLE, "NUMA placement requires building with NUMA=1");
+  return NULL;
+  #endif
+}
+
+void QuickFile::load_interleaved() {
+  char *copy = numa_copy_of_file(-1);
+  munmap(fptr, filesize);
+  fptr = copy;
+  numa_copy = true;
+}
+
+char *QuickFile::load_replica(int node) {
+  replicas.push_back(numa_copy_of_file(node));
+  return replicas.back();
+}
+
 char * QuickFile::ptr() {
   return valid ? fptr : NULL;
 }
@@ -131,8 +245,17 @@ void QuickFile::sync_file() {
 void QuickFile::close_file() {
   if (! valid)
     return;
-  sync_file();
-  munmap(fptr, filesize);
+  #ifdef HAVE_NUMA
+  for (size_t i = 0; i < replicas.size(); i++)
+    numa_free(replicas[i], filesize);
+  if (numa_copy)
+    numa_free(fptr, filesize);
+  #endif
+  replicas.clear();
+  if (! numa_copy) {
+    sync_file();
+    munmap(fptr, filesize);
+  }
   close(fd);
   valid = false;
 }
@@ -23,6 +23,31 @@
 #include "kraken_headers.hpp"
 
 namespace kraken {
+  // Number of NUMA nodes (1 if not built w/ NUMA=1 or not a NUMA system)
+  int numa_node_count();
+  // Restrict calling thread to the CPUs and memory of a NUMA node
+  void numa_bind_thread(int node);
+
+  // Header of a shared-memory segment holding copies of DB files, made
+  // by db_shm.  A segment name w/ a '/' is a file (e.g., on a hugetlbfs
+  // mount); otherwise it names a POSIX shared memory object.
+  const size_t SHARED_DB_MAX_MEMBERS = 4;
+  typedef struct {
+    char name[8];  // e.g., "kdb"
+    uint64_t offset, size;
+    // Source file's, to tell if the copy is stale
+    uint64_t source_size, source_mtime_sec, source_mtime_nsec;
+  } SharedDBMember;
+  typedef struct {
+    char magic[8];  // "KRAKSHM1"
+    uint64_t complete;  // set once all members are copied in
+    uint64_t member_ct;
+    SharedDBMember members[SHARED_DB_MAX_MEMBERS];
+  } SharedDBHeader;
+
+  // Open segment as open(2) would; returns -1 on failure
+  int open_shared_segment(std::string name, int flags, mode_t mode=0);
+
   class QuickFile {
     public:
 
@@ -30,9 +55,20 @@ namespace kraken {
     QuickFile(std::string filename, std::string mode="r", size_t size=0);
     ~QuickFile();
     void open_file(std::string filename, std::string mode="r", size_t size=0);
+    // Map member of a db_shm segment, read-only and w/o copying.
+    // Returns false if there's no such segment or member, or if it
+    // isn't a copy of source_filename's current contents; the file
+    // can be opened instead.
+    bool open_shared(std::string segment, std::string member,
+                     std::string source_filename);
     char *ptr();
     size_t size();
     void load_file();
+    // Replace read-only mapping w/ a copy whose pages are interleaved
+    // across all NUMA nodes
+    void load_interleaved();
+    // Return a copy placed on the given NUMA node, freed on close
+    char *load_replica(int node);
     void sync_file();
     void close_file();
 
@@ -42,6 +78,10 @@ namespace kraken {
     int fd;
     char *fptr;
     size_t filesize;
+    bool numa_copy;  // fptr is an anonymous NUMA copy, not a mapping
+    std::vector<char *> replicas;
+
+    char *numa_copy_of_file(int node);
   };
 }
 
@@ -0,0 +1,241 @@
+/*
+ * Copyright 2013-2019, Derrick Wood, Jennifer Lu <jlu26@jhmi.edu>
+ *
+ * This file is part of the Kraken taxonomic sequence classification system.
+ *
+ * Kraken is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Kraken is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Kraken.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Times k-mer lookups against one or more builds of the same DB
+// (e.g., w/ different db_sort layout options), using every search
+// method each build supports, and checks that all agree.
+
+#include "kraken_headers.hpp"
+#include "krakendb.hpp"
+#include "krakenutil.hpp"
+#include "quickfile.hpp"
+#include "seqreader.hpp"
+
+using namespace std;
+using namespace kraken;
+
+typedef struct {
+  string db_filename, idx_filename;
+  QuickFile db_file, idx_file;
+  KrakenDB db;
+  KrakenDBIndex idx;
+} BenchDB;
+
+void parse_command_line(int argc, char **argv);
+void usage(int exit_code=EX_USAGE);
+void read_queries(BenchDB &bdb);
+void run_bench(BenchDB &bdb, BinSearchMethod method, const char *method_name);
+string describe_layout(KrakenDB &db);
+double wall_clock_time();
+
+bool Fastq_input = false;
+int Repetitions = 3;
+size_t Max_queries = 10000000;
+string Sequence_filename;
+vector<string> DB_filenames, Index_filenames;
+
+// Queries, and results from the first DB/method, for checking others
+vector<uint64_t> Kmers, Bin_keys;
+vector<uint8_t> Mmer_pos;
+vector<uint32_t> Reference_taxa;
+
+int main(int argc, char **argv) {
+  parse_command_line(argc, argv);
+
+  vector<BenchDB> dbs(DB_filenames.size());
+  for (size_t i = 0; i < dbs.size(); i++) {
+    BenchDB &bdb = dbs[i];
+    bdb.db_filename = DB_filenames[i];
+    bdb.idx_filename = Index_filenames[i];
+    bdb.db_file.open_file(bdb.db_filename);
+    bdb.db_file.load_file();
+    bdb.db = KrakenDB(bdb.db_file.ptr());
+    bdb.idx_file.open_file(bdb.idx_filename);
+    bdb.idx_file.load_file();
+    bdb.idx = KrakenDBIndex(bdb.idx_file.ptr());
+    bdb.db.set_index(&bdb.idx);
+    if (i > 0 && (bdb.db.get_k() != dbs[0].db.get_k()
+                  || bdb.idx.indexed_nt() != dbs[0].idx.indexed_nt()))
+      errx(EX_USAGE, "%s: k or minimizer length differs from %s",
+           bdb.db_filename.c_str(), dbs[0].db_filename.c_str());
+  }
+  read_queries(dbs[0]);
+
+  printf("%zu k-mers, best of %d runs, %s kernels\n", Kmers.size(),
+         Repetitions, search_kernel());
+  printf("%-24s %-24s %-14s %10s %10s %10s\n", "database", "layout",
+         "method", "single ns", "batch ns", "hits");
+  for (size_t i = 0; i < dbs.size(); i++) {
+    if (dbs[i].db.is_eytzinger()) {
+      run_bench(dbs[i], BIN_SEARCH_BINARY, "eytzinger");
+    }
+    else {
+      run_bench(dbs[i], BIN_SEARCH_BINARY, "binary");
+      run_bench(dbs[i], BIN_SEARCH_INTERPOLATION, "interpolation");
+    }
+  }
+
+  return 0;
+}
+
+// Scan unambiguous k-mers from sequence file, as classify does
+void read_queries(BenchDB &bdb) {
+  KmerScanner::set_k(bdb.db.get_k());
+  KmerScanner::set_minimizer(bdb.idx.indexed_nt(), bdb.idx.xor_mask());
+
+  BlockSequenceReader reader(Sequence_filename, Fastq_input);
+  SequenceBatch batch;
+  while (Kmers.size() < Max_queries && reader.next_batch(batch, 1 << 20)) {
+    for (size_t i = 0; i < batch.records.size(); i++) {
+      SequenceView &dna = batch.records[i];
+      if (dna.seq_len < bdb.db.get_k())
+        continue;
+      KmerScanner scanner(dna.seq, dna.seq_len);
+      uint64_t *kmer_ptr;
+      while ((kmer_ptr = scanner.next_kmer()) != NULL
+             && Kmers.size() < Max_queries) {
+        if (scanner.ambig_kmer())
+          continue;
+        uint64_t canonical = bdb.db.canonical_representation(*kmer_ptr);
+        Kmers.push_back(canonical);
+        Bin_keys.push_back(scanner.bin_key());
+        Mmer_pos.push_back(scanner.minimizer_pos(canonical != *kmer_ptr));
+      }
+    }
+  }
+  if (Kmers.empty())
+    errx(EX_DATAERR, "no k-mers in %s", Sequence_filename.c_str());
+}
+
+void run_bench(BenchDB &bdb, BinSearchMethod method, const char *method_name) {
+  KrakenDB &db = bdb.db;
+  size_t n = Kmers.size();
+  vector<uint32_t> single_taxa(n), batch_taxa(n);
+  double single_time = 0, batch_time = 0;
+
+  db.set_search_method(method);
+  for (int rep = 0; rep < Repetitions; rep++) {
+    double start = wall_clock_time();
+    for (size_t i = 0; i < n; i++) {
+      uint32_t *val_ptr = db.kmer_query(Kmers[i], Bin_keys[i]);
+      single_taxa[i] = val_ptr ? *val_ptr : 0;
+    }
+    double elapsed = wall_clock_time() - start;
+    if (rep == 0 || elapsed < single_time)
+      single_time = elapsed;
+
+    start = wall_clock_time();
+    db.kmer_query_batch(Kmers.data(), n, batch_taxa.data(), Bin_keys.data(),
+                        db.is_compact() ? Mmer_pos.data() : NULL);
+    elapsed = wall_clock_time() - start;
+    if (rep == 0 || elapsed < batch_time)
+      batch_time = elapsed;
+  }
+
+  if (Reference_taxa.empty())
+    Reference_taxa = batch_taxa;
+  size_t hits = 0, mismatches = 0;
+  for (size_t i = 0; i < n; i++) {
+    hits += batch_taxa[i] != 0;
+    mismatches += single_taxa[i] != Reference_taxa[i];
+    mismatches += batch_taxa[i] != Reference_taxa[i];
+  }
+
+  string name = bdb.db_filename;
+  if (name.size() > 24)
+    name = "..." + name.substr(name.size() - 21);
+  printf("%-24s %-24s %-14s %10.1f %10.1f %10zu\n", name.c_str(),
+         describe_layout(db).c_str(), method_name,
+         single_time * 1e9 / n, batch_time * 1e9 / n, hits);
+  if (mismatches)
+    printf("  %zu results differ from first database's\n", mismatches);
+}
+
+string describe_layout(KrakenDB &db) {
+  string layout = db.is_split() ? "split" : "pairs";
+  if (db.is_compact())
+    layout += ",residual";
+  if (db.is_eytzinger())
+    layout += ",eytzinger";
+  if (db.get_index()->is_compressed())
+    layout += ",v3 index";
+  return layout;
+}
+
+double wall_clock_time() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+void parse_command_line(int argc, char **argv) {
+  int opt;
+  long long sig;
+
+  if (argc > 1 && strcmp(argv[1], "-h") == 0)
+    usage(0);
+  while ((opt = getopt(argc, argv, "fr:q:k:")) != -1) {
+    switch (opt) {
+      case 'f' :
+        Fastq_input = true;
+        break;
+      case 'r' :
+        sig = atoll(optarg);
+        if (sig <= 0)
+          errx(EX_USAGE, "can't use nonpositive repetition count");
+        Repetitions = sig;
+        break;
+      case 'q' :
+        sig = atoll(optarg);
+        if (sig <= 0)
+          errx(EX_USAGE, "can't use nonpositive query count");
+        Max_queries = sig;
+        break;
+      case 'k' :
+        if (! set_search_kernel(optarg))
+          errx(EX_USAGE, "unknown or unsupported search kernel: %s", optarg);
+        break;
+      default:
+        usage();
+        break;
+    }
+  }
+
+  if (argc - optind < 3 || (argc - optind) % 2 != 1)
+    usage();
+  Sequence_filename = argv[optind++];
+  for (; optind < argc; optind += 2) {
+    DB_filenames.push_back(argv[optind]);
+    Index_filenames.push_back(argv[optind + 1]);
+  }
+}
+
+void usage(int exit_code) {
+  cerr << "Usage: search_bench [options] <sequence file> <db> <idx> [<db> <idx> ...]" << endl
+       << endl
+       << "Databases must share k and minimizer length." << endl
+       << "Options:" << endl
+       << "  -f               Sequence file is in FASTQ format" << endl
+       << "  -r #             Number of timed runs (best is reported)" << endl
+       << "  -q #             Maximum number of k-mers to look up" << endl
+       << "  -k KERNEL        Key comparison kernel (scalar, avx2, avx512;" << endl
+       << "                   default: best CPU supports)" << endl
+       << "  -h               Print this message" << endl;
+  exit(exit_code);
+}
@@ -133,4 +133,363 @@ namespace kraken {
   bool FastqReader::is_valid() {
     return valid;
   }
+
+  // Non-mmap'ed input is read in chunks of at least this many bytes
+  static const size_t BLOCK_READ_SIZE = 1 << 16;
+
+  // Same characters skipped by operator>> when reading the sequence ID
+  static inline bool is_space(char c) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+  }
+
+  // Sets view's ID: first whitespace-delimited word in header
+  static void set_id(SequenceView &view) {
+    const char *end = view.header + view.header_len;
+    const char *id = view.header;
+    while (id < end && is_space(*id))
+      id++;
+    const char *id_end = id;
+    while (id_end < end && ! is_space(*id_end))
+      id_end++;
+    view.id = id;
+    view.id_len = id_end - id;
+  }
+
+  SequenceBatch::SequenceBatch() {
+    total_nt = 0;
+    data = NULL;
+    data_size = 0;
+    data_capacity = 0;
+  }
+
+  SequenceBatch::~SequenceBatch() {
+    delete[] data;
+  }
+
+  void SequenceBatch::clear() {
+    records.clear();
+    total_nt = 0;
+    data_size = 0;
+  }
+
+  // Grow buffer to hold at least size bytes, moving the views into it
+  void SequenceBatch::reserve(size_t size) {
+    if (size <= data_capacity)
+      return;
+    size_t new_capacity = data_capacity ? data_capacity : BLOCK_READ_SIZE;
+    while (new_capacity < size)
+      new_capacity *= 2;
+    char *new_data = new char[new_capacity];
+    memcpy(new_data, data, data_size);
+    for (size_t i = 0; i < records.size(); i++) {
+      SequenceView &view = records[i];
+      view.id = new_data + (view.id - data);
+      view.header = new_data + (view.header - data);
+      view.seq = new_data + (view.seq - data);
+      if (view.quals != NULL)
+        view.quals = new_data + (view.quals - data);
+    }
+    delete[] data;
+    data = new_data;
+    data_capacity = new_capacity;
+  }
+
+  BlockSequenceReader::BlockSequenceReader(string filename, bool fastq,
+                                           int thread_ct)
+  {
+    this->fastq = fastq;
+    valid = true;
+    at_eof = false;
+    decompressor = NULL;
+    map_ptr = NULL;
+    map_size = 0;
+    map_pos = 0;
+    carry = NULL;
+    carry_size = 0;
+    carry_capacity = 0;
+
+    fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+      err(EX_NOINPUT, "can't open %s", filename.c_str());
+    struct stat sb;
+    if (fstat(fd, &sb) < 0)
+      err(EX_OSERR, "unable to fstat %s", filename.c_str());
+    if (S_ISREG(sb.st_mode) && sb.st_size > 0) {
+      // Private and writable, so FASTA lines can be joined in place
+      map_size = sb.st_size;
+      map_ptr = (char *) mmap(0, map_size, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE, fd, 0);
+      if (map_ptr == MAP_FAILED)
+        err(EX_OSERR, "unable to mmap %s", filename.c_str());
+      madvise(map_ptr, map_size, MADV_SEQUENTIAL);
+      CompressionType type = detect_compression(map_ptr, map_size);
+      if (type == COMPRESSION_NONE)
+        at_eof = true;
+      else
+        decompressor = new Decompressor(type, map_ptr, map_size, thread_ct);
+    }
+    else {
+      // Check for compression, keeping what's read to be parsed
+      char prefix[DETECT_COMPRESSION_BYTES];
+      size_t prefix_len = 0;
+      while (prefix_len < DETECT_COMPRESSION_BYTES) {
+        ssize_t read_ct = read(fd, prefix + prefix_len,
+                               DETECT_COMPRESSION_BYTES - prefix_len);
+        if (read_ct < 0 && errno == EINTR)
+          continue;
+        if (read_ct < 0)
+          err(EX_IOERR, "read error");
+        if (read_ct == 0)
+          break;
+        prefix_len += read_ct;
+      }
+      CompressionType type = detect_compression(prefix, prefix_len);
+      if (type == COMPRESSION_NONE) {
+        carry = new char[prefix_len];
+        memcpy(carry, prefix, prefix_len);
+        carry_size = carry_capacity = prefix_len;
+      }
+      else {
+        decompressor = new Decompressor(type, fd, prefix, prefix_len);
+      }
+    }
+  }
+
+  BlockSequenceReader::~BlockSequenceReader() {
+    delete decompressor;
+    if (map_ptr != NULL)
+      munmap(map_ptr, map_size);
+    close(fd);
+    delete[] carry;
+  }
+
+  bool BlockSequenceReader::is_valid() {
+    return valid;
+  }
+
+  // Whether batch needs more records to be complete
+  static inline bool batch_open(SequenceBatch &batch, size_t max_nt,
+                                size_t group_size, size_t max_records)
+  {
+    size_t record_ct = batch.records.size();
+    return record_ct < max_records
+           && (batch.total_nt < max_nt || record_ct % group_size != 0);
+  }
+
+  bool BlockSequenceReader::next_batch(SequenceBatch &batch, size_t max_nt,
+                                       size_t group_size, size_t max_records)
+  {
+    SequenceView view;
+
+    batch.clear();
+    if (! valid)
+      return false;
+
+    if (map_ptr != NULL && decompressor == NULL) {
+      char *pos = map_ptr + map_pos;
+      while (batch_open(batch, max_nt, group_size, max_records)) {
+        if (parse_record(pos, map_ptr + map_size, view) != RECORD_PARSED) {
+          valid = false;
+          break;
+        }
+        batch.records.push_back(view);
+        batch.total_nt += view.seq_len;
+      }
+      map_pos = pos - map_ptr;
+      return ! batch.records.empty();
+    }
+
+    // Start w/ what the last batch left unparsed
+    batch.reserve(carry_size + BLOCK_READ_SIZE);
+    memcpy(batch.data, carry, carry_size);
+    batch.data_size = carry_size;
+    size_t parse_pos = 0;
+    while (batch_open(batch, max_nt, group_size, max_records)) {
+      char *pos = batch.data + parse_pos;
+      ParseStatus status = parse_record(pos, batch.data + batch.data_size, view);
+      if (status == RECORD_PARSED) {
+        batch.records.push_back(view);
+        batch.total_nt += view.seq_len;
+        parse_pos = pos - batch.data;
+      }
+      else if (status == RECORD_INCOMPLETE) {
+        // Grow geometrically, so long records aren't rescanned often
+        size_t unparsed = batch.data_size - parse_pos;
+        fill_buffer(batch, unparsed > BLOCK_READ_SIZE ? unparsed : BLOCK_READ_SIZE);
+      }
+      else {
+        valid = false;
+        break;
+      }
+    }
+
+    size_t unparsed = batch.data_size - parse_pos;
+    if (unparsed > carry_capacity) {
+      delete[] carry;
+      carry = new char[unparsed];
+      carry_capacity = unparsed;
+    }
+    memcpy(carry, batch.data + parse_pos, unparsed);
+    carry_size = unparsed;
+    return ! batch.records.empty();
+  }
+
+  // Append up to size bytes of input to batch's buffer
+  size_t BlockSequenceReader::fill_buffer(SequenceBatch &batch, size_t size) {
+    size_t total = 0;
+    batch.reserve(batch.data_size + size);
+    while (total < size) {
+      ssize_t read_ct;
+      if (decompressor != NULL)
+        read_ct = decompressor->read(batch.data + batch.data_size,
+                                     size - total);
+      else
+        read_ct = read(fd, batch.data + batch.data_size, size - total);
+      if (read_ct < 0) {
+        if (errno == EINTR)
+          continue;
+        err(EX_IOERR, "read error");
+      }
+      if (read_ct == 0) {
+        at_eof = true;
+        break;
+      }
+      batch.data_size += read_ct;
+      total += read_ct;
+    }
+    return total;
+  }
+
+  BlockSequenceReader::ParseStatus
+  BlockSequenceReader::parse_record(char *&pos, char *end, SequenceView &view)
+  {
+    return fastq ? parse_fastq(pos, end, view) : parse_fasta(pos, end, view);
+  }
+
+  BlockSequenceReader::ParseStatus
+  BlockSequenceReader::parse_fasta(char *&pos, char *end, SequenceView &view)
+  {
+    if (pos == end)
+      return at_eof ? INPUT_ENDED : RECORD_INCOMPLETE;
+    if (*pos != '>') {
+      warnx("malformed fasta file - expected header char > not found");
+      return INPUT_ENDED;
+    }
+    char *header_end = (char *) memchr(pos, '\n', end - pos);
+    if (header_end == NULL) {
+      if (! at_eof)
+        return RECORD_INCOMPLETE;
+      header_end = end;
+    }
+
+    // Sequence runs until next line starting w/ '>'
+    char *seq_start = header_end == end ? end : header_end + 1;
+    char *record_end = seq_start;
+    while ((record_end = (char *) memchr(record_end, '>', end - record_end))
+           != NULL)
+    {
+      if (record_end[-1] == '\n')
+        break;
+      record_end++;
+    }
+    if (record_end == NULL) {
+      if (! at_eof)
+        return RECORD_INCOMPLETE;
+      record_end = end;
+    }
+
+    view.header = pos + 1;
+    view.header_len = header_end - view.header;
+    set_id(view);
+
+    // Join sequence lines in place
+    char *seq_end = seq_start;
+    char *line = seq_start;
+    while (line < record_end) {
+      char *line_end = (char *) memchr(line, '\n', record_end - line);
+      if (line_end == NULL)
+        line_end = record_end;
+      if (seq_end != line)
+        memmove(seq_end, line, line_end - line);
+      seq_end += line_end - line;
+      line = line_end + 1;
+    }
+    view.seq = seq_start;
+    view.seq_len = seq_end - seq_start;
+    view.quals = NULL;
+    view.quals_len = 0;
+
+    if (view.seq_len == 0) {
+      warnx("malformed fasta file - zero-length record (%.*s)",
+            (int) view.id_len, view.id);
+      return INPUT_ENDED;
+    }
+    pos = record_end;
+    return RECORD_PARSED;
+  }
+
+  BlockSequenceReader::ParseStatus
+  BlockSequenceReader::parse_fastq(char *&pos, char *end, SequenceView &view)
+  {
+    char *line_start[4], *line_end[4];
+    char *line = pos;
+
+    for (int i = 0; i < 4; i++) {
+      line_start[i] = line;
+      line_end[i] = (char *) memchr(line, '\n', end - line);
+      if (line_end[i] == NULL) {
+        if (! at_eof)
+          return RECORD_INCOMPLETE;
+        line_end[i] = end;  // lines missing at EOF are empty
+        line = end;
+      }
+      else {
+        line = line_end[i] + 1;
+      }
+    }
+
+    if (line_start[0] == line_end[0])
+      return INPUT_ENDED;  // Sometimes FASTQ files have empty last lines
+    if (*line_start[0] != '@') {
+      if (*line_start[0] != '\r')
+        warnx("malformed fastq file - sequence header (%.*s)",
+              (int) (line_end[0] - line_start[0]), line_start[0]);
+      return INPUT_ENDED;
+    }
+    if (line_start[2] == line_end[2] || *line_start[2] != '+') {
+      // FastqReader reports the sequence header if the line is missing
+      int bad_line = line_start[2] == end ? 0 : 2;
+      if (line_start[2] == line_end[2] || *line_start[2] != '\r')
+        warnx("malformed fastq file - quality header (%.*s)",
+              (int) (line_end[bad_line] - line_start[bad_line]),
+              line_start[bad_line]);
+      return INPUT_ENDED;
+    }
+
+    view.header = line_start[0] + 1;
+    view.header_len = line_end[0] - view.header;
+    set_id(view);
+    view.seq = line_start[1];
+    view.seq_len = line_end[1] - line_start[1];
+    view.quals = line_start[3];
+    view.quals_len = line_end[3] - line_start[3];
+    pos = line;
+    return RECORD_PARSED;
+  }
+
+  // Length of ID w/o any "/1" or "/2" mate suffix
+  static size_t mate_id_len(const SequenceView &dna) {
+    size_t len = dna.id_len;
+    if (len >= 2 && dna.id[len - 2] == '/'
+        && (dna.id[len - 1] == '1' || dna.id[len - 1] == '2'))
+      len -= 2;
+    return len;
+  }
+
+  void check_mate_ids(const SequenceView &dna, const SequenceView &mate) {
+    size_t len = mate_id_len(dna);
+    if (len != mate_id_len(mate) || memcmp(dna.id, mate.id, len) != 0)
+      errx(EX_DATAERR, "mismatched mate pair names ('%.*s' & '%.*s')",
+           (int) dna.id_len, dna.id, (int) mate.id_len, mate.id);
+  }
 } // namespace
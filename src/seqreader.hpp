@@ -21,6 +21,7 @@
 #define SEQREADER_HPP
 
 #include "kraken_headers.hpp"
+#include "decompressor.hpp"
 
 namespace kraken {
   typedef struct {
@@ -59,6 +60,93 @@ namespace kraken {
     std::ifstream file;
     bool valid;
   };
+
+  // A record handed out by a BlockSequenceReader.  Fields point into
+  // memory owned by the reader or by the SequenceBatch holding the
+  // view; no part of the record is copied.
+  typedef struct {
+    const char *id;
+    size_t id_len;
+    const char *header;  // id + optional description
+    size_t header_len;
+    const char *seq;
+    size_t seq_len;
+    const char *quals;
+    size_t quals_len;
+  } SequenceView;
+
+  // Exit w/ an error unless mates' IDs match (ignoring any "/1" or "/2"
+  // mate suffix)
+  void check_mate_ids(const SequenceView &dna, const SequenceView &mate);
+
+  // Group of records filled by BlockSequenceReader::next_batch().  Its
+  // views remain valid until the batch is refilled; the batch's buffer
+  // (only used for non-mmap'ed input) is kept for reuse.
+  class SequenceBatch {
+    public:
+    SequenceBatch();
+    ~SequenceBatch();
+    void clear();
+
+    std::vector<SequenceView> records;
+    size_t total_nt;
+
+    private:
+    friend class BlockSequenceReader;
+    SequenceBatch(const SequenceBatch &);
+    SequenceBatch &operator=(const SequenceBatch &);
+    void reserve(size_t size);
+
+    char *data;
+    size_t data_size;
+    size_t data_capacity;
+  };
+
+  // FASTA/FASTQ reader that works on large blocks of input.  Regular
+  // files are mmap'ed and records point straight into the mapping;
+  // other inputs (e.g., pipes) are read w/ large read() calls into the
+  // batch's buffer.  Line ends are found w/ memchr(), and multi-line
+  // FASTA sequences are joined in place.  Malformed input is reported
+  // as with FastaReader/FastqReader, and ends the input.
+  //
+  // gzip, bzip2, and zstd input is detected by its magic bytes, and
+  // decompressed into the batch's buffer (using up to thread_ct
+  // threads for mmap'ed files).
+  class BlockSequenceReader {
+    public:
+    BlockSequenceReader(std::string filename, bool fastq, int thread_ct=1);
+    ~BlockSequenceReader();
+
+    // Clear batch, then add records until it holds >= max_nt bp and a
+    // multiple of group_size records (e.g., 2 for interleaved mates),
+    // or until it holds max_records records
+    // Returns false if no records were added
+    bool next_batch(SequenceBatch &batch, size_t max_nt,
+                    size_t group_size=1, size_t max_records=SIZE_MAX);
+    bool is_valid();
+
+    private:
+    BlockSequenceReader(const BlockSequenceReader &);
+    BlockSequenceReader &operator=(const BlockSequenceReader &);
+
+    enum ParseStatus { RECORD_PARSED, RECORD_INCOMPLETE, INPUT_ENDED };
+    ParseStatus parse_record(char *&pos, char *end, SequenceView &view);
+    ParseStatus parse_fasta(char *&pos, char *end, SequenceView &view);
+    ParseStatus parse_fastq(char *&pos, char *end, SequenceView &view);
+    size_t fill_buffer(SequenceBatch &batch, size_t size);
+
+    bool fastq;
+    bool valid;
+    bool at_eof;  // no more input beyond what's buffered
+    int fd;
+    Decompressor *decompressor;  // NULL if input not compressed
+    char *map_ptr;  // NULL if input not mmap'ed
+    size_t map_size;
+    size_t map_pos;
+    char *carry;  // unparsed input left from last batch
+    size_t carry_size;
+    size_t carry_capacity;
+  };
 }
 
 #endif
@@ -24,16 +24,59 @@
 #include "seqreader.hpp"
 
 #define SKIP_LEN 50000
+// Bin key bits used to split a sorted batch's updates among threads
+#define UPDATE_PARTITION_BITS 8
+// Least number of a thread's updates to a partition worth deduplicating
+// before its vector grows
+#define MIN_COMPACT_UPDATES 4096
+// Most bp of parsed sequence waiting for (or being) processed
+#define QUEUED_BP_LIMIT (64 << 20)
+// Locks for DB values that aren't 4-byte aligned (w/ compact keys),
+// which can't be updated by compare-and-swap
+#define VALUE_LOCK_CT 1024
 
 using namespace std;
 using namespace kraken;
 
+// Canonical k-mer of a reference sequence, w/ its bin key and the
+// sequence's taxon (packed into 20 bytes, as a batch holds many)
+#pragma pack(push, 4)
+typedef struct {
+  uint64_t bin_key;
+  uint64_t kmer;
+  uint32_t taxid;
+} KmerUpdate;
+#pragma pack(pop)
+
+// Sequence being added to the DB, shared by its chunks
+typedef struct {
+  string seq;
+  uint32_t taxid;
+  size_t chunks_left;
+} LcaSequence;
+
+// SKIP_LEN bp of a sequence (plus the overlap of its last k-mer)
+typedef struct {
+  LcaSequence *sequence;
+  size_t start;
+} LcaChunk;
+
 void parse_command_line(int argc, char **argv);
 void usage(int exit_code=EX_USAGE);
 void process_files();
 void process_single_file();
 void process_file(string filename, uint32_t taxid);
+void *parse_sequences(void *arg);
+void process_concurrently();
+void add_sequence(uint32_t taxid, string &seq);
 void set_lcas(uint32_t taxid, string &seq, size_t start, size_t finish);
+void update_lca(uint32_t *val_ptr, uint32_t taxid);
+void flush_batch();
+void collect_kmers(uint32_t taxid, string &seq, size_t start, size_t finish,
+                   uint64_t part_shift, vector<vector<KmerUpdate> > &updates,
+                   vector<size_t> &sorted_cts);
+void compact_updates(vector<KmerUpdate> &updates, size_t sorted_ct);
+void apply_updates(vector<KmerUpdate> &updates);
 
 int Num_threads = 1;
 string DB_filename, Index_filename, Nodes_filename,
@@ -42,9 +85,25 @@ string DB_filename, Index_filename, Nodes_filename,
 bool Allow_extra_kmers = false;
 bool Operate_in_RAM = false;
 bool One_FASTA_file = false;
-map<uint32_t, uint32_t> Parent_map;
+uint64_t Sorted_batch_size = 0;  // bp; 0 to update DB k-mer by k-mer
+Taxonomy Taxonomy_tree;
 map<string, uint32_t> ID_to_taxon_map;
 KrakenDB Database;
+// Sequences awaiting sorted updates
+vector<uint32_t> Batch_taxa;
+vector<string> Batch_seqs;
+uint64_t Batch_bp = 0;
+uint32_t Seqs_processed = 0;
+
+// Chunks passed from the parser thread to the worker threads, and
+// sequences' state, guarded by Queue_lock
+deque<LcaChunk> Chunk_queue;
+uint64_t Queued_bp = 0;  // in sequences w/ chunks not yet finished
+bool Parsing_done = false;
+pthread_mutex_t Queue_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t Chunks_queued = PTHREAD_COND_INITIALIZER;
+pthread_cond_t Sequence_finished = PTHREAD_COND_INITIALIZER;
+pthread_mutex_t Value_locks[VALUE_LOCK_CT];
 
 int main(int argc, char **argv) {
   #ifdef _OPENMP
@@ -52,7 +111,8 @@ int main(int argc, char **argv) {
   #endif
 
   parse_command_line(argc, argv);
-  Parent_map = build_parent_map(Nodes_filename);
+  map<uint32_t, uint32_t> parent_map = build_parent_map(Nodes_filename);
+  Taxonomy_tree = Taxonomy(parent_map);
 
   QuickFile db_file(DB_filename, "rw");
   Database = KrakenDB(db_file.ptr());
@@ -72,11 +132,24 @@ int main(int argc, char **argv) {
   QuickFile idx_file(Index_filename);
   KrakenDBIndex db_index(idx_file.ptr());
   Database.set_index(&db_index);
+  KmerScanner::set_minimizer(db_index.indexed_nt(), db_index.xor_mask());
 
-  if (One_FASTA_file)
-    process_single_file();
-  else
-    process_files();
+  // Sorted updates visit bins in order
+  if (Sorted_batch_size && ! Operate_in_RAM)
+    Database.advise_bins(0, (1ull << (db_index.indexed_nt() * 2)) - 1,
+                         MADV_SEQUENTIAL);
+
+  if (Sorted_batch_size) {
+    parse_sequences(NULL);
+    flush_batch();
+  }
+  else {
+    process_concurrently();
+  }
+  if (isatty(fileno(stderr))) {
+    cerr << "\r                                                       \r";
+  }
+  cerr << "Finished processing " << Seqs_processed << " sequences" << endl;
 
   if (Operate_in_RAM) {
     ofstream ofs(DB_filename.c_str(), ofstream::binary);
@@ -108,27 +181,19 @@ void process_single_file() {
 
   FastaReader reader(Multi_fasta_filename);
   DNASequence dna;
-  uint32_t seqs_processed = 0;
 
   while (reader.is_valid()) {
     dna = reader.next_sequence();
     if (! reader.is_valid())
       break;
     uint32_t taxid = ID_to_taxon_map[dna.id];
-    if (taxid) {
-      #pragma omp parallel for schedule(dynamic)
-      for (size_t i = 0; i < dna.seq.size(); i += SKIP_LEN)
-        set_lcas(taxid, dna.seq, i, i + SKIP_LEN + Database.get_k() - 1);
-    }
+    if (taxid)
+      add_sequence(taxid, dna.seq);
     if (isatty(fileno(stderr)))
-      cerr << "\rProcessed " << ++seqs_processed << " sequences";
-    else if (++seqs_processed % 500 == 0)
-      cerr << "Processed " << seqs_processed << " sequences.\n";
-  }
-  if (isatty(fileno(stderr))) {
-    cerr << "\r                                                       \r";
+      cerr << "\rProcessed " << ++Seqs_processed << " sequences";
+    else if (++Seqs_processed % 500 == 0)
+      cerr << "Processed " << Seqs_processed << " sequences.\n";
   }
-  cerr << "Finished processing " << seqs_processed << " sequences" << endl;
 }
 
 void process_files() {
@@ -137,7 +202,6 @@ void process_files() {
     err(EX_NOINPUT, "can't open %s", File_to_taxon_map_filename.c_str());
   }
   string line;
-  uint32_t seqs_processed = 0;
 
   while (map_file.good()) {
     getline(map_file, line);
@@ -150,14 +214,10 @@ void process_files() {
     iss >> taxid;
     process_file(filename, taxid);
     if (isatty(fileno(stderr)))
-      cerr << "\rProcessed " << ++seqs_processed << " sequences";
-    else if (++seqs_processed % 500 == 0)
-      cerr << "Processed " << seqs_processed << " sequences.\n";
-  }
-  if (isatty(fileno(stderr))) {
-    cerr << "\r                                                       \r";
+      cerr << "\rProcessed " << ++Seqs_processed << " sequences";
+    else if (++Seqs_processed % 500 == 0)
+      cerr << "Processed " << Seqs_processed << " sequences.\n";
   }
-  cerr << "Finished processing " << seqs_processed << " sequences" << endl;
 }
 
 void process_file(string filename, uint32_t taxid) {
@@ -167,10 +227,96 @@ void process_file(string filename, uint32_t taxid) {
   // For the purposes of this program, we assume these files are
   // single-fasta files.
   dna = reader.next_sequence();
+  add_sequence(taxid, dna.seq);
+}
 
-  #pragma omp parallel for schedule(dynamic)
-  for (size_t i = 0; i < dna.seq.size(); i += SKIP_LEN)
-    set_lcas(taxid, dna.seq, i, i + SKIP_LEN + Database.get_k() - 1);
+// Parser stage: read sequences, passing each to add_sequence()
+void *parse_sequences(void *arg) {
+  if (One_FASTA_file)
+    process_single_file();
+  else
+    process_files();
+
+  pthread_mutex_lock(&Queue_lock);
+  Parsing_done = true;
+  pthread_cond_broadcast(&Chunks_queued);
+  pthread_mutex_unlock(&Queue_lock);
+  return NULL;
+}
+
+// Sequences are parsed by one thread and split into chunks, which
+// Num_threads threads process in any order, so many (small) sequences
+// can be processed at once; DB values are updated atomically
+void process_concurrently() {
+  pthread_t parser_thread;
+
+  for (int i = 0; i < VALUE_LOCK_CT; i++)
+    pthread_mutex_init(&Value_locks[i], NULL);
+  if (pthread_create(&parser_thread, NULL, parse_sequences, NULL) != 0)
+    errx(EX_OSERR, "unable to create parser thread");
+
+  #pragma omp parallel
+  {
+    while (true) {
+      pthread_mutex_lock(&Queue_lock);
+      while (Chunk_queue.empty() && ! Parsing_done)
+        pthread_cond_wait(&Chunks_queued, &Queue_lock);
+      if (Chunk_queue.empty()) {
+        pthread_mutex_unlock(&Queue_lock);
+        break;
+      }
+      LcaChunk chunk = Chunk_queue.front();
+      Chunk_queue.pop_front();
+      pthread_mutex_unlock(&Queue_lock);
+
+      LcaSequence *sequence = chunk.sequence;
+      set_lcas(sequence->taxid, sequence->seq, chunk.start,
+               chunk.start + SKIP_LEN + Database.get_k() - 1);
+
+      pthread_mutex_lock(&Queue_lock);
+      if (--sequence->chunks_left == 0) {
+        Queued_bp -= sequence->seq.size();
+        delete sequence;
+        pthread_cond_signal(&Sequence_finished);
+      }
+      pthread_mutex_unlock(&Queue_lock);
+    }
+  }  // end parallel section
+
+  pthread_join(parser_thread, NULL);
+}
+
+// Update DB w/ a sequence's k-mers (taking the sequence's contents):
+// queue its chunks, waiting while too much sequence is queued, or w/
+// sorted updates, add it to the batch
+void add_sequence(uint32_t taxid, string &seq) {
+  if (! Sorted_batch_size) {
+    if (seq.empty())
+      return;
+    LcaSequence *sequence = new LcaSequence;
+    sequence->seq.swap(seq);
+    sequence->taxid = taxid;
+    size_t size = sequence->seq.size();
+    sequence->chunks_left = (size + SKIP_LEN - 1) / SKIP_LEN;
+
+    pthread_mutex_lock(&Queue_lock);
+    while (Queued_bp > 0 && Queued_bp + size > QUEUED_BP_LIMIT)
+      pthread_cond_wait(&Sequence_finished, &Queue_lock);
+    Queued_bp += size;
+    for (size_t i = 0; i < size; i += SKIP_LEN) {
+      LcaChunk chunk = { sequence, i };
+      Chunk_queue.push_back(chunk);
+    }
+    pthread_cond_broadcast(&Chunks_queued);
+    pthread_mutex_unlock(&Queue_lock);
+    return;
+  }
+  Batch_taxa.push_back(taxid);
+  Batch_seqs.push_back(string());
+  Batch_seqs.back().swap(seq);
+  Batch_bp += Batch_seqs.back().size();
+  if (Batch_bp >= Sorted_batch_size)
+    flush_batch();
 }
 
 void set_lcas(uint32_t taxid, string &seq, size_t start, size_t finish) {
@@ -182,7 +328,8 @@ void set_lcas(uint32_t taxid, string &seq, size_t start, size_t finish) {
     if (scanner.ambig_kmer())
       continue;
     val_ptr = Database.kmer_query(
-                Database.canonical_representation(*kmer_ptr)
+                Database.canonical_representation(*kmer_ptr),
+                scanner.bin_key()
               );
     if (val_ptr == NULL) {
       if (! Allow_extra_kmers)
@@ -190,7 +337,148 @@ void set_lcas(uint32_t taxid, string &seq, size_t start, size_t finish) {
       else
         continue;
     }
-    *val_ptr = lca(Parent_map, taxid, *val_ptr);
+    update_lca(val_ptr, taxid);
+  }
+}
+
+// Set a DB value to its LCA w/ taxid, safely w/ concurrent updates:
+// by compare-and-swap, or if the value is unaligned, under a lock
+void update_lca(uint32_t *val_ptr, uint32_t taxid) {
+  if ((uintptr_t) val_ptr % sizeof(*val_ptr) != 0) {
+    pthread_mutex_t *lock = &Value_locks[(uintptr_t) val_ptr % VALUE_LOCK_CT];
+    pthread_mutex_lock(lock);
+    *val_ptr = Taxonomy_tree.lca(taxid, *val_ptr);
+    pthread_mutex_unlock(lock);
+    return;
+  }
+  uint32_t old_val = *(volatile uint32_t *) val_ptr;
+  while (true) {
+    uint32_t new_val = Taxonomy_tree.lca(taxid, old_val);
+    if (new_val == old_val)
+      return;
+    uint32_t seen = __sync_val_compare_and_swap(val_ptr, old_val, new_val);
+    if (seen == old_val)
+      return;
+    old_val = seen;
+  }
+}
+
+static bool update_less(const KmerUpdate &a, const KmerUpdate &b) {
+  if (a.bin_key != b.bin_key)
+    return a.bin_key < b.bin_key;
+  return a.kmer < b.kmer;
+}
+
+// Apply the batch's updates in (bin key, k-mer) order.  K-mers are
+// collected in partitions by the top bits of their bin keys, each
+// thread's sorted and combined by k-mer as they grow; each partition is
+// then merged and applied by one thread, so bins are visited in order
+// and no DB value is updated by two threads.
+void flush_batch() {
+  if (Batch_seqs.empty())
+    return;
+  uint64_t key_bits = Database.get_index()->indexed_nt() * 2;
+  uint64_t part_bits = min(key_bits, (uint64_t) UPDATE_PARTITION_BITS);
+  uint64_t part_shift = key_bits - part_bits;
+  uint64_t part_ct = 1ull << part_bits;
+  int thread_ct = omp_get_max_threads();
+
+  vector<pair<size_t, size_t> > chunks;  // (sequence, start)
+  for (size_t s = 0; s < Batch_seqs.size(); s++)
+    for (size_t i = 0; i < Batch_seqs[s].size(); i += SKIP_LEN)
+      chunks.push_back(make_pair(s, i));
+
+  // Per-thread updates for each partition, w/ the number at the start
+  // of each that have been compacted
+  vector<vector<vector<KmerUpdate> > > updates(thread_ct,
+    vector<vector<KmerUpdate> >(part_ct));
+  vector<vector<size_t> > sorted_cts(thread_ct, vector<size_t>(part_ct, 0));
+  #pragma omp parallel for schedule(dynamic)
+  for (size_t c = 0; c < chunks.size(); c++) {
+    size_t s = chunks[c].first, i = chunks[c].second;
+    collect_kmers(Batch_taxa[s], Batch_seqs[s], i,
+                  i + SKIP_LEN + Database.get_k() - 1, part_shift,
+                  updates[omp_get_thread_num()],
+                  sorted_cts[omp_get_thread_num()]);
+  }
+  Batch_taxa.clear();
+  Batch_seqs.clear();
+  Batch_bp = 0;
+
+  #pragma omp parallel for schedule(dynamic)
+  for (uint64_t p = 0; p < part_ct; p++) {
+    vector<KmerUpdate> part_updates;
+    for (int t = 0; t < thread_ct; t++) {
+      vector<KmerUpdate> &thread_updates = updates[t][p];
+      compact_updates(thread_updates, sorted_cts[t][p]);
+      size_t merged_ct = part_updates.size();
+      part_updates.insert(part_updates.end(), thread_updates.begin(),
+                          thread_updates.end());
+      vector<KmerUpdate>().swap(thread_updates);
+      inplace_merge(part_updates.begin(), part_updates.begin() + merged_ct,
+                    part_updates.end(), update_less);
+    }
+    compact_updates(part_updates, part_updates.size());
+    apply_updates(part_updates);
+  }
+}
+
+void collect_kmers(uint32_t taxid, string &seq, size_t start, size_t finish,
+                   uint64_t part_shift, vector<vector<KmerUpdate> > &updates,
+                   vector<size_t> &sorted_cts)
+{
+  KmerScanner scanner(seq, start, finish);
+  uint64_t *kmer_ptr;
+
+  while ((kmer_ptr = scanner.next_kmer()) != NULL) {
+    if (scanner.ambig_kmer())
+      continue;
+    KmerUpdate update;
+    update.bin_key = scanner.bin_key();
+    update.kmer = Database.canonical_representation(*kmer_ptr);
+    update.taxid = taxid;
+    // Combine repeated k-mers rather than let the vector grow
+    uint64_t p = update.bin_key >> part_shift;
+    vector<KmerUpdate> &part = updates[p];
+    if (part.size() == part.capacity() && part.size() >= MIN_COMPACT_UPDATES) {
+      compact_updates(part, sorted_cts[p]);
+      sorted_cts[p] = part.size();
+    }
+    part.push_back(update);
+  }
+}
+
+// Sort updates, leaving one per k-mer w/ the LCA of its taxa;
+// the first sorted_ct are already sorted, so only the rest are sorted
+// and then merged w/ them
+void compact_updates(vector<KmerUpdate> &updates, size_t sorted_ct) {
+  sort(updates.begin() + sorted_ct, updates.end(), update_less);
+  inplace_merge(updates.begin(), updates.begin() + sorted_ct, updates.end(),
+                update_less);
+  size_t kept = 0;
+  for (size_t i = 0; i < updates.size(); ) {
+    KmerUpdate update = updates[i];
+    for (i++; i < updates.size() && updates[i].kmer == update.kmer
+              && updates[i].bin_key == update.bin_key; i++)
+      update.taxid = Taxonomy_tree.lca(update.taxid, updates[i].taxid);
+    updates[kept++] = update;
+  }
+  updates.resize(kept);
+}
+
+// Set each k-mer's LCA w/ its update's taxon (updates are sorted, one
+// per k-mer)
+void apply_updates(vector<KmerUpdate> &updates) {
+  for (size_t i = 0; i < updates.size(); i++) {
+    uint64_t kmer = updates[i].kmer, b_key = updates[i].bin_key;
+    uint32_t *val_ptr = Database.kmer_query(kmer, b_key);
+    if (val_ptr == NULL) {
+      if (! Allow_extra_kmers)
+        errx(EX_DATAERR, "kmer found in sequence that is not in database");
+      else
+        continue;
+    }
+    *val_ptr = Taxonomy_tree.lca(updates[i].taxid, *val_ptr);
   }
 }
 
@@ -200,7 +488,7 @@ void parse_command_line(int argc, char **argv) {
 
   if (argc > 1 && strcmp(argv[1], "-h") == 0)
     usage(0);
-  while ((opt = getopt(argc, argv, "f:d:i:t:n:m:F:xM")) != -1) {
+  while ((opt = getopt(argc, argv, "f:d:i:t:n:m:F:xMS:")) != -1) {
     switch (opt) {
       case 'f' :
         File_to_taxon_map_filename = optarg;
@@ -237,6 +525,12 @@ void parse_command_line(int argc, char **argv) {
       case 'M' :
         Operate_in_RAM = true;
         break;
+      case 'S' :
+        sig = atoll(optarg);
+        if (sig <= 0)
+          errx(EX_USAGE, "can't use nonpositive batch size");
+        Sorted_batch_size = (uint64_t) sig * 1000000;
+        break;
       default:
         usage();
         break;
@@ -266,6 +560,8 @@ void usage(int exit_code) {
        << "  -t #             Number of threads" << endl
        << "  -M               Copy DB to RAM during operation" << endl
        << "  -x               K-mers not found in DB do not cause errors" << endl
+       << "  -S #             Update DB in batches of # Mbp of sequence," << endl
+       << "                   sorted to visit DB bins in order" << endl
        << "  -f filename      File to taxon map" << endl
        << "  -F filename      Multi-FASTA file with sequence data" << endl
        << "  -m filename      Sequence ID to taxon map" << endl